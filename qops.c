@@ -1,19 +1,99 @@
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdatomic.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/futex.h>
 #include "qops.h"
 
-#define THREADSAFEQ_LOCK(q)	pthread_mutex_lock(&q->lock)
-#define THREADSAFEQ_UNLOCK(q)	pthread_mutex_unlock(&q->lock)
+#define QOPS_CACHELINE		64
+#define QOPS_ALIGN_UP(x, a)	(((x) + (a) - 1) & ~((size_t)(a) - 1))
+#define QOPS_FC_SLOTS		64
+#define QOPS_FC_SPIN		64
+#define QOPS_SPIN_MAX		128
+#define QLANE_FREE_MAX		16
+#define QOPS_MCS_DEPTH		4
+#define QARENA_REGION		((size_t)2 << 20)
+#define QARENA_CLASSES		29	/* Size classes below a region: 64, 128, 192, 256, 384, ... 1.5M bytes. */
+#define QARENA_STACK		QARENA_REGION
+#define QSPILL_SEG		((size_t)4 << 20)
+#define QSPILL_SKIP		UINT32_MAX
+#define QSPILL_DEFDEPTH		64	/* Buffers of nodes in memory before spilling. */
+#define QSHM_MAGIC		0x324d485373706f71ULL
+#define QSHM_WORD		UINT32_MAX
+#define QSHM_SKIP		(UINT32_MAX - 1)
+#define QKEYS_MIN		64
+#define QCLASS_HASH_BITS	13	/* Class index at most half full with QCLASS_MAX classes. */
+#define QPRIO_QUANTUM		1000	/* Default CPU microseconds per round of a fair tenant. */
+#define QPRIO_PERIOD		1000000	/* Default quota period in microseconds. */
 
-int
-qnode_exec(struct qnode *node)
+#if defined(__x86_64__) || defined(__i386__)
+# define QOPS_CPU_RELAX()	__builtin_ia32_pause()
+#elif defined(__aarch64__)
+# define QOPS_CPU_RELAX()	__asm__ __volatile__("yield")
+#else
+# define QOPS_CPU_RELAX()	((void)0)
+#endif
+
+#define THREADSAFEQ_LOCK(l)	qlock_acquire(&(l)->lock)
+#define THREADSAFEQ_TRYLOCK(l)	qlock_try(&(l)->lock)
+#define THREADSAFEQ_UNLOCK(l)	qlock_release(&(l)->lock)
+
+static uint64_t
+qops_now_usec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+/* CPU time of the calling thread in nanoseconds. */
+static uint64_t
+qops_cpu_nsec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+uint64_t
+qnode_deadline(size_t usec)
+{
+	return (qops_now_usec() + usec);
+}
+
+/* A task past its deadline only gets its err and cleanup. */
+static int
+qnode_expire(struct qnode *node)
+{
+	if (node->err)
+		node->err(node->data, THREADSAFEQ_EEXPIRED);
+	if (node->cleanup)
+		node->cleanup(node->data);
+	return (THREADSAFEQ_EEXPIRED);
+}
+
+static int
+qnode_run(struct qnode *node)
 {
 	int	ret;
 
@@ -29,40 +109,441 @@ qnode_exec(struct qnode *node)
 	return (ret);
 }
 
+int
+qnode_exec(struct qnode *node)
+{
+	if (node->deadline && node->deadline <= qops_now_usec())
+		return (qnode_expire(node));
+	return (qnode_run(node));
+}
+
+/*
+ * Task classes. A (func, err, cleanup) triple is interned once and compact
+ * queues store its index next to the data pointer. Entries are never
+ * removed, so readers only need the published count, and find a triple
+ * through a hash index instead of scanning the table.
+ */
+struct qclass
+{
+	int	(*func)(void *data);
+	void	(*err)(void *data, int errcode);
+	void	(*cleanup)(void *data);
+	_Atomic(const struct qclass_codec *)	codec;
+};
+
+/* Slot of a compact queue. */
+struct qcnode
+{
+	void	*data;
+	size_t	cls;
+};
+
+/*
+ * Inline payload area behind the slots of a buffer. Payloads are carved
+ * from it in order. The buffer is freed once its lane has drained it and
+ * every payload carved from it has been cleaned up, whichever comes last.
+ */
+struct qinline_area
+{
+	_Alignas(max_align_t) _Atomic size_t	refs;
+	size_t					used;
+	size_t					cap;
+	struct qnode_buff			*buff;
+	const struct qops_allocator		*alloc;
+	size_t					bytes;
+};
+
+/* Header in front of each inline payload. */
+struct qinline
+{
+	struct qinline_area	*area;
+	void			(*cleanup)(void *data);
+};
+
+static struct qclass		qclass_tab[QCLASS_MAX];
+static _Atomic size_t		qclass_cnt = 0;
+/* Open addressing index of qclass_tab: class id + 1, 0 for an empty entry. */
+static _Atomic uint16_t		qclass_hash[(size_t)1 << QCLASS_HASH_BITS];
+static pthread_mutex_t		qclass_lock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local static size_t	qclass_last = SIZE_MAX;
+/* Lane whose lock the calling thread holds between reserve and commit of an inline slot. */
+_Thread_local static struct qlane	*qlane_slot_held = NULL;
+/* Shared ring cell claimed by the calling thread between reserve and commit. */
+_Thread_local static struct qshm_cell	*qshm_slot_held = NULL;
+/* Last fair pick of this thread, settled by qprio_charge(). */
+_Thread_local static struct threadsafeq	*qprio_taken_q = NULL;
+_Thread_local static size_t		qprio_taken_level = 0;
+_Thread_local static uint64_t		qprio_taken_ns = 0;
+
+/* Fibonacci hash of the (func, err, cleanup) triple of `node`. */
+static size_t
+qclass_hash_of(const struct qnode *node)
+{
+	uint64_t	h;
+
+	h = (uint64_t)(uintptr_t)node->func * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (uint64_t)(uintptr_t)node->err) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (uint64_t)(uintptr_t)node->cleanup) * 0x9e3779b97f4a7c15ULL;
+	return ((size_t)(h >> (64 - QCLASS_HASH_BITS)));
+}
+
+/*
+ * Linear probing of the class index. Entries are published after their
+ * class and never change, so readers take no lock.
+ */
+static size_t
+qclass_find(const struct qnode *node)
+{
+	struct qclass	*cls;
+	size_t		i;
+	size_t		e;
+
+	i = qclass_last;
+	if (i < atomic_load_explicit(&qclass_cnt, memory_order_acquire) && qclass_tab[i].func == node->func
+		&& qclass_tab[i].err == node->err && qclass_tab[i].cleanup == node->cleanup)
+		return (i);
+	i = qclass_hash_of(node);
+	while ((e = atomic_load_explicit(&qclass_hash[i], memory_order_acquire)))
+	{
+		cls = qclass_tab + e - 1;
+		if (cls->func == node->func && cls->err == node->err && cls->cleanup == node->cleanup)
+		{
+			qclass_last = e - 1;
+			return (e - 1);
+		}
+		i = (i + 1) & (((size_t)1 << QCLASS_HASH_BITS) - 1);
+	}
+	return (SIZE_MAX);
+}
+
+/* Index of the class of `node`, registered on first use. SIZE_MAX if the table is full. */
+static size_t
+qclass_of(const struct qnode *node)
+{
+	size_t	i;
+	size_t	n;
+
+	i = qclass_find(node);
+	if (i != SIZE_MAX)
+		return (i);
+	pthread_mutex_lock(&qclass_lock);
+	i = qclass_find(node);
+	n = atomic_load(&qclass_cnt);
+	if (i == SIZE_MAX && n < QCLASS_MAX)
+	{
+		qclass_tab[n] = (struct qclass){.func = node->func, .err = node->err, .cleanup = node->cleanup};
+		i = qclass_hash_of(node);
+		while (atomic_load_explicit(&qclass_hash[i], memory_order_relaxed))
+			i = (i + 1) & (((size_t)1 << QCLASS_HASH_BITS) - 1);
+		atomic_store_explicit(&qclass_hash[i], (uint16_t)(n + 1), memory_order_release);
+		atomic_store_explicit(&qclass_cnt, n + 1, memory_order_release);
+		qclass_last = n;
+		i = n;
+	}
+	pthread_mutex_unlock(&qclass_lock);
+	return (i);
+}
+
+int
+qclass_register(int (*func)(void *data), void (*err)(void *data, int errcode), void (*cleanup)(void *data))
+{
+	size_t	i;
+
+	i = qclass_of(&(struct qnode){.func = func, .err = err, .cleanup = cleanup});
+	return (i == SIZE_MAX ? -1 : (int)i);
+}
+
+int
+qclass_set_codec(int cls, const struct qclass_codec *codec)
+{
+	if (cls < 0 || (size_t)cls >= atomic_load_explicit(&qclass_cnt, memory_order_acquire)
+		|| (codec && (!codec->encode || !codec->decode)))
+		return (-1);
+	atomic_store_explicit(&qclass_tab[cls].codec, codec, memory_order_release);
+	return (0);
+}
+
+/*
+ * Default allocator. Callers pass the size and alignment back on free, as
+ * std::pmr::memory_resource needs them.
+ */
+static void *
+qops_std_alloc(void *ctx, size_t size, size_t align)
+{
+	(void)ctx;
+	if (align <= _Alignof (max_align_t))
+		return (malloc(size));
+	return (aligned_alloc(align, QOPS_ALIGN_UP(size, align)));
+}
+
+static void
+qops_std_free(void *ctx, void *ptr, size_t size, size_t align)
+{
+	(void)ctx;
+	(void)size;
+	(void)align;
+	free(ptr);
+}
+
+static const struct qops_allocator	qops_std_allocator = {.alloc = qops_std_alloc, .free = qops_std_free, .ctx = NULL};
+
+static void *
+qops_alloc(const struct qops_allocator *a, size_t size, size_t align)
+{
+	return (a->alloc(a->ctx, size, align));
+}
+
+static void
+qops_free(const struct qops_allocator *a, void *ptr, size_t size, size_t align)
+{
+	if (ptr)
+		a->free(a->ctx, ptr, size, align);
+}
+
+/*
+ * Process wide arena of 2M pages for the buffers of queues created with
+ * THREADSAFEQ_ARENA_CHUNKS and the worker stacks of THREADSAFEQ_ARENA_STACKS.
+ * Regions are mapped with MAP_HUGETLB, or 2M aligned and madvise()d for
+ * transparent huge pages when no huge page is reserved. Sizes are rounded
+ * to a size class (a cache line, then powers of two and their midpoints),
+ * blocks are carved in order and freed blocks are kept per class for reuse;
+ * the regions stay mapped. When a region runs out, its tail is cut into
+ * blocks of the classes that fit. A block of a region or more gets a mapping
+ * of its own, returned to the system when freed. Lanes recycle their
+ * buffers first, so the arena lock is cold. Blocks are cache line aligned.
+ */
+static pthread_mutex_t		qarena_lock = PTHREAD_MUTEX_INITIALIZER;
+static char			*qarena_cur = NULL;
+static size_t			qarena_left = 0;
+static void			*qarena_freev[QARENA_CLASSES];
+
+static void *
+qarena_map(size_t sz)
+{
+	char	*p;
+	size_t	off;
+
+	p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return (p);
+	p = mmap(NULL, sz + QARENA_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return (NULL);
+	off = QOPS_ALIGN_UP((uintptr_t)p, QARENA_REGION) - (uintptr_t)p;
+	if (off)
+		munmap(p, off);
+	munmap(p + off + sz, QARENA_REGION - off);
+	p += off;
+	madvise(p, sz, MADV_HUGEPAGE);
+	return (p);
+}
+
+/* Bytes of the blocks of class `i`. */
+static size_t
+qarena_class_sz(size_t i)
+{
+	size_t	p;
+
+	if (!i)
+		return (QOPS_CACHELINE);
+	p = (size_t)QOPS_CACHELINE << ((i + 2) / 2);
+	return (i % 2 ? p : p - p / 4);
+}
+
+/* Rounds `*sz` up to its class and returns the class, SIZE_MAX for a block of a region or more. */
+static size_t
+qarena_class(size_t *sz)
+{
+	size_t	i;
+
+	i = 0;
+	while (qarena_class_sz(i) < *sz)
+		++i;
+	*sz = qarena_class_sz(i);
+	if (*sz >= QARENA_REGION)
+	{
+		*sz = QOPS_ALIGN_UP(*sz, QARENA_REGION);
+		return (SIZE_MAX);
+	}
+	return (i);
+}
+
+/* Arena lock held. Cuts the tail of the current region into blocks of the largest classes that fit. */
+static void
+qarena_retire_tail(void)
+{
+	size_t	i;
+
+	i = QARENA_CLASSES;
+	while (i-- && qarena_left >= QOPS_CACHELINE)
+	{
+		while (qarena_class_sz(i) <= qarena_left)
+		{
+			*(void **)(void *)qarena_cur = qarena_freev[i];
+			qarena_freev[i] = qarena_cur;
+			qarena_cur += qarena_class_sz(i);
+			qarena_left -= qarena_class_sz(i);
+		}
+	}
+}
+
+static void *
+qarena_alloc(void *ctx, size_t sz, size_t align)
+{
+	void	*p;
+	size_t	i;
+
+	(void)ctx;
+	if (align > QOPS_CACHELINE)
+		return (NULL);
+	i = qarena_class(&sz);
+	if (i == SIZE_MAX)
+		return (qarena_map(sz));
+	pthread_mutex_lock(&qarena_lock);
+	if ((p = qarena_freev[i]))
+	{
+		qarena_freev[i] = *(void **)p;
+		pthread_mutex_unlock(&qarena_lock);
+		return (p);
+	}
+	if (qarena_left < sz)
+	{
+		p = qarena_map(QARENA_REGION);
+		if (!p)
+		{
+			pthread_mutex_unlock(&qarena_lock);
+			return (NULL);
+		}
+		qarena_retire_tail();
+		qarena_cur = p;
+		qarena_left = QARENA_REGION;
+	}
+	p = qarena_cur;
+	qarena_cur += sz;
+	qarena_left -= sz;
+	pthread_mutex_unlock(&qarena_lock);
+	return (p);
+}
+
+static void
+qarena_free(void *ctx, void *p, size_t sz, size_t align)
+{
+	size_t	i;
+
+	(void)ctx;
+	(void)align;
+	i = qarena_class(&sz);
+	if (i == SIZE_MAX)
+	{
+		munmap(p, sz);
+		return ;
+	}
+	pthread_mutex_lock(&qarena_lock);
+	*(void **)p = qarena_freev[i];
+	qarena_freev[i] = p;
+	pthread_mutex_unlock(&qarena_lock);
+}
+
+static const struct qops_allocator	qarena_allocator = {.alloc = qarena_alloc, .free = qarena_free, .ctx = NULL};
+
+static size_t
+qnode_buff_slots(size_t size, int compact)
+{
+	return (QOPS_ALIGN_UP(sizeof (struct qnode_buff) + (compact ? sizeof (struct qcnode) : sizeof (struct qnode)) * size,
+		_Alignof (max_align_t)));
+}
+
+static struct qinline_area *
+qnode_buff_area(struct qnode_buff *qbuff, int compact)
+{
+	return ((struct qinline_area *)(void *)((char *)qbuff + qnode_buff_slots(qbuff->sz, compact)));
+}
+
+static size_t
+qnode_buff_bytes(size_t size, int compact, size_t inline_sz)
+{
+	if (!inline_sz)
+		return (sizeof (struct qnode_buff) + ((compact ? sizeof (struct qcnode) : sizeof (struct qnode)) * size));
+	return (qnode_buff_slots(size, compact) + sizeof (struct qinline_area) + inline_sz * size);
+}
+
+/* `inline_sz` payload bytes per slot are appended behind the slots. */
 static struct qnode_buff *
-qnode_buff_new(size_t size)
+qnode_buff_new(size_t size, int compact, size_t inline_sz, const struct qops_allocator *a)
 {
 	struct qnode_buff	*qbuff;
+	struct qinline_area	*area;
 
 	if (!size)
 		size = QNODE_BUFF_DEFSIZE;
-	qbuff = malloc(sizeof (*qbuff) + (sizeof (struct qnode) * size));
+	qbuff = qops_alloc(a, qnode_buff_bytes(size, compact, inline_sz), _Alignof (max_align_t));
 	if (!qbuff)
 		return (NULL);
 	qbuff->sz = size;
 	qbuff->ri = 0;
 	qbuff->wi = 0;
 	qbuff->next = NULL;
+	if (inline_sz)
+	{
+		area = qnode_buff_area(qbuff, compact);
+		atomic_init(&area->refs, 1);
+		area->used = 0;
+		area->cap = inline_sz * size;
+		area->buff = qbuff;
+		area->alloc = a;
+		area->bytes = qnode_buff_bytes(size, compact, inline_sz);
+	}
 	return (qbuff);
 }
 
 static void
-qnode_buff_delete(struct qnode_buff *qbuff)
+qinline_unref(struct qinline_area *area)
+{
+	if (atomic_fetch_sub(&area->refs, 1) == 1)
+		qops_free(area->alloc, area->buff, area->bytes, _Alignof (max_align_t));
+}
+
+/* Cleanup of every inline task: the user's cleanup, then the buffer reference. */
+static void
+qinline_cleanup(void *data)
+{
+	struct qinline		*hdr;
+	struct qinline_area	*area;
+
+	hdr = (struct qinline *)data - 1;
+	area = hdr->area;
+	if (hdr->cleanup)
+		hdr->cleanup(data);
+	qinline_unref(area);
+}
+
+/* Runs the cleanup of the nodes left in `qbuff`. */
+static void
+qnode_buff_clear(struct qnode_buff *qbuff, int compact)
 {
 	struct qnode	*node;
+	struct qcnode	*slot;
+
 	if (!qbuff)
 		return ;
 	while (qbuff->ri < qbuff->wi)
 	{
+		if (compact)
+		{
+			slot = (struct qcnode *)(void *)qbuff->nodev + qbuff->ri++;
+			if (qclass_tab[slot->cls].cleanup)
+				qclass_tab[slot->cls].cleanup(slot->data);
+			continue ;
+		}
 		node = qbuff->nodev + qbuff->ri++;
 		if (node->cleanup)
 			node->cleanup(node->data);
 	}
-	free(qbuff);
 }
 
 struct qbuff *
-qbuff_new(size_t size, int (*func)(void *data), void (*err)(void *data, int errorcode), void (*cleanup)(void *data))
+qbuff_new_alloc(size_t size, int (*func)(void *data), void (*err)(void *data, int errorcode),
+	void (*cleanup)(void *data), const struct qops_allocator *alloc)
 {
 	struct qbuff	*qbuff;
 
@@ -70,9 +551,12 @@ qbuff_new(size_t size, int (*func)(void *data), void (*err)(void *data, int erro
 		return (NULL);
 	if (!size)
 		size = QNODE_BUFF_DEFSIZE;
-	qbuff = malloc(sizeof (*qbuff) + (sizeof (void *) * size));
+	if (!alloc)
+		alloc = &qops_std_allocator;
+	qbuff = qops_alloc(alloc, sizeof (*qbuff) + (sizeof (void *) * size), _Alignof (struct qbuff));
 	if (!qbuff)
 		return (NULL);
+	qbuff->alloc = alloc;
 	qbuff->func = func;
 	qbuff->err = err;
 	qbuff->cleanup = cleanup;
@@ -104,7 +588,13 @@ qbuff_delete(struct qbuff *qbuff)
 	if (!qbuff)
 		return ;
 	qbuff_clear(qbuff);
-	free(qbuff);
+	qops_free(qbuff->alloc, qbuff, sizeof (*qbuff) + (sizeof (void *) * qbuff->sz), _Alignof (struct qbuff));
+}
+
+struct qbuff *
+qbuff_new(size_t size, int (*func)(void *data), void (*err)(void *data, int errorcode), void (*cleanup)(void *data))
+{
+	return (qbuff_new_alloc(size, func, err, cleanup, NULL));
 }
 
 int
@@ -133,16 +623,322 @@ qbuff_write(struct qbuff *qbuff, void *data)
 
 
 
+
+struct threadsafeq_ops
+{
+	int	(*append)(struct threadsafeq *q, struct qnode *node);
+	int	(*append_batch)(struct threadsafeq *q, struct qnode *nodev, size_t n);
+	int	(*remove)(struct threadsafeq *q, struct qnode *node);
+	int	(*reserve)(struct threadsafeq *q, size_t n);
+	size_t	(*remove_batch)(struct threadsafeq *q, struct qnode *nodev, size_t n);
+	size_t	(*size)(struct threadsafeq *q);
+	void	(*delete)(struct threadsafeq *q);
+};
+
+#define QSEG_EMPTY	0
+#define QSEG_BUSY	1
+#define QSEG_FULL	2
+#define QSEG_TAKEN	3
+
+struct qebr_node
+{
+	struct qebr_node	*next;
+	void			(*free)(struct qebr_node *node);
+	const void		*owner;
+};
+
+struct qseg_cell
+{
+	_Atomic int		state;
+	struct qnode		node;
+};
+
+struct qseg
+{
+	struct qebr_node			retire;
+	const struct qops_allocator		*alloc;
+	size_t					sz;
+	_Alignas(QOPS_CACHELINE) _Atomic size_t	wi;
+	_Alignas(QOPS_CACHELINE) _Atomic size_t	ri;
+	_Alignas(QOPS_CACHELINE) _Atomic(struct qseg *)	next;
+	struct qseg_cell			cellv[];
+};
+
+struct qseg_list
+{
+	_Alignas(QOPS_CACHELINE) _Atomic(struct qseg *)	head;
+	_Alignas(QOPS_CACHELINE) _Atomic(struct qseg *)	tail;
+};
+
+struct qring_cell
+{
+	_Atomic size_t		seq;
+	struct qnode		node;
+};
+
+struct qring
+{
+	_Alignas(QOPS_CACHELINE) _Atomic size_t	wpos;
+	_Alignas(QOPS_CACHELINE) _Atomic size_t	rpos;
+	_Alignas(QOPS_CACHELINE) size_t		mask;
+	struct qring_cell			cellv[];
+};
+
+/* Cell of a shared ring, followed by its inline payload. */
+struct qshm_cell
+{
+	_Alignas(max_align_t) _Atomic size_t	seq;
+	uint64_t				word;
+	uint32_t				cls;
+	uint32_t				len;
+	uint64_t				deadline;
+};
+
+/* Head of a shared segment, the cells follow on the next cache line. */
+struct qshm
+{
+	uint64_t				magic;
+	size_t					mask;
+	size_t					cell_sz;
+	size_t					bytes;
+	size_t					nof_class;
+	_Alignas(QOPS_CACHELINE) _Atomic size_t	wpos;
+	_Alignas(QOPS_CACHELINE) _Atomic size_t	rpos;
+	_Alignas(QOPS_CACHELINE) _Atomic int	bell;
+	_Atomic int				sleeping;
+};
+
+struct qprio
+{
+	_Alignas(QOPS_CACHELINE) _Atomic uint64_t	map;
+	int						policy;
+	uint64_t					aging_usec;
+	size_t						weightv[THREADSAFEQ_PRIO_MAX];
+	_Atomic size_t					creditv[THREADSAFEQ_PRIO_MAX];
+	_Atomic uint64_t				sincev[THREADSAFEQ_PRIO_MAX];
+	size_t						nof_level;
+	int64_t						quantum_ns;
+	uint64_t					period_usec;
+	int						quota_on;
+	uint64_t					quotav[THREADSAFEQ_PRIO_MAX];
+	_Atomic int64_t					deficitv[THREADSAFEQ_PRIO_MAX];
+	_Atomic uint64_t				estv[THREADSAFEQ_PRIO_MAX];
+	_Atomic uint64_t				usedv[THREADSAFEQ_PRIO_MAX];
+	_Atomic uint64_t				cpuv[THREADSAFEQ_PRIO_MAX];
+	_Atomic uint64_t				period_start;
+	_Atomic size_t					cursor;
+	_Atomic size_t					round;
+};
+
+struct qspsc
+{
+	_Alignas(QOPS_CACHELINE) _Atomic size_t	head;
+	size_t					cached_tail;
+	_Alignas(QOPS_CACHELINE) _Atomic size_t	tail;
+	size_t					cached_head;
+	_Alignas(QOPS_CACHELINE) size_t		mask;
+	struct qnode				nodev[];
+};
+
+_Thread_local static int workerp_local_index = -1;
+_Thread_local static size_t qops_thread_id = SIZE_MAX;
+static _Atomic size_t qops_thread_cnt = 0;
+
+struct qmcs_node
+{
+	_Atomic(struct qmcs_node *)	next;
+	_Atomic int			locked;
+};
+
+struct qlock
+{
+	int	kind;
+	union
+	{
+		pthread_mutex_t	mutex;
+		struct
+		{
+			_Atomic(struct qmcs_node *)	tail;
+			struct qmcs_node		*owner;
+		}	mcs;
+		struct
+		{
+			_Atomic unsigned	next;
+			_Atomic unsigned	serving;
+		}	ticket;
+		_Atomic int	futex;
+	}	u;
+};
+
+/*
+ * Memory held by a queue. Buffers and segments are charged when they join
+ * the queue and uncharged when they leave it, which for buffers kept alive
+ * by inline payloads is before they are freed.
+ */
+struct qmem
+{
+	_Atomic size_t	bytes;
+	_Atomic size_t	peak;
+	_Atomic size_t	chunks;
+};
+
+static void
+qmem_charge(struct qmem *m, size_t bytes, size_t chunks)
+{
+	size_t	now;
+	size_t	peak;
+
+	now = atomic_fetch_add_explicit(&m->bytes, bytes, memory_order_relaxed) + bytes;
+	atomic_fetch_add_explicit(&m->chunks, chunks, memory_order_relaxed);
+	peak = atomic_load_explicit(&m->peak, memory_order_relaxed);
+	while (peak < now && !atomic_compare_exchange_weak(&m->peak, &peak, now))
+		;
+}
+
+static void
+qmem_uncharge(struct qmem *m, size_t bytes, size_t chunks)
+{
+	atomic_fetch_sub_explicit(&m->bytes, bytes, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&m->chunks, chunks, memory_order_relaxed);
+}
+
+/*
+ * Spill file of a lane. Once the lane holds `depth` nodes, nodes of task
+ * classes with a codec are encoded into the fixed size segments of an
+ * unlinked file, through a shared mapping of the segment being written.
+ * Consumers map the segments in the same order and punch them out of the
+ * file once read. Nodes spilled are not counted in the lane's `n` until
+ * they are read back. Everything but `count` is under the lane lock.
+ * With a capacity, records keep the weight of their task, and the weight of
+ * a task dropped on read is added to `dropped` for the next remove to release.
+ */
+struct qspill
+{
+	int				fd;
+	size_t				depth;
+	size_t				low;
+	_Atomic size_t			count;
+	_Atomic size_t			*dropped;
+	size_t				(*weigh)(const struct qnode *node);
+	char				*wmap;
+	size_t				wseg;
+	size_t				woff;
+	char				*rmap;
+	size_t				rseg;
+	size_t				roff;
+	const struct qops_allocator	*alloc;
+};
+
+/*
+ * Record of a spilled node, followed by `len` bytes of payload padded to 8.
+ * The codec that encoded it decodes it, whatever the class has set since.
+ */
+struct qspill_rec
+{
+	uint32_t			len;
+	uint32_t			cls;
+	uint64_t			deadline;
+	const struct qclass_codec	*codec;
+	uint64_t			weight;
+};
+
+/*
+ * Index of the keyed nodes of a lane. Every node pushed takes the next
+ * position and pops count up in the same order, so an entry is still
+ * pending while its position is not below `popped`. Entries of popped nodes
+ * are left in place and dropped when the table is rebuilt.
+ */
+struct qkey_ent
+{
+	uint64_t		key;
+	size_t			pos;
+	struct qnode_buff	*buff;	/* NULL for an empty entry. */
+	size_t			i;
+};
+
+struct qkeys
+{
+	struct qkey_ent			*entv;
+	size_t				bits;
+	size_t				used;
+	size_t				pushed;
+	size_t				popped;
+	const struct qops_allocator	*alloc;
+	struct qmem			*mem;
+};
+
+struct qlane
+{
+	_Alignas(QOPS_CACHELINE) struct qlock	lock;
+	struct qnode_buff			*head;
+	struct qnode_buff			*tail;
+	struct qnode_buff			*free;
+	size_t					nof_free;
+	size_t					max_free;
+	size_t					chunk_sz;
+	size_t					chunk_min;
+	size_t					chunk_max;
+	int					compact;
+	size_t					inline_sz;
+	const struct qops_allocator		*alloc;
+	struct qmem				*mem;
+	struct qspill				*spill;
+	struct qkeys				*keys;
+	size_t					held;		/* Nodes in the buffers, reserved or not. */
+	size_t					nof_linked;	/* Buffers from head to tail and their bytes. */
+	size_t					linked_bytes;
+	_Atomic size_t				n;
+};
+
+#define QFC_FREE	0
+#define QFC_CLAIMED	1
+#define QFC_APPEND	2
+#define QFC_REMOVE	3
+#define QFC_DONE	4
+#define QFC_APPEND_BATCH	5
+#define QFC_REMOVE_BATCH	6
+
+struct qfc_slot
+{
+	_Alignas(QOPS_CACHELINE) _Atomic int	op;
+	int					ret;
+	struct qnode				node;
+	struct qnode				*nodev;
+	size_t					nof_node;
+};
+
 struct threadsafeq
 {
+	const struct threadsafeq_ops	*ops;
 	pthread_mutex_t		lock;
-	struct qnode_buff	*head;
-	struct qnode_buff	*tail;
-	void	(*on_append)(void *);
+	struct qlane		*lanev;
+	size_t			nof_lane;
+	struct qring		*ring;
+	struct qseg_list	*lf;
+	struct qspsc		*spsc;
+	struct qfc_slot		*fc;
+	struct qprio		*prio;
+	void			*(*coalesce)(void *pending, void *incoming);
+	struct qshm		*shm;
+	int			shm_fd;
+	pthread_t		bell_thread;
+	int			bell_on;
+	_Atomic int		bell_stop;
+	void	(*on_append)(void *, size_t);
 	void	(*on_broadcast)(void *);
 	void			*signal_data;
 	_Atomic size_t		n;
-	size_t			buff_sz;
+	pthread_cond_t		not_full;
+	_Atomic size_t		load;
+	_Atomic size_t		full_waiters;
+	_Atomic size_t		spill_dropped;
+	size_t			capacity;
+	size_t			(*weigh)(const struct qnode *node);
+	int			full_policy;
+	size_t			full_timeout_ms;
+	int			arena;
+	const struct qops_allocator	*alloc;
+	struct qmem		mem;
 };
 
 static void
@@ -150,22 +946,22 @@ threadsafeq_disconnect(struct threadsafeq *q)
 {
 	if (!q)
 		return;;
-	THREADSAFEQ_LOCK(q);
+	pthread_mutex_lock(&q->lock);
 	q->signal_data = NULL;
 	q->on_append = NULL;
 	q->on_broadcast = NULL;
-	THREADSAFEQ_UNLOCK(q);
+	pthread_mutex_unlock(&q->lock);
 }
 
 static int
-threadsafeq_connect(struct threadsafeq *q, void *signal_data,  void (*on_append)(void *), void (*on_broadcast)(void *))
+threadsafeq_connect(struct threadsafeq *q, void *signal_data,  void (*on_append)(void *, size_t), void (*on_broadcast)(void *))
 {
 	int	ret;
 
 	if (!q)
 		return (-1);
 	ret = 0;
-	THREADSAFEQ_LOCK(q);
+	pthread_mutex_lock(&q->lock);
 	if (!q->signal_data && !q->on_append && !q->on_broadcast)
 	{
 		q->signal_data = signal_data;
@@ -174,52 +970,3432 @@ threadsafeq_connect(struct threadsafeq *q, void *signal_data,  void (*on_append)
 	}
 	else
 		ret = -1;
-	THREADSAFEQ_UNLOCK(q);
+	pthread_mutex_unlock(&q->lock);
 	return (ret);
 }
 
-static int
-threadsafeq_append_ops(struct threadsafeq *q, struct qnode *node, int signal_f)
+/*
+ * Lane locks. THREADSAFEQ_LOCK/UNLOCK dispatch on the strategy chosen at
+ * creation. MCS nodes come from a small per-thread stack, so a thread may
+ * hold up to QOPS_MCS_DEPTH lane locks at once, released in reverse order.
+ */
+_Thread_local static struct qmcs_node	qmcs_nodev[QOPS_MCS_DEPTH];
+_Thread_local static size_t		qmcs_depth = 0;
+
+static void
+qops_spin_wait(size_t *spin)
 {
-	struct qnode_buff	*curr;
+	if (*spin < QOPS_SPIN_MAX)
+	{
+		++*spin;
+		QOPS_CPU_RELAX();
+	}
+	else
+		sched_yield();
+}
+
+static int
+qlock_init(struct qlock *l, int kind)
+{
+	pthread_mutexattr_t	attr;
 	int			ret;
 
-	if (!q || !node)
+	l->kind = kind;
+	switch (kind)
+	{
+	case THREADSAFEQ_LOCK_MUTEX:
+		return (pthread_mutex_init(&l->u.mutex, NULL));
+	case THREADSAFEQ_LOCK_PI:
+		if (pthread_mutexattr_init(&attr))
+			return (-1);
+		ret = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+		if (!ret)
+			ret = pthread_mutex_init(&l->u.mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+		return (ret);
+	case THREADSAFEQ_LOCK_MCS:
+		atomic_init(&l->u.mcs.tail, NULL);
+		l->u.mcs.owner = NULL;
+		return (0);
+	case THREADSAFEQ_LOCK_TICKET:
+		atomic_init(&l->u.ticket.next, 0);
+		atomic_init(&l->u.ticket.serving, 0);
+		return (0);
+	case THREADSAFEQ_LOCK_ADAPTIVE:
+		atomic_init(&l->u.futex, 0);
+		return (0);
+	}
+	return (-1);
+}
+
+static void
+qlock_destroy(struct qlock *l)
+{
+	if (l->kind == THREADSAFEQ_LOCK_MUTEX || l->kind == THREADSAFEQ_LOCK_PI)
+		pthread_mutex_destroy(&l->u.mutex);
+}
+
+static void
+qlock_futex(_Atomic int *addr, int op, int val)
+{
+	syscall(SYS_futex, (int *)addr, op, val, NULL, NULL, 0);
+}
+
+static void
+qlock_acquire(struct qlock *l)
+{
+	struct qmcs_node	*me;
+	struct qmcs_node	*pred;
+	size_t			spin;
+	unsigned		ticket;
+	int			c;
+
+	spin = 0;
+	switch (l->kind)
+	{
+	case THREADSAFEQ_LOCK_MCS:
+		me = qmcs_nodev + qmcs_depth++;
+		atomic_store_explicit(&me->next, NULL, memory_order_relaxed);
+		atomic_store_explicit(&me->locked, 1, memory_order_relaxed);
+		pred = atomic_exchange(&l->u.mcs.tail, me);
+		if (pred)
+		{
+			atomic_store_explicit(&pred->next, me, memory_order_release);
+			while (atomic_load_explicit(&me->locked, memory_order_acquire))
+				qops_spin_wait(&spin);
+		}
+		l->u.mcs.owner = me;
+		return ;
+	case THREADSAFEQ_LOCK_TICKET:
+		ticket = atomic_fetch_add(&l->u.ticket.next, 1);
+		while (atomic_load_explicit(&l->u.ticket.serving, memory_order_acquire) != ticket)
+			qops_spin_wait(&spin);
+		return ;
+	case THREADSAFEQ_LOCK_ADAPTIVE:
+		while (spin++ < QOPS_SPIN_MAX)
+		{
+			c = 0;
+			if (atomic_load_explicit(&l->u.futex, memory_order_relaxed) == 0
+				&& atomic_compare_exchange_weak(&l->u.futex, &c, 1))
+				return ;
+			QOPS_CPU_RELAX();
+		}
+		c = atomic_exchange(&l->u.futex, 2);
+		while (c)
+		{
+			qlock_futex(&l->u.futex, FUTEX_WAIT_PRIVATE, 2);
+			c = atomic_exchange(&l->u.futex, 2);
+		}
+		return ;
+	default:
+		pthread_mutex_lock(&l->u.mutex);
+	}
+}
+
+static int
+qlock_try(struct qlock *l)
+{
+	struct qmcs_node	*me;
+	struct qmcs_node	*tail;
+	unsigned		ticket;
+	int			c;
+
+	switch (l->kind)
+	{
+	case THREADSAFEQ_LOCK_MCS:
+		me = qmcs_nodev + qmcs_depth;
+		atomic_store_explicit(&me->next, NULL, memory_order_relaxed);
+		tail = NULL;
+		if (!atomic_compare_exchange_strong(&l->u.mcs.tail, &tail, me))
+			return (-1);
+		++qmcs_depth;
+		l->u.mcs.owner = me;
+		return (0);
+	case THREADSAFEQ_LOCK_TICKET:
+		ticket = atomic_load(&l->u.ticket.serving);
+		if (!atomic_compare_exchange_strong(&l->u.ticket.next, &ticket, ticket + 1))
+			return (-1);
+		return (0);
+	case THREADSAFEQ_LOCK_ADAPTIVE:
+		c = 0;
+		return (atomic_compare_exchange_strong(&l->u.futex, &c, 1) ? 0 : -1);
+	default:
+		return (pthread_mutex_trylock(&l->u.mutex) ? -1 : 0);
+	}
+}
+
+static void
+qlock_release(struct qlock *l)
+{
+	struct qmcs_node	*me;
+	struct qmcs_node	*next;
+	size_t			spin;
+
+	switch (l->kind)
+	{
+	case THREADSAFEQ_LOCK_MCS:
+		me = l->u.mcs.owner;
+		--qmcs_depth;
+		next = atomic_load_explicit(&me->next, memory_order_acquire);
+		if (!next)
+		{
+			if (atomic_compare_exchange_strong(&l->u.mcs.tail, &(struct qmcs_node *){me}, NULL))
+				return ;
+			spin = 0;
+			while (!(next = atomic_load_explicit(&me->next, memory_order_acquire)))
+				qops_spin_wait(&spin);
+		}
+		atomic_store_explicit(&next->locked, 0, memory_order_release);
+		return ;
+	case THREADSAFEQ_LOCK_TICKET:
+		atomic_store_explicit(&l->u.ticket.serving, atomic_load_explicit(&l->u.ticket.serving, memory_order_relaxed) + 1, memory_order_release);
+		return ;
+	case THREADSAFEQ_LOCK_ADAPTIVE:
+		if (atomic_fetch_sub(&l->u.futex, 1) != 1)
+		{
+			atomic_store(&l->u.futex, 0);
+			qlock_futex(&l->u.futex, FUTEX_WAKE_PRIVATE, 1);
+		}
+		return ;
+	default:
+		pthread_mutex_unlock(&l->u.mutex);
+	}
+}
+
+static int
+qlane_init(struct qlane *lane, int lock, size_t min, size_t max, int compact, size_t inline_sz,
+	const struct qops_allocator *alloc, struct qmem *mem)
+{
+	lane->head = NULL;
+	lane->tail = NULL;
+	lane->free = NULL;
+	lane->nof_free = 0;
+	lane->max_free = QLANE_FREE_MAX;
+	lane->chunk_sz = min;
+	lane->chunk_min = min;
+	lane->chunk_max = max > min ? max : min;
+	lane->compact = compact;
+	/* Room for `inline_sz` bytes and a header per slot. */
+	lane->inline_sz = inline_sz ? QOPS_ALIGN_UP(sizeof (struct qinline) + inline_sz, _Alignof (max_align_t)) : 0;
+	lane->alloc = alloc;
+	lane->mem = mem;
+	lane->spill = NULL;
+	lane->keys = NULL;
+	lane->held = 0;
+	lane->nof_linked = 0;
+	lane->linked_bytes = 0;
+	atomic_init(&lane->n, 0);
+	return (qlock_init(&lane->lock, lock));
+}
+
+static size_t
+qlane_chunk_bytes(struct qlane *lane, size_t size)
+{
+	return (qnode_buff_bytes(size, lane->compact, lane->inline_sz));
+}
+
+/* Lane lock held. */
+static struct qnode_buff *
+qlane_chunk_new(struct qlane *lane)
+{
+	struct qnode_buff	*curr;
+
+	curr = qnode_buff_new(lane->chunk_sz, lane->compact, lane->inline_sz, lane->alloc);
+	if (curr)
+		qmem_charge(lane->mem, qlane_chunk_bytes(lane, curr->sz), 1);
+	return (curr);
+}
+
+/* Drops the lane's reference on `curr`; with inline payloads out, their last cleanup frees it. */
+static void
+qlane_chunk_free(struct qlane *lane, struct qnode_buff *curr)
+{
+	qmem_uncharge(lane->mem, qlane_chunk_bytes(lane, curr->sz), 1);
+	if (lane->inline_sz)
+		qinline_unref(qnode_buff_area(curr, lane->compact));
+	else
+		qops_free(lane->alloc, curr, qnode_buff_bytes(curr->sz, lane->compact, 0), _Alignof (max_align_t));
+}
+
+/*
+ * Lane lock held. Drained buffers are kept on a bounded per lane freelist,
+ * so the steady state does not call the allocator inside the critical section.
+ * With adaptive sizing the buffer size doubles while more than two buffers
+ * worth of nodes are queued; buffers of a stale size are not reused.
+ */
+static struct qnode_buff *
+qlane_chunk_get(struct qlane *lane)
+{
+	struct qnode_buff	*curr;
+
+	if (lane->chunk_sz < lane->chunk_max && atomic_load(&lane->n) >= 2 * lane->chunk_sz)
+		lane->chunk_sz = lane->chunk_sz * 2 < lane->chunk_max ? lane->chunk_sz * 2 : lane->chunk_max;
+	while ((curr = lane->free) && curr->sz != lane->chunk_sz)
+	{
+		lane->free = curr->next;
+		--lane->nof_free;
+		qlane_chunk_free(lane, curr);
+	}
+	if (!curr)
+		curr = qlane_chunk_new(lane);
+	else
+	{
+		lane->free = curr->next;
+		--lane->nof_free;
+		curr->ri = 0;
+		curr->wi = 0;
+		curr->next = NULL;
+		if (lane->inline_sz)
+			qnode_buff_area(curr, lane->compact)->used = 0;
+	}
+	if (curr)
+	{
+		++lane->nof_linked;
+		lane->linked_bytes += qlane_chunk_bytes(lane, curr->sz);
+	}
+	return (curr);
+}
+
+/*
+ * Lane lock held, `curr` holds no node and is no longer linked. A buffer
+ * with inline payloads that are still being run is left to the last cleanup.
+ */
+static void
+qlane_chunk_put(struct qlane *lane, struct qnode_buff *curr)
+{
+	--lane->nof_linked;
+	lane->linked_bytes -= qlane_chunk_bytes(lane, curr->sz);
+	if (lane->inline_sz && atomic_load(&qnode_buff_area(curr, lane->compact)->refs) != 1)
+	{
+		qlane_chunk_free(lane, curr);
+		return ;
+	}
+	if (lane->nof_free >= lane->max_free || curr->sz != lane->chunk_sz)
+	{
+		qlane_chunk_free(lane, curr);
+		return ;
+	}
+	curr->next = lane->free;
+	lane->free = curr;
+	++lane->nof_free;
+}
+
+/*
+ * Class of `node` on a compact lane, SIZE_MAX when it cannot be queued: a
+ * compact slot has no room for a deadline, which must not be lost.
+ */
+static size_t
+qlane_class(const struct qnode *node)
+{
+	if (node->deadline)
+		return (SIZE_MAX);
+	return (qclass_of(node));
+}
+
+/* Stores `node` in slot `i` of `curr`; `cls` is its class on a compact lane. */
+static void
+qlane_slot_set(struct qlane *lane, struct qnode_buff *curr, size_t i, const struct qnode *node, size_t cls)
+{
+	struct qcnode	*slot;
+
+	if (!lane->compact)
+	{
+		curr->nodev[i] = *node;
+		return ;
+	}
+	slot = (struct qcnode *)(void *)curr->nodev + i;
+	slot->data = node->data;
+	slot->cls = cls;
+}
+
+static void
+qlane_slot_get(struct qlane *lane, struct qnode_buff *curr, size_t i, struct qnode *node)
+{
+	struct qcnode	*slot;
+	struct qclass	*cls;
+
+	if (!lane->compact)
+	{
+		*node = curr->nodev[i];
+		return ;
+	}
+	slot = (struct qcnode *)(void *)curr->nodev + i;
+	cls = qclass_tab + slot->cls;
+	*node = (struct qnode){.next = NULL, .data = slot->data, .func = cls->func, .err = cls->err, .cleanup = cls->cleanup};
+}
+
+/* Lane lock held. */
+static int
+qlane_push(struct qlane *lane, struct qnode *node)
+{
+	struct qnode_buff	*curr;
+	size_t			cls;
+
+	cls = 0;
+	if (lane->compact && (cls = qlane_class(node)) == SIZE_MAX)
+		return (-1);
+	curr = lane->tail;
+	if (!curr || curr->wi == curr->sz)
+	{
+		curr = qlane_chunk_get(lane);
+		if (!curr)
+			return (-1);
+		if (lane->tail)
+			lane->tail->next = curr;
+		else
+			lane->head = curr;
+		lane->tail = curr;
+	}
+	qlane_slot_set(lane, curr, curr->wi++, node, cls);
+	++lane->held;
+	if (lane->keys)
+		++lane->keys->pushed;
+	return (0);
+}
+
+/*
+ * Lane lock held. The buffers missing for the whole batch are allocated
+ * before anything is written, so the batch is appended entirely or not at all.
+ */
+static int
+qlane_push_batch(struct qlane *lane, struct qnode *nodev, size_t n)
+{
+	struct qnode_buff	*curr;
+	struct qnode_buff	*first;
+	struct qnode_buff	*last;
+	size_t			room;
+
+	room = 0;
+	while (lane->compact && room < n)
+		if (qlane_class(nodev + room++) == SIZE_MAX)
+			return (-1);
+	room = lane->tail ? lane->tail->sz - lane->tail->wi : 0;
+	first = NULL;
+	last = NULL;
+	while (room < n)
+	{
+		curr = qlane_chunk_get(lane);
+		if (!curr)
+		{
+			while (first)
+			{
+				curr = first->next;
+				qlane_chunk_put(lane, first);
+				first = curr;
+			}
+			return (-1);
+		}
+		if (last)
+			last->next = curr;
+		else
+			first = curr;
+		last = curr;
+		room += curr->sz;
+	}
+	curr = lane->tail;
+	if (!curr)
+	{
+		lane->head = first;
+		curr = first;
+	}
+	else
+		curr->next = first ? first : curr->next;
+	if (last)
+		lane->tail = last;
+	lane->held += n;
+	while (n)
+	{
+		if (curr->wi == curr->sz)
+			curr = curr->next;
+		qlane_slot_set(lane, curr, curr->wi++, nodev, lane->compact ? qclass_of(nodev) : 0);
+		if (lane->keys)
+			++lane->keys->pushed;
+		++nodev;
+		--n;
+	}
+	return (0);
+}
+
+static struct qspill *
+qspill_new(const char *dir, size_t depth, const struct qops_allocator *a)
+{
+	struct qspill	*sp;
+	char		path[PATH_MAX];
+
+	sp = qops_alloc(a, sizeof (*sp), _Alignof (struct qspill));
+	if (!sp)
+		return (NULL);
+	*sp = (struct qspill){.depth = depth, .low = depth / 2 ? depth / 2 : 1, .dropped = NULL, .weigh = NULL, .alloc = a};
+	atomic_init(&sp->count, 0);
+	sp->fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	/* Without O_TMPFILE support, a named file unlinked right away. */
+	if (sp->fd < 0 && snprintf(path, sizeof (path), "%s/qops-spill-XXXXXX", dir) < (int)sizeof (path))
+	{
+		sp->fd = mkostemp(path, O_CLOEXEC);
+		if (sp->fd >= 0)
+			unlink(path);
+	}
+	if (sp->fd < 0)
+	{
+		qops_free(a, sp, sizeof (*sp), _Alignof (struct qspill));
+		return (NULL);
+	}
+	return (sp);
+}
+
+static size_t
+qspill_count(struct qlane *lane)
+{
+	return (lane->spill ? atomic_load_explicit(&lane->spill->count, memory_order_relaxed) : 0);
+}
+
+/* Nothing spilled any more: unmap both segments and start the file over. */
+static void
+qspill_reset(struct qspill *sp)
+{
+	if (sp->rmap)
+		munmap(sp->rmap, QSPILL_SEG);
+	if (sp->wmap)
+		munmap(sp->wmap, QSPILL_SEG);
+	sp->rmap = NULL;
+	sp->wmap = NULL;
+	sp->rseg = 0;
+	sp->roff = 0;
+	sp->wseg = 0;
+	sp->woff = 0;
+	/* A file that cannot shrink is overwritten from the start all the same. */
+	if (ftruncate(sp->fd, 0))
+		return ;
+}
+
+/*
+ * Maps the segment after the one being written, or the first one. Its blocks
+ * are allocated up front, so a full disk fails here and not as a SIGBUS on
+ * a store. The segment left is ended with a skip mark and its write-back
+ * is started, so it does not linger dirty in the page cache.
+ */
+static int
+qspill_next_wseg(struct qspill *sp)
+{
+	size_t	seg;
+	char	*map;
+
+	seg = sp->wmap ? sp->wseg + 1 : sp->wseg;
+	if (fallocate(sp->fd, 0, (off_t)(seg * QSPILL_SEG), (off_t)QSPILL_SEG))
+		return (-1);
+	map = mmap(NULL, QSPILL_SEG, PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, (off_t)(seg * QSPILL_SEG));
+	if (map == MAP_FAILED)
+		return (-1);
+	if (sp->wmap)
+	{
+		if (sp->woff + sizeof (struct qspill_rec) <= QSPILL_SEG)
+			((struct qspill_rec *)(void *)(sp->wmap + sp->woff))->len = QSPILL_SKIP;
+		munmap(sp->wmap, QSPILL_SEG);
+		sync_file_range(sp->fd, (off_t)(sp->wseg * QSPILL_SEG), (off_t)QSPILL_SEG, SYNC_FILE_RANGE_WRITE);
+	}
+	sp->wmap = map;
+	sp->wseg = seg;
+	sp->woff = 0;
+	return (0);
+}
+
+/*
+ * Lane lock held. Spills `node` if the lane is `depth` deep or has nodes
+ * spilled already, and its class has a codec. The spilled copy replaces the
+ * task, so its cleanup runs here. Returns 1 if the node is to be kept in
+ * memory: no codec, the payload is refused or larger than a segment, or the
+ * file cannot grow.
+ */
+static int
+qspill_push(struct qlane *lane, struct qnode *node)
+{
+	const struct qclass_codec	*codec;
+	struct qspill			*sp;
+	struct qspill_rec		*rec;
+	size_t				room;
+	size_t				cls;
+	size_t				len;
+
+	sp = lane->spill;
+	if (!atomic_load_explicit(&sp->count, memory_order_relaxed) && atomic_load(&lane->n) < sp->depth)
+		return (1);
+	cls = qclass_find(node);
+	if (cls == SIZE_MAX || !(codec = atomic_load_explicit(&qclass_tab[cls].codec, memory_order_acquire)))
+		return (1);
+	room = 0;
+	if (sp->wmap && sp->woff + sizeof (*rec) <= QSPILL_SEG)
+		room = QSPILL_SEG - sp->woff - sizeof (*rec);
+	len = room ? codec->encode(node->data, sp->wmap + sp->woff + sizeof (*rec), room) : 1;
+	if (len > room)
+	{
+		/* Once more at the start of a new segment. */
+		if (len > QSPILL_SEG - sizeof (*rec) || qspill_next_wseg(sp))
+			return (1);
+		room = QSPILL_SEG - sizeof (*rec);
+		len = codec->encode(node->data, sp->wmap + sizeof (*rec), room);
+		if (len > room)
+			return (1);
+	}
+	rec = (struct qspill_rec *)(void *)(sp->wmap + sp->woff);
+	rec->len = (uint32_t)len;
+	rec->cls = (uint32_t)cls;
+	rec->deadline = node->deadline;
+	rec->codec = codec;
+	rec->weight = !sp->dropped ? 0 : sp->weigh ? sp->weigh(node) : 1;
+	sp->woff += sizeof (*rec) + QOPS_ALIGN_UP(len, 8);
+	atomic_fetch_add_explicit(&sp->count, 1, memory_order_relaxed);
+	if (node->cleanup)
+		node->cleanup(node->data);
+	return (0);
+}
+
+/*
+ * Lane lock held and a node spilled. The record to read next; segments read
+ * to their end are unmapped and punched out of the file. A new segment is
+ * read with MADV_SEQUENTIAL and the one after it is read ahead.
+ */
+static struct qspill_rec *
+qspill_next(struct qspill *sp)
+{
+	struct qspill_rec	*rec;
+
+	while (1)
+	{
+		if (!sp->rmap)
+		{
+			sp->rmap = mmap(NULL, QSPILL_SEG, PROT_READ, MAP_SHARED, sp->fd, (off_t)(sp->rseg * QSPILL_SEG));
+			if (sp->rmap == MAP_FAILED)
+			{
+				sp->rmap = NULL;
+				return (NULL);
+			}
+			madvise(sp->rmap, QSPILL_SEG, MADV_SEQUENTIAL);
+			if (sp->rseg < sp->wseg)
+				readahead(sp->fd, (off_t)((sp->rseg + 1) * QSPILL_SEG), QSPILL_SEG);
+		}
+		rec = (struct qspill_rec *)(void *)(sp->rmap + sp->roff);
+		if (sp->roff + sizeof (*rec) <= QSPILL_SEG && rec->len != QSPILL_SKIP)
+			return (rec);
+		munmap(sp->rmap, QSPILL_SEG);
+		fallocate(sp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(sp->rseg * QSPILL_SEG), (off_t)QSPILL_SEG);
+		sp->rmap = NULL;
+		++sp->rseg;
+		sp->roff = 0;
+	}
+}
+
+/* Consumes the record returned by qspill_next(). */
+static void
+qspill_pop(struct qspill *sp, struct qspill_rec *rec)
+{
+	sp->roff += sizeof (*rec) + QOPS_ALIGN_UP(rec->len, 8);
+	if (atomic_fetch_sub_explicit(&sp->count, 1, memory_order_relaxed) == 1)
+		qspill_reset(sp);
+}
+
+/*
+ * Lane lock held. Reads up to a buffer of spilled nodes back behind the
+ * nodes in memory. A payload the codec cannot decode drops its task, whose
+ * `err` gets a NULL data pointer and THREADSAFEQ_ESPILL, and whose weight
+ * is left for the remove to release.
+ */
+static size_t
+qspill_refill(struct qlane *lane)
+{
+	struct qspill		*sp;
+	struct qspill_rec	*rec;
+	struct qclass		*cls;
+	struct qnode		node;
+	size_t			k;
+
+	sp = lane->spill;
+	k = 0;
+	while (k < lane->chunk_sz && atomic_load_explicit(&sp->count, memory_order_relaxed))
+	{
+		rec = qspill_next(sp);
+		if (!rec)
+			break ;
+		cls = qclass_tab + rec->cls;
+		node = (struct qnode){.func = cls->func, .err = cls->err, .cleanup = cls->cleanup, .deadline = rec->deadline};
+		if (rec->codec->decode(rec + 1, rec->len, &node.data))
+		{
+			if (sp->dropped && rec->weight)
+				atomic_fetch_add(sp->dropped, rec->weight);
+			if (cls->err)
+				cls->err(NULL, THREADSAFEQ_ESPILL);
+		}
+		else if (qlane_push(lane, &node))
+		{
+			/* Out of memory, the record stays for the next try. */
+			if (node.cleanup)
+				node.cleanup(node.data);
+			break ;
+		}
+		else
+		{
+			atomic_fetch_add(&lane->n, 1);
+			++k;
+		}
+		qspill_pop(sp, rec);
+	}
+	return (k);
+}
+
+/* Runs the cleanup of the nodes left spilled, on their decoded data, and closes the file. */
+static void
+qspill_delete(struct qspill *sp)
+{
+	struct qspill_rec	*rec;
+	struct qclass		*cls;
+	void			*data;
+
+	while (atomic_load(&sp->count) && (rec = qspill_next(sp)))
+	{
+		cls = qclass_tab + rec->cls;
+		if (!rec->codec->decode(rec + 1, rec->len, &data) && cls->cleanup)
+			cls->cleanup(data);
+		qspill_pop(sp, rec);
+	}
+	qspill_reset(sp);
+	close(sp->fd);
+	qops_free(sp->alloc, sp, sizeof (*sp), _Alignof (struct qspill));
+}
+
+/* Lane lock held. Appends and counts `node`, in memory or in the spill file. */
+static int
+qlane_put(struct qlane *lane, struct qnode *node)
+{
+	/* Refused before it can be spilled, it could never be read back. */
+	if (lane->compact && node->deadline)
+		return (-1);
+	if (lane->spill && !qspill_push(lane, node))
+		return (0);
+	if (qlane_push(lane, node))
+		return (-1);
+	atomic_fetch_add(&lane->n, 1);
+	return (0);
+}
+
+/*
+ * Lane lock held. A batch that may spill goes node by node and is no longer
+ * appended all or nothing.
+ */
+static int
+qlane_put_batch(struct qlane *lane, struct qnode *nodev, size_t n)
+{
+	size_t	i;
+
+	if (!lane->spill || (!qspill_count(lane) && atomic_load(&lane->n) + n < lane->spill->depth))
+	{
+		if (qlane_push_batch(lane, nodev, n))
+			return (-1);
+		atomic_fetch_add(&lane->n, n);
+		return (0);
+	}
+	i = 0;
+	while (i < n)
+		if (qlane_put(lane, nodev + i++))
+			return (-1);
+	return (0);
+}
+
+/* Lane lock held and a node reserved on `n`. */
+static void
+qlane_pop(struct qlane *lane, struct qnode *node)
+{
+	struct qnode_buff	*curr;
+
+	curr = lane->head;
+	/* A buffer drained in front of spliced ones. */
+	while (curr->ri == curr->wi)
+	{
+		lane->head = curr->next;
+		qlane_chunk_put(lane, curr);
+		curr = lane->head;
+	}
+	qlane_slot_get(lane, curr, curr->ri++, node);
+	--lane->held;
+	if (lane->keys)
+		++lane->keys->popped;
+	if (curr->sz == curr->ri)
+	{
+		lane->head = curr->next;
+		if (!lane->head)
+		{
+			lane->tail = NULL;
+			/* Drained: step back towards the minimum buffer size. */
+			if (lane->chunk_sz > lane->chunk_min)
+				lane->chunk_sz = lane->chunk_sz / 2 > lane->chunk_min ? lane->chunk_sz / 2 : lane->chunk_min;
+		}
+		qlane_chunk_put(lane, curr);
+	}
+	if (qspill_count(lane) && atomic_load(&lane->n) < lane->spill->low)
+		qspill_refill(lane);
+}
+
+static int
+qlane_append(struct qlane *lane, struct qnode *node)
+{
+	int	ret;
+
+	THREADSAFEQ_LOCK(lane);
+	ret = qlane_put(lane, node);
+	THREADSAFEQ_UNLOCK(lane);
+	return (ret);
+}
+
+static int
+qlane_append_batch(struct qlane *lane, struct qnode *nodev, size_t n)
+{
+	int	ret;
+
+	THREADSAFEQ_LOCK(lane);
+	ret = qlane_put_batch(lane, nodev, n);
+	THREADSAFEQ_UNLOCK(lane);
+	return (ret);
+}
+
+static size_t
+qkeys_bytes(size_t bits)
+{
+	return (sizeof (struct qkey_ent) << bits);
+}
+
+/* A table of 2^bits empty entries. */
+static struct qkey_ent *
+qkeys_table(const struct qops_allocator *a, size_t bits)
+{
+	struct qkey_ent	*entv;
+	size_t		i;
+
+	entv = qops_alloc(a, qkeys_bytes(bits), _Alignof (struct qkey_ent));
+	i = 0;
+	while (entv && i < ((size_t)1 << bits))
+		entv[i++] = (struct qkey_ent){.buff = NULL};
+	return (entv);
+}
+
+static struct qkeys *
+qkeys_new(const struct qops_allocator *a, struct qmem *mem)
+{
+	struct qkeys	*keys;
+	size_t		bits;
+
+	bits = (size_t)__builtin_ctzll(QKEYS_MIN);
+	keys = qops_alloc(a, sizeof (*keys), _Alignof (struct qkeys));
+	if (!keys)
+		return (NULL);
+	*keys = (struct qkeys){.bits = bits, .alloc = a, .mem = mem};
+	keys->entv = qkeys_table(a, bits);
+	if (!keys->entv)
+	{
+		qops_free(a, keys, sizeof (*keys), _Alignof (struct qkeys));
+		return (NULL);
+	}
+	qmem_charge(mem, sizeof (*keys) + qkeys_bytes(bits), 0);
+	return (keys);
+}
+
+static void
+qkeys_delete(struct qkeys *keys)
+{
+	qmem_uncharge(keys->mem, sizeof (*keys) + qkeys_bytes(keys->bits), 0);
+	qops_free(keys->alloc, keys->entv, qkeys_bytes(keys->bits), _Alignof (struct qkey_ent));
+	qops_free(keys->alloc, keys, sizeof (*keys), _Alignof (struct qkeys));
+}
+
+/* Linear probing from a Fibonacci hash of the key. */
+static struct qkey_ent *
+qkeys_probe(struct qkey_ent *entv, size_t bits, uint64_t key)
+{
+	size_t	mask;
+	size_t	i;
+
+	mask = ((size_t)1 << bits) - 1;
+	i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> (64 - bits));
+	while (entv[i].buff && entv[i].key != key)
+		i = (i + 1) & mask;
+	return (entv + i);
+}
+
+/*
+ * Moves the pending entries to a table at most half full once the current
+ * one is three quarters full. Returns -1 if the new table cannot be allocated.
+ */
+static int
+qkeys_rebuild(struct qkeys *keys)
+{
+	struct qkey_ent	*entv;
+	size_t		live;
+	size_t		bits;
+	size_t		i;
+
+	if (keys->used * 4 < ((size_t)3 << keys->bits))
+		return (0);
+	live = 0;
+	i = 0;
+	while (i < ((size_t)1 << keys->bits))
+	{
+		live += keys->entv[i].buff && keys->entv[i].pos >= keys->popped;
+		++i;
+	}
+	bits = (size_t)__builtin_ctzll(QKEYS_MIN);
+	while (((size_t)1 << bits) < live * 2)
+		++bits;
+	entv = qkeys_table(keys->alloc, bits);
+	if (!entv)
+		return (-1);
+	i = 0;
+	while (i < ((size_t)1 << keys->bits))
+	{
+		if (keys->entv[i].buff && keys->entv[i].pos >= keys->popped)
+			*qkeys_probe(entv, bits, keys->entv[i].key) = keys->entv[i];
+		++i;
+	}
+	qops_free(keys->alloc, keys->entv, qkeys_bytes(keys->bits), _Alignof (struct qkey_ent));
+	qmem_uncharge(keys->mem, qkeys_bytes(keys->bits), 0);
+	qmem_charge(keys->mem, qkeys_bytes(bits), 0);
+	keys->entv = entv;
+	keys->bits = bits;
+	keys->used = live;
+	return (0);
+}
+
+/*
+ * A node still pending under `key` takes the callbacks of `node` and the
+ * payload `coalesce` picks (the new one without it), keeping its place in
+ * the queue. The payloads it no longer holds go to their cleanup once the
+ * lock is released. Returns 1 if the node was coalesced, with the weights of
+ * the task before and after in `wv`. Without `put`, a key that is not
+ * pending is left alone and 2 is returned.
+ */
+static int
+qlane_append_key(struct qlane *lane, struct qnode *node, uint64_t key, void *(*coalesce)(void *, void *),
+	size_t (*weigh)(const struct qnode *), int put, size_t *wv)
+{
+	struct qkey_ent	*ent;
+	struct qnode	old;
+	struct qnode	tmp;
+	size_t		cls;
+
+	cls = 0;
+	if (lane->compact && (cls = qlane_class(node)) == SIZE_MAX)
+		return (-1);
+	THREADSAFEQ_LOCK(lane);
+	if (qkeys_rebuild(lane->keys))
+	{
+		THREADSAFEQ_UNLOCK(lane);
+		return (-1);
+	}
+	ent = qkeys_probe(lane->keys->entv, lane->keys->bits, key);
+	if (ent->buff && ent->pos >= lane->keys->popped)
+	{
+		qlane_slot_get(lane, ent->buff, ent->i, &old);
+		/* Before `coalesce`, which may update the pending payload in place. */
+		wv[0] = weigh ? weigh(&old) : 1;
+		tmp = *node;
+		if (coalesce)
+			tmp.data = coalesce(old.data, node->data);
+		qlane_slot_set(lane, ent->buff, ent->i, &tmp, cls);
+		wv[1] = weigh ? weigh(&tmp) : 1;
+		THREADSAFEQ_UNLOCK(lane);
+		if (old.cleanup && old.data != tmp.data)
+			old.cleanup(old.data);
+		if (node->cleanup && node->data != tmp.data && node->data != old.data)
+			node->cleanup(node->data);
+		return (1);
+	}
+	if (!put || qlane_put(lane, node))
+	{
+		THREADSAFEQ_UNLOCK(lane);
+		return (put ? -1 : 2);
+	}
+	lane->keys->used += !ent->buff;
+	*ent = (struct qkey_ent){.key = key, .pos = lane->keys->pushed - 1, .buff = lane->tail, .i = lane->tail->wi - 1};
+	THREADSAFEQ_UNLOCK(lane);
+	return (0);
+}
+
+/*
+ * Carves `len` payload bytes from the tail buffer, or from a new buffer when
+ * the slots or the area of the tail are used up. On success the lane lock
+ * stays held until qlane_commit_slot(), which fills the slot of the tail.
+ */
+static void *
+qlane_reserve_slot(struct qlane *lane, size_t len)
+{
+	struct qnode_buff	*curr;
+	struct qinline_area	*area;
+	struct qinline		*hdr;
+	size_t			need;
+
+	need = QOPS_ALIGN_UP(sizeof (*hdr) + len, _Alignof (max_align_t));
+	THREADSAFEQ_LOCK(lane);
+	curr = lane->tail;
+	area = curr ? qnode_buff_area(curr, lane->compact) : NULL;
+	if (!curr || curr->wi == curr->sz || area->used + need > area->cap)
+	{
+		curr = qlane_chunk_get(lane);
+		if (!curr)
+			goto err;
+		area = qnode_buff_area(curr, lane->compact);
+		if (need > area->cap)
+		{
+			qlane_chunk_put(lane, curr);
+			goto err;
+		}
+		if (lane->tail)
+			lane->tail->next = curr;
+		else
+			lane->head = curr;
+		lane->tail = curr;
+	}
+	hdr = (struct qinline *)(void *)((char *)(area + 1) + area->used);
+	area->used += need;
+	atomic_fetch_add(&area->refs, 1);
+	hdr->area = area;
+	hdr->cleanup = NULL;
+	return (hdr + 1);
+err:
+	THREADSAFEQ_UNLOCK(lane);
+	return (NULL);
+}
+
+/* Publishes the reserved payload as the data of `node`, or drops it if `node` is NULL. */
+static int
+qlane_commit_slot(struct qlane *lane, void *slot, struct qnode *node)
+{
+	struct qinline	*hdr;
+	struct qnode	tmp;
+	size_t		cls;
+
+	hdr = (struct qinline *)slot - 1;
+	cls = 0;
+	if (node)
+	{
+		hdr->cleanup = node->cleanup;
+		tmp = (struct qnode){.data = slot, .func = node->func, .err = node->err, .cleanup = qinline_cleanup,
+			.deadline = node->deadline};
+		if (lane->compact)
+			cls = qlane_class(&tmp);
+	}
+	if (!node || cls == SIZE_MAX)
+	{
+		/* The lane holds its own reference, this never frees the buffer. */
+		atomic_fetch_sub(&hdr->area->refs, 1);
+		THREADSAFEQ_UNLOCK(lane);
+		return (node ? -1 : 0);
+	}
+	qlane_slot_set(lane, lane->tail, lane->tail->wi++, &tmp, cls);
+	++lane->held;
+	atomic_fetch_add(&lane->n, 1);
+	THREADSAFEQ_UNLOCK(lane);
+	return (0);
+}
+
+/*
+ * Nothing left in memory but nodes spilled, when the refill of the last
+ * remove failed or the lane was drained under a remove that saw it empty.
+ * Returns non-zero if the lane holds nodes in memory again.
+ */
+static size_t
+qlane_refill(struct qlane *lane)
+{
+	size_t	k;
+
+	if (!qspill_count(lane))
+		return (0);
+	THREADSAFEQ_LOCK(lane);
+	k = atomic_load(&lane->n);
+	if (!k)
+		k = qspill_refill(lane);
+	THREADSAFEQ_UNLOCK(lane);
+	return (k);
+}
+
+/*
+ * Reserves up to `k` of the nodes counted on `lane->n`, with a CAS so that
+ * the removes, the combiner and a splice never take the same node.
+ */
+static size_t
+qlane_claim(struct qlane *lane, size_t k)
+{
+	size_t	n;
+
+	n = atomic_load(&lane->n);
+	while (n && !atomic_compare_exchange_weak(&lane->n, &n, n - (k < n ? k : n)))
+		;
+	return (k < n ? k : n);
+}
+
+static int
+qlane_remove(struct qlane *lane, struct qnode *node)
+{
+	size_t	n;
+
+	do
+	{
+		n = atomic_load(&lane->n);
+		while (n)
+		{
+			if (!atomic_compare_exchange_strong(&lane->n, &n, n - 1))
+				continue ;
+			THREADSAFEQ_LOCK(lane);
+			qlane_pop(lane, node);
+			THREADSAFEQ_UNLOCK(lane);
+			return (0);
+		}
+	} while (qlane_refill(lane));
+	return (-1);
+}
+
+static size_t
+qlane_remove_batch(struct qlane *lane, struct qnode *nodev, size_t k)
+{
+	size_t	n;
+	size_t	m;
+	size_t	i;
+
+	m = 0;
+	do
+	{
+		n = atomic_load(&lane->n);
+		while (n)
+		{
+			m = n < k ? n : k;
+			if (atomic_compare_exchange_strong(&lane->n, &n, n - m))
+				break ;
+		}
+	} while (!n && qlane_refill(lane));
+	if (!n)
+		return (0);
+	THREADSAFEQ_LOCK(lane);
+	i = 0;
+	while (i < m)
+		qlane_pop(lane, nodev + i++);
+	THREADSAFEQ_UNLOCK(lane);
+	return (m);
+}
+
+static void
+qlane_delete(struct qlane *lane)
+{
+	struct qnode_buff	*buff;
+
+	THREADSAFEQ_LOCK(lane);
+	while (lane->head)
+	{
+		buff = lane->head;
+		lane->head = lane->head->next;
+		qnode_buff_clear(buff, lane->compact);
+		qlane_chunk_free(lane, buff);
+	}
+	lane->tail = NULL;
+	while (lane->free)
+	{
+		buff = lane->free;
+		lane->free = buff->next;
+		qlane_chunk_free(lane, buff);
+	}
+	lane->nof_free = 0;
+	atomic_store(&lane->n, 0);
+	if (lane->spill)
+		qspill_delete(lane->spill);
+	lane->spill = NULL;
+	if (lane->keys)
+		qkeys_delete(lane->keys);
+	lane->keys = NULL;
+	THREADSAFEQ_UNLOCK(lane);
+	qlock_destroy(&lane->lock);
+}
+
+/*
+ * Lane of the calling thread. Workers use their index in the pool, other
+ * threads get a sequential id on first use, so threads spread evenly.
+ */
+static size_t
+threadsafeq_home_lane(struct threadsafeq *q)
+{
+	if (q->nof_lane == 1)
+		return (0);
+	if (workerp_local_index >= 0)
+		return ((size_t)workerp_local_index % q->nof_lane);
+	if (qops_thread_id == SIZE_MAX)
+		qops_thread_id = atomic_fetch_add(&qops_thread_cnt, 1);
+	return (qops_thread_id % q->nof_lane);
+}
+
+static int
+threadsafeq_list_append(struct threadsafeq *q, struct qnode *node)
+{
+	return (qlane_append(q->lanev + threadsafeq_home_lane(q), node));
+}
+
+static int
+threadsafeq_list_append_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	return (qlane_append_batch(q->lanev + threadsafeq_home_lane(q), nodev, n));
+}
+
+/* Drain the home lane first, then steal from the others in order. */
+static int
+threadsafeq_list_remove(struct threadsafeq *q, struct qnode *node)
+{
+	size_t	i;
+	size_t	k;
+
+	i = threadsafeq_home_lane(q);
+	k = 0;
+	while (k++ < q->nof_lane)
+	{
+		if (!qlane_remove(q->lanev + i, node))
+			return (0);
+		if (++i == q->nof_lane)
+			i = 0;
+	}
+	return (-1);
+}
+
+static size_t
+threadsafeq_list_remove_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	size_t	i;
+	size_t	k;
+	size_t	m;
+
+	i = threadsafeq_home_lane(q);
+	k = 0;
+	while (k++ < q->nof_lane)
+	{
+		m = qlane_remove_batch(q->lanev + i, nodev, n);
+		if (m)
+			return (m);
+		if (++i == q->nof_lane)
+			i = 0;
+	}
+	return (0);
+}
+
+/* Spread the nodes over the lanes and park the buffers on their freelists. */
+static int
+threadsafeq_list_reserve(struct threadsafeq *q, size_t n)
+{
+	struct qlane		*lane;
+	struct qnode_buff	*curr;
+	size_t			per_lane;
+	size_t			room;
+	size_t			i;
+	int			ret;
+
+	per_lane = (n + q->nof_lane - 1) / q->nof_lane;
+	ret = 0;
+	i = 0;
+	while (i < q->nof_lane)
+	{
+		lane = q->lanev + i++;
+		THREADSAFEQ_LOCK(lane);
+		room = 0;
+		curr = lane->free;
+		while (curr)
+		{
+			room += curr->sz;
+			curr = curr->next;
+		}
+		while (!ret && room < per_lane)
+		{
+			curr = qlane_chunk_new(lane);
+			if (!curr)
+			{
+				ret = -1;
+				break ;
+			}
+			curr->next = lane->free;
+			lane->free = curr;
+			room += curr->sz;
+			++lane->nof_free;
+		}
+		if (lane->max_free < lane->nof_free)
+			lane->max_free = lane->nof_free;
+		THREADSAFEQ_UNLOCK(lane);
+	}
+	return (ret);
+}
+
+/* Both locks held. Moves the buffer accounting of `nof` buffers of `bytes` from `src` to `dst`. */
+static void
+qlane_splice_charge(struct qlane *dst, struct qlane *src, size_t nof, size_t bytes)
+{
+	src->nof_linked -= nof;
+	src->linked_bytes -= bytes;
+	dst->nof_linked += nof;
+	dst->linked_bytes += bytes;
+	if (src->mem == dst->mem)
+		return ;
+	qmem_uncharge(src->mem, bytes, nof);
+	qmem_charge(dst->mem, bytes, nof);
+}
+
+/*
+ * Moves up to `n` nodes from the front of `src` to the back of `dst`.
+ * Whole buffers are relinked; only the nodes taken from the buffer that is
+ * split are copied. The nodes are reserved on `src->n` first, like a remove,
+ * and both locks are taken in address order. When they are all the nodes
+ * `src` holds, its whole list is relinked at once.
+ */
+static size_t
+qlane_splice(struct qlane *dst, struct qlane *src, size_t n)
+{
+	struct qnode_buff	*curr;
+	struct qnode_buff	*first;
+	struct qnode_buff	*last;
+	struct qnode		node;
+	size_t			m;
+	size_t			moved;
+
+	m = qlane_claim(src, n);
+	if (!m)
+		return (0);
+	THREADSAFEQ_LOCK(dst < src ? dst : src);
+	THREADSAFEQ_LOCK(dst < src ? src : dst);
+	first = NULL;
+	last = NULL;
+	moved = 0;
+	if (m == src->held)
+	{
+		first = src->head;
+		last = src->tail;
+		moved = m;
+		qlane_splice_charge(dst, src, src->nof_linked, src->linked_bytes);
+		src->head = NULL;
+		src->tail = NULL;
+	}
+	while (moved < m && src->head->wi - src->head->ri <= m - moved)
+	{
+		curr = src->head;
+		src->head = curr->next;
+		if (!src->head)
+			src->tail = NULL;
+		curr->next = NULL;
+		if (curr->ri == curr->wi)
+		{
+			qlane_chunk_put(src, curr);
+			continue ;
+		}
+		moved += curr->wi - curr->ri;
+		qlane_splice_charge(dst, src, 1, qlane_chunk_bytes(src, curr->sz));
+		if (last)
+			last->next = curr;
+		else
+			first = curr;
+		last = curr;
+	}
+	if (first)
+	{
+		if (dst->tail)
+			dst->tail->next = first;
+		else
+			dst->head = first;
+		dst->tail = last;
+	}
+	src->held -= moved;
+	dst->held += moved;
+	while (moved < m)
+	{
+		curr = src->head;
+		qlane_slot_get(src, curr, curr->ri, &node);
+		if (qlane_push(dst, &node))
+			break ;
+		++curr->ri;
+		--src->held;
+		++moved;
+	}
+	atomic_fetch_add(&dst->n, moved);
+	if (moved < m)
+		atomic_fetch_add(&src->n, m - moved);
+	THREADSAFEQ_UNLOCK(dst < src ? src : dst);
+	THREADSAFEQ_UNLOCK(dst < src ? dst : src);
+	return (moved);
+}
+
+/* Lane i of `src` goes to lane i modulo the lanes of `dst`. */
+static size_t
+threadsafeq_list_splice(struct threadsafeq *dst, struct threadsafeq *src, size_t n)
+{
+	size_t	moved;
+	size_t	i;
+
+	moved = 0;
+	i = 0;
+	while (i < src->nof_lane && moved < n)
+	{
+		moved += qlane_splice(dst->lanev + i % dst->nof_lane, src->lanev + i, n - moved);
+		++i;
+	}
+	return (moved);
+}
+
+static size_t
+threadsafeq_list_size(struct threadsafeq *q)
+{
+	size_t	n;
+	size_t	i;
+
+	n = 0;
+	i = 0;
+	while (i < q->nof_lane)
+	{
+		n += atomic_load(&q->lanev[i].n) + qspill_count(q->lanev + i);
+		++i;
+	}
+	return (n);
+}
+
+static void
+threadsafeq_list_delete(struct threadsafeq *q)
+{
+	size_t	i;
+
+	if (!q->lanev)
+		return ;
+	i = 0;
+	while (i < q->nof_lane)
+		qlane_delete(q->lanev + i++);
+	qops_free(q->alloc, q->lanev, sizeof (*q->lanev) * q->nof_lane, QOPS_CACHELINE);
+}
+
+/* Buffers come from the arena with THREADSAFEQ_ARENA_CHUNKS, from the queue's allocator otherwise. */
+static int
+qlane_new(struct threadsafeq *q, const struct threadsafeq_attr *attr)
+{
+	const struct qops_allocator	*chunk_alloc;
+	size_t				depth;
+	size_t				min;
+	size_t				i;
+
+	q->nof_lane = 1;
+	if (attr->type == THREADSAFEQ_SHARDED)
+		q->nof_lane = attr->lanes ? attr->lanes : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	else if (attr->type == THREADSAFEQ_LIST && attr->levels > 1)
+		q->nof_lane = attr->levels;
+	q->nof_lane = q->nof_lane ? q->nof_lane : 1;
+	q->lanev = qops_alloc(q->alloc, sizeof (*q->lanev) * q->nof_lane, QOPS_CACHELINE);
+	if (!q->lanev)
+		return (-1);
+	min = attr->buff_sz ? attr->buff_sz : QNODE_BUFF_DEFSIZE;
+	chunk_alloc = (attr->arena & THREADSAFEQ_ARENA_CHUNKS) ? &qarena_allocator : q->alloc;
+	depth = attr->spill_depth ? attr->spill_depth : min * QSPILL_DEFDEPTH;
+	i = 0;
+	while (i < q->nof_lane)
+	{
+		if (qlane_init(q->lanev + i, attr->lock, min, attr->buff_max, attr->compact, attr->inline_sz, chunk_alloc,
+			&q->mem))
+			break ;
+		if (attr->spill_dir && !(q->lanev[i].spill = qspill_new(attr->spill_dir, depth, q->alloc)))
+		{
+			qlock_destroy(&q->lanev[i].lock);
+			break ;
+		}
+		if (q->lanev[i].spill && q->capacity)
+		{
+			q->lanev[i].spill->dropped = &q->spill_dropped;
+			q->lanev[i].spill->weigh = q->weigh;
+		}
+		++i;
+	}
+	if (i == q->nof_lane)
+	{
+		qmem_charge(&q->mem, (sizeof (*q->lanev) + (attr->spill_dir ? sizeof (struct qspill) : 0)) * q->nof_lane, 0);
+		return (0);
+	}
+	while (i--)
+	{
+		if (q->lanev[i].spill)
+			qspill_delete(q->lanev[i].spill);
+		qlock_destroy(&q->lanev[i].lock);
+	}
+	qops_free(q->alloc, q->lanev, sizeof (*q->lanev) * q->nof_lane, QOPS_CACHELINE);
+	q->lanev = NULL;
+	return (-1);
+}
+
+static const struct threadsafeq_ops threadsafeq_list_ops =
+{
+	.append = threadsafeq_list_append,
+	.append_batch = threadsafeq_list_append_batch,
+	.remove = threadsafeq_list_remove,
+	.reserve = threadsafeq_list_reserve,
+	.remove_batch = threadsafeq_list_remove_batch,
+	.size = threadsafeq_list_size,
+	.delete = threadsafeq_list_delete,
+};
+
+/*
+ * Bounded MPMC ring (Vyukov). Each cell carries a sequence number:
+ * seq == pos means the cell is free for the producer claiming `pos`,
+ * seq == pos + 1 means it holds the node for the consumer claiming `pos`.
+ * Producers and consumers only contend on their own position counter.
+ */
+static size_t
+qring_bytes(size_t cap)
+{
+	return (QOPS_ALIGN_UP(sizeof (struct qring) + (sizeof (struct qring_cell) * cap), QOPS_CACHELINE));
+}
+
+static struct qring *
+qring_new(size_t size, const struct qops_allocator *a)
+{
+	struct qring	*ring;
+	size_t		cap;
+	size_t		i;
+
+	if (!size)
+		size = QNODE_BUFF_DEFSIZE;
+	cap = 1;
+	while (cap < size)
+		cap <<= 1;
+	ring = qops_alloc(a, qring_bytes(cap), QOPS_CACHELINE);
+	if (!ring)
+		return (NULL);
+	atomic_init(&ring->wpos, 0);
+	atomic_init(&ring->rpos, 0);
+	ring->mask = cap - 1;
+	i = 0;
+	while (i < cap)
+	{
+		atomic_init(&ring->cellv[i].seq, i);
+		++i;
+	}
+	return (ring);
+}
+
+static int
+threadsafeq_ring_append(struct threadsafeq *q, struct qnode *node)
+{
+	struct qring		*ring;
+	struct qring_cell	*cell;
+	size_t			pos;
+	intptr_t		dif;
+
+	ring = q->ring;
+	pos = atomic_load_explicit(&ring->wpos, memory_order_relaxed);
+	while (1)
+	{
+		cell = ring->cellv + (pos & ring->mask);
+		dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+		if (!dif)
+		{
+			if (atomic_compare_exchange_weak(&ring->wpos, &pos, pos + 1))
+				break ;
+		}
+		else if (dif < 0)
+			return (-1);
+		else
+			pos = atomic_load_explicit(&ring->wpos, memory_order_relaxed);
+	}
+	cell->node = *node;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return (0);
+}
+
+/* Claims `n` consecutive cells with a single CAS once all of them are free. */
+static int
+threadsafeq_ring_append_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	struct qring		*ring;
+	size_t			pos;
+	size_t			i;
+	intptr_t		dif;
+
+	ring = q->ring;
+	if (n > ring->mask + 1)
+		return (-1);
+	pos = atomic_load_explicit(&ring->wpos, memory_order_relaxed);
+	while (1)
+	{
+		i = 0;
+		dif = 0;
+		while (i < n && !dif)
+		{
+			dif = (intptr_t)atomic_load_explicit(&ring->cellv[(pos + i) & ring->mask].seq, memory_order_acquire) - (intptr_t)(pos + i);
+			i += !dif;
+		}
+		if (!dif)
+		{
+			if (atomic_compare_exchange_weak(&ring->wpos, &pos, pos + n))
+				break ;
+		}
+		else if (dif < 0)
+			return (-1);
+		else
+			pos = atomic_load_explicit(&ring->wpos, memory_order_relaxed);
+	}
+	i = 0;
+	while (i < n)
+	{
+		ring->cellv[(pos + i) & ring->mask].node = nodev[i];
+		atomic_store_explicit(&ring->cellv[(pos + i) & ring->mask].seq, pos + i + 1, memory_order_release);
+		++i;
+	}
+	return (0);
+}
+
+static int
+threadsafeq_ring_remove(struct threadsafeq *q, struct qnode *node)
+{
+	struct qring		*ring;
+	struct qring_cell	*cell;
+	size_t			pos;
+	intptr_t		dif;
+
+	ring = q->ring;
+	pos = atomic_load_explicit(&ring->rpos, memory_order_relaxed);
+	while (1)
+	{
+		cell = ring->cellv + (pos & ring->mask);
+		dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+		if (!dif)
+		{
+			if (atomic_compare_exchange_weak(&ring->rpos, &pos, pos + 1))
+				break ;
+		}
+		else if (dif < 0)
+			return (-1);
+		else
+			pos = atomic_load_explicit(&ring->rpos, memory_order_relaxed);
+	}
+	*node = cell->node;
+	atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+	return (0);
+}
+
+/* Claims the run of published cells at the read position, up to `n`, with a single CAS. */
+static size_t
+threadsafeq_ring_remove_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	struct qring		*ring;
+	size_t			pos;
+	size_t			i;
+	size_t			m;
+	intptr_t		dif;
+
+	ring = q->ring;
+	pos = atomic_load_explicit(&ring->rpos, memory_order_relaxed);
+	while (1)
+	{
+		m = 0;
+		dif = 0;
+		while (m < n && !dif)
+		{
+			dif = (intptr_t)atomic_load_explicit(&ring->cellv[(pos + m) & ring->mask].seq, memory_order_acquire) - (intptr_t)(pos + m + 1);
+			m += !dif;
+		}
+		if (m)
+		{
+			if (atomic_compare_exchange_weak(&ring->rpos, &pos, pos + m))
+				break ;
+		}
+		else if (dif < 0)
+			return (0);
+		else
+			pos = atomic_load_explicit(&ring->rpos, memory_order_relaxed);
+	}
+	i = 0;
+	while (i < m)
+	{
+		nodev[i] = ring->cellv[(pos + i) & ring->mask].node;
+		atomic_store_explicit(&ring->cellv[(pos + i) & ring->mask].seq, pos + i + ring->mask + 1, memory_order_release);
+		++i;
+	}
+	return (m);
+}
+
+/* The ring is preallocated, it only has to be large enough. */
+static int
+threadsafeq_ring_reserve(struct threadsafeq *q, size_t n)
+{
+	return (n > q->ring->mask + 1 ? -1 : 0);
+}
+
+static size_t
+threadsafeq_ring_size(struct threadsafeq *q)
+{
+	size_t	r;
+
+	r = atomic_load(&q->ring->rpos);
+	return (atomic_load(&q->ring->wpos) - r);
+}
+
+static void
+threadsafeq_ring_delete(struct threadsafeq *q)
+{
+	struct qnode	node;
+
+	if (!q->ring)
+		return ;
+	while (!threadsafeq_ring_remove(q, &node))
+		if (node.cleanup)
+			node.cleanup(node.data);
+	qops_free(q->alloc, q->ring, qring_bytes(q->ring->mask + 1), QOPS_CACHELINE);
+}
+
+static const struct threadsafeq_ops threadsafeq_ring_ops =
+{
+	.append = threadsafeq_ring_append,
+	.append_batch = threadsafeq_ring_append_batch,
+	.remove = threadsafeq_ring_remove,
+	.reserve = threadsafeq_ring_reserve,
+	.remove_batch = threadsafeq_ring_remove_batch,
+	.size = threadsafeq_ring_size,
+	.delete = threadsafeq_ring_delete,
+};
+
+/*
+ * Epoch based reclamation for the lock-free backends. A thread announces
+ * the global epoch while it may hold pointers into shared segments.
+ * Retired memory is freed once the global epoch has moved two steps past
+ * the epoch it was retired in, i.e. no thread can still reference it.
+ * The limbo lists of a thread are under its `lock`, so the owner of
+ * retired memory can take it back, see qebr_reclaim().
+ */
+#define QEBR_ACTIVE		1
+
+struct qebr_rec
+{
+	_Atomic size_t		local;
+	_Atomic int		used;
+	struct qebr_rec		*next;
+	pthread_mutex_t		lock;
+	struct qebr_node	*limbo[3];
+	size_t			limbo_epoch[3];
+};
+
+static _Atomic size_t			qebr_epoch = 0;
+static _Atomic(struct qebr_rec *)	qebr_recs = NULL;
+static pthread_key_t			qebr_key;
+static pthread_once_t			qebr_once = PTHREAD_ONCE_INIT;
+_Thread_local static struct qebr_rec	*qebr_self = NULL;
+
+static void
+qebr_release(void *data)
+{
+	struct qebr_rec	*rec;
+
+	rec = data;
+	atomic_store(&rec->local, 0);
+	atomic_store(&rec->used, 0);
+}
+
+static void
+qebr_init(void)
+{
+	pthread_key_create(&qebr_key, qebr_release);
+}
+
+static void
+qebr_free_list(struct qebr_node *node)
+{
+	struct qebr_node	*next;
+
+	while (node)
+	{
+		next = node->next;
+		node->free(node);
+		node = next;
+	}
+}
+
+static struct qebr_rec *
+qebr_acquire(void)
+{
+	struct qebr_rec	*rec;
+	int		used;
+
+	if (qebr_self)
+		return (qebr_self);
+	pthread_once(&qebr_once, qebr_init);
+	rec = atomic_load(&qebr_recs);
+	while (rec)
+	{
+		used = 0;
+		if (atomic_compare_exchange_strong(&rec->used, &used, 1))
+			break ;
+		rec = rec->next;
+	}
+	if (!rec)
+	{
+		rec = calloc(1, sizeof (*rec));
+		if (!rec)
+			return (NULL);
+		if (pthread_mutex_init(&rec->lock, NULL))
+		{
+			free(rec);
+			return (NULL);
+		}
+		atomic_init(&rec->used, 1);
+		rec->next = atomic_load(&qebr_recs);
+		while (!atomic_compare_exchange_weak(&qebr_recs, &rec->next, rec))
+			;
+	}
+	pthread_setspecific(qebr_key, rec);
+	qebr_self = rec;
+	return (rec);
+}
+
+static struct qebr_rec *
+qebr_enter(void)
+{
+	struct qebr_rec	*rec;
+
+	rec = qebr_acquire();
+	if (rec)
+		atomic_store(&rec->local, (atomic_load(&qebr_epoch) << 1) | QEBR_ACTIVE);
+	return (rec);
+}
+
+static void
+qebr_exit(struct qebr_rec *rec)
+{
+	if (rec)
+		atomic_store_explicit(&rec->local, 0, memory_order_release);
+}
+
+static void
+qebr_try_advance(void)
+{
+	struct qebr_rec	*rec;
+	size_t		epoch;
+	size_t		local;
+
+	epoch = atomic_load(&qebr_epoch);
+	rec = atomic_load(&qebr_recs);
+	while (rec)
+	{
+		local = atomic_load(&rec->local);
+		if ((local & QEBR_ACTIVE) && (local >> 1) != epoch)
+			return ;
+		rec = rec->next;
+	}
+	atomic_compare_exchange_strong(&qebr_epoch, &epoch, epoch + 1);
+}
+
+/* Called inside a critical section (between qebr_enter and qebr_exit). */
+static void
+qebr_retire(struct qebr_rec *rec, struct qebr_node *node)
+{
+	struct qebr_node	*old[3];
+	size_t			epoch;
+	size_t			i;
+
+	epoch = atomic_load(&qebr_epoch);
+	pthread_mutex_lock(&rec->lock);
+	i = 0;
+	while (i < 3)
+	{
+		old[i] = NULL;
+		if (rec->limbo[i] && rec->limbo_epoch[i] + 2 <= epoch)
+		{
+			old[i] = rec->limbo[i];
+			rec->limbo[i] = NULL;
+		}
+		++i;
+	}
+	i = epoch % 3;
+	rec->limbo_epoch[i] = epoch;
+	node->next = rec->limbo[i];
+	rec->limbo[i] = node;
+	pthread_mutex_unlock(&rec->lock);
+	i = 0;
+	while (i < 3)
+		qebr_free_list(old[i++]);
+	qebr_try_advance();
+}
+
+/*
+ * Frees the memory `owner` retired that still waits in the limbo lists of
+ * any thread, once a grace period has passed. The owner is going away and
+ * its memory may come from an allocator that does not outlive it.
+ */
+static void
+qebr_reclaim(const void *owner)
+{
+	struct qebr_node	*mine;
+	struct qebr_node	**link;
+	struct qebr_node	*node;
+	struct qebr_rec		*rec;
+	size_t			epoch;
+	size_t			i;
+
+	epoch = atomic_load(&qebr_epoch);
+	while (atomic_load(&qebr_epoch) < epoch + 2)
+	{
+		qebr_try_advance();
+		if (atomic_load(&qebr_epoch) < epoch + 2)
+			sched_yield();
+	}
+	mine = NULL;
+	rec = atomic_load(&qebr_recs);
+	while (rec)
+	{
+		pthread_mutex_lock(&rec->lock);
+		i = 0;
+		while (i < 3)
+		{
+			link = rec->limbo + i++;
+			while ((node = *link))
+			{
+				if (node->owner != owner)
+				{
+					link = &node->next;
+					continue ;
+				}
+				*link = node->next;
+				node->next = mine;
+				mine = node;
+			}
+		}
+		pthread_mutex_unlock(&rec->lock);
+		rec = rec->next;
+	}
+	qebr_free_list(mine);
+}
+
+/*
+ * Unbounded lock-free queue of segments. Producers claim a cell of the
+ * tail segment with fetch-and-add and link a new segment with CAS when it
+ * is exhausted. Consumers first reserve a node on `n`, then claim cells of
+ * the head segment the same way; a consumer that overtakes a producer marks
+ * the cell TAKEN and the producer retries on a later cell.
+ */
+static size_t
+qseg_bytes(size_t size)
+{
+	return (QOPS_ALIGN_UP(sizeof (struct qseg) + (sizeof (struct qseg_cell) * size), QOPS_CACHELINE));
+}
+
+/* Segments carry their allocator, they may be reclaimed after the queue is gone. */
+static void
+qseg_free(struct qebr_node *node)
+{
+	struct qseg	*seg;
+
+	seg = (struct qseg *)node;
+	qops_free(seg->alloc, seg, qseg_bytes(seg->sz), QOPS_CACHELINE);
+}
+
+static struct qseg *
+qseg_new(size_t size, const struct qops_allocator *a, const struct qseg_list *list)
+{
+	struct qseg	*seg;
+	size_t		i;
+
+	seg = qops_alloc(a, qseg_bytes(size), QOPS_CACHELINE);
+	if (!seg)
+		return (NULL);
+	seg->retire = (struct qebr_node){.next = NULL, .free = qseg_free, .owner = list};
+	seg->alloc = a;
+	seg->sz = size;
+	atomic_init(&seg->wi, 0);
+	atomic_init(&seg->ri, 0);
+	atomic_init(&seg->next, NULL);
+	i = 0;
+	while (i < size)
+		atomic_init(&seg->cellv[i++].state, QSEG_EMPTY);
+	return (seg);
+}
+
+static struct qseg_list *
+qseg_list_new(size_t size, const struct qops_allocator *a)
+{
+	struct qseg_list	*list;
+	struct qseg		*seg;
+
+	list = qops_alloc(a, sizeof (*list), QOPS_CACHELINE);
+	if (!list)
+		return (NULL);
+	seg = qseg_new(size, a, list);
+	if (!seg)
+	{
+		qops_free(a, list, sizeof (*list), QOPS_CACHELINE);
+		return (NULL);
+	}
+	atomic_init(&list->head, seg);
+	atomic_init(&list->tail, seg);
+	return (list);
+}
+
+static int
+threadsafeq_lflist_append(struct threadsafeq *q, struct qnode *node)
+{
+	struct qebr_rec		*rec;
+	struct qseg		*seg;
+	struct qseg		*next;
+	size_t			i;
+	int			state;
+	int			ret;
+
+	rec = qebr_enter();
+	if (!rec)
+		return (-1);
+	ret = -1;
+	while (1)
+	{
+		seg = atomic_load(&q->lf->tail);
+		i = atomic_fetch_add(&seg->wi, 1);
+		if (i < seg->sz)
+		{
+			state = QSEG_EMPTY;
+			if (!atomic_compare_exchange_strong(&seg->cellv[i].state, &state, QSEG_BUSY))
+				continue ;
+			seg->cellv[i].node = *node;
+			atomic_store_explicit(&seg->cellv[i].state, QSEG_FULL, memory_order_release);
+			ret = 0;
+			break ;
+		}
+		next = atomic_load(&seg->next);
+		if (next)
+		{
+			atomic_compare_exchange_strong(&q->lf->tail, &seg, next);
+			continue ;
+		}
+		next = qseg_new(seg->sz, seg->alloc, q->lf);
+		if (!next)
+			break ;
+		next->cellv[0].node = *node;
+		atomic_init(&next->cellv[0].state, QSEG_FULL);
+		atomic_init(&next->wi, 1);
+		if (atomic_compare_exchange_strong(&seg->next, &(struct qseg *){NULL}, next))
+		{
+			qmem_charge(&q->mem, qseg_bytes(next->sz), 1);
+			atomic_compare_exchange_strong(&q->lf->tail, &seg, next);
+			ret = 0;
+			break ;
+		}
+		qseg_free(&next->retire);
+	}
+	qebr_exit(rec);
+	if (!ret)
+		atomic_fetch_add(&q->n, 1);
+	return (ret);
+}
+
+static int
+threadsafeq_lflist_remove(struct threadsafeq *q, struct qnode *node)
+{
+	struct qebr_rec		*rec;
+	struct qseg		*seg;
+	struct qseg		*next;
+	struct qseg		*tail;
+	size_t			n;
+	size_t			i;
+	int			state;
+
+	n = atomic_load(&q->n);
+	while (n && !atomic_compare_exchange_weak(&q->n, &n, n - 1))
+		;
+	if (!n)
+		return (-1);
+	rec = qebr_enter();
+	if (!rec)
+	{
+		atomic_fetch_add(&q->n, 1);
+		return (-1);
+	}
+	while (1)
+	{
+		seg = atomic_load(&q->lf->head);
+		i = atomic_fetch_add(&seg->ri, 1);
+		if (i < seg->sz)
+		{
+			state = QSEG_EMPTY;
+			if (atomic_compare_exchange_strong(&seg->cellv[i].state, &state, QSEG_TAKEN))
+				continue ;
+			while (state == QSEG_BUSY)
+			{
+				sched_yield();
+				state = atomic_load_explicit(&seg->cellv[i].state, memory_order_acquire);
+			}
+			*node = seg->cellv[i].node;
+			break ;
+		}
+		next = atomic_load(&seg->next);
+		if (!next)
+		{
+			sched_yield();
+			continue ;
+		}
+		tail = seg;
+		atomic_compare_exchange_strong(&q->lf->tail, &tail, next);
+		if (atomic_compare_exchange_strong(&q->lf->head, &seg, next))
+		{
+			qmem_uncharge(&q->mem, qseg_bytes(seg->sz), 1);
+			qebr_retire(rec, &seg->retire);
+		}
+	}
+	qebr_exit(rec);
+	return (0);
+}
+
+static size_t
+threadsafeq_lflist_size(struct threadsafeq *q)
+{
+	return (atomic_load(&q->n));
+}
+
+/* Only called from threadsafeq_delete, no other thread may use the queue. */
+static void
+threadsafeq_lflist_delete(struct threadsafeq *q)
+{
+	struct qseg	*seg;
+	struct qseg	*next;
+	size_t		i;
+	size_t		end;
+
+	if (!q->lf)
+		return ;
+	seg = atomic_load(&q->lf->head);
+	while (seg)
+	{
+		i = atomic_load(&seg->ri);
+		end = atomic_load(&seg->wi);
+		end = end < seg->sz ? end : seg->sz;
+		while (i < end)
+		{
+			if (atomic_load(&seg->cellv[i].state) == QSEG_FULL && seg->cellv[i].node.cleanup)
+				seg->cellv[i].node.cleanup(seg->cellv[i].node.data);
+			++i;
+		}
+		next = atomic_load(&seg->next);
+		qseg_free(&seg->retire);
+		seg = next;
+	}
+	/* Drained segments may still wait in the limbo of the threads that removed from the queue. */
+	qebr_reclaim(q->lf);
+	atomic_store(&q->n, 0);
+	qops_free(q->alloc, q->lf, sizeof (*q->lf), QOPS_CACHELINE);
+}
+
+static const struct threadsafeq_ops threadsafeq_lflist_ops =
+{
+	.append = threadsafeq_lflist_append,
+	.remove = threadsafeq_lflist_remove,
+	.size = threadsafeq_lflist_size,
+	.delete = threadsafeq_lflist_delete,
+};
+
+/*
+ * Single producer, single consumer ring. Each side owns its index and keeps
+ * a cached copy of the other side's index, so the shared cache lines are
+ * only read when the cached view says the ring is full or empty.
+ */
+static size_t
+qspsc_bytes(size_t cap)
+{
+	return (QOPS_ALIGN_UP(sizeof (struct qspsc) + (sizeof (struct qnode) * cap), QOPS_CACHELINE));
+}
+
+static struct qspsc *
+qspsc_new(size_t size, const struct qops_allocator *a)
+{
+	struct qspsc	*ring;
+	size_t		cap;
+
+	if (!size)
+		size = QNODE_BUFF_DEFSIZE;
+	cap = 1;
+	while (cap < size)
+		cap <<= 1;
+	ring = qops_alloc(a, qspsc_bytes(cap), QOPS_CACHELINE);
+	if (!ring)
+		return (NULL);
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->cached_head = 0;
+	ring->cached_tail = 0;
+	ring->mask = cap - 1;
+	return (ring);
+}
+
+static int
+threadsafeq_spsc_append(struct threadsafeq *q, struct qnode *node)
+{
+	struct qspsc	*ring;
+	size_t		tail;
+
+	ring = q->spsc;
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - ring->cached_head > ring->mask)
+	{
+		ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (tail - ring->cached_head > ring->mask)
+			return (-1);
+	}
+	ring->nodev[tail & ring->mask] = *node;
+	/* seq_cst so that the store is ordered before the idle worker check in on_append */
+	atomic_store(&ring->tail, tail + 1);
+	return (0);
+}
+
+static int
+threadsafeq_spsc_append_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	struct qspsc	*ring;
+	size_t		tail;
+	size_t		i;
+
+	ring = q->spsc;
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail + n - ring->cached_head > ring->mask + 1)
+	{
+		ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (tail + n - ring->cached_head > ring->mask + 1)
+			return (-1);
+	}
+	i = 0;
+	while (i < n)
+	{
+		ring->nodev[(tail + i) & ring->mask] = nodev[i];
+		++i;
+	}
+	atomic_store(&ring->tail, tail + n);
+	return (0);
+}
+
+static int
+threadsafeq_spsc_remove(struct threadsafeq *q, struct qnode *node)
+{
+	struct qspsc	*ring;
+	size_t		head;
+
+	ring = q->spsc;
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head == ring->cached_tail)
+	{
+		ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (head == ring->cached_tail)
+			return (-1);
+	}
+	*node = ring->nodev[head & ring->mask];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return (0);
+}
+
+static size_t
+threadsafeq_spsc_remove_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	struct qspsc	*ring;
+	size_t		head;
+	size_t		i;
+
+	ring = q->spsc;
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (ring->cached_tail - head < n)
+		ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (ring->cached_tail - head < n)
+		n = ring->cached_tail - head;
+	i = 0;
+	while (i < n)
+	{
+		nodev[i] = ring->nodev[(head + i) & ring->mask];
+		++i;
+	}
+	if (n)
+		atomic_store_explicit(&ring->head, head + n, memory_order_release);
+	return (n);
+}
+
+static int
+threadsafeq_spsc_reserve(struct threadsafeq *q, size_t n)
+{
+	return (n > q->spsc->mask + 1 ? -1 : 0);
+}
+
+static size_t
+threadsafeq_spsc_size(struct threadsafeq *q)
+{
+	size_t	head;
+
+	head = atomic_load(&q->spsc->head);
+	return (atomic_load(&q->spsc->tail) - head);
+}
+
+static void
+threadsafeq_spsc_delete(struct threadsafeq *q)
+{
+	struct qnode	node;
+
+	if (!q->spsc)
+		return ;
+	while (!threadsafeq_spsc_remove(q, &node))
+		if (node.cleanup)
+			node.cleanup(node.data);
+	qops_free(q->alloc, q->spsc, qspsc_bytes(q->spsc->mask + 1), QOPS_CACHELINE);
+}
+
+static const struct threadsafeq_ops threadsafeq_spsc_ops =
+{
+	.append = threadsafeq_spsc_append,
+	.append_batch = threadsafeq_spsc_append_batch,
+	.remove = threadsafeq_spsc_remove,
+	.reserve = threadsafeq_spsc_reserve,
+	.remove_batch = threadsafeq_spsc_remove_batch,
+	.size = threadsafeq_spsc_size,
+	.delete = threadsafeq_spsc_delete,
+};
+
+/*
+ * Flat combining over a single lane. A thread publishes its request in a
+ * slot and whoever wins the lane lock applies every published request in
+ * one pass, so N contending threads cost one lock handoff instead of N.
+ */
+static struct qfc_slot *
+qfc_claim(struct threadsafeq *q)
+{
+	struct qfc_slot	*slot;
+	size_t		i;
+	size_t		k;
+	int		state;
+
+	if (qops_thread_id == SIZE_MAX)
+		qops_thread_id = atomic_fetch_add(&qops_thread_cnt, 1);
+	i = qops_thread_id % QOPS_FC_SLOTS;
+	k = 0;
+	while (1)
+	{
+		slot = q->fc + i;
+		state = QFC_FREE;
+		if (atomic_load_explicit(&slot->op, memory_order_relaxed) == QFC_FREE
+			&& atomic_compare_exchange_strong(&slot->op, &state, QFC_CLAIMED))
+			return (slot);
+		if (++i == QOPS_FC_SLOTS)
+			i = 0;
+		if (!(++k % QOPS_FC_SLOTS))
+			sched_yield();
+	}
+}
+
+/* Lane lock held. */
+static void
+qfc_combine(struct threadsafeq *q)
+{
+	struct qlane	*lane;
+	struct qfc_slot	*slot;
+	size_t		i;
+	size_t		k;
+	int		op;
+
+	lane = q->lanev;
+	i = 0;
+	while (i < QOPS_FC_SLOTS)
+	{
+		slot = q->fc + i++;
+		op = atomic_load_explicit(&slot->op, memory_order_acquire);
+		if (op == QFC_APPEND)
+		{
+			slot->ret = qlane_put(lane, &slot->node);
+		}
+		else if (op == QFC_APPEND_BATCH)
+		{
+			slot->ret = qlane_put_batch(lane, slot->nodev, slot->nof_node);
+		}
+		else if (op == QFC_REMOVE_BATCH)
+		{
+			if (!atomic_load_explicit(&lane->n, memory_order_relaxed) && qspill_count(lane))
+				qspill_refill(lane);
+			k = qlane_claim(lane, slot->nof_node);
+			slot->ret = 0;
+			while ((size_t)slot->ret < k)
+				qlane_pop(lane, slot->nodev + slot->ret++);
+		}
+		else if (op == QFC_REMOVE)
+		{
+			if (!atomic_load_explicit(&lane->n, memory_order_relaxed) && qspill_count(lane))
+				qspill_refill(lane);
+			slot->ret = -1;
+			if (qlane_claim(lane, 1))
+			{
+				qlane_pop(lane, &slot->node);
+				slot->ret = 0;
+			}
+		}
+		else
+			continue ;
+		atomic_store_explicit(&slot->op, QFC_DONE, memory_order_release);
+	}
+}
+
+/* Publishes the claimed slot and waits until a combiner has applied it. */
+static int
+qfc_apply(struct threadsafeq *q, struct qfc_slot *slot, int op)
+{
+	size_t		spin;
+	int		ret;
+
+	atomic_store_explicit(&slot->op, op, memory_order_release);
+	spin = 0;
+	while (atomic_load_explicit(&slot->op, memory_order_acquire) != QFC_DONE)
+	{
+		if (!THREADSAFEQ_TRYLOCK(q->lanev))
+		{
+			qfc_combine(q);
+			THREADSAFEQ_UNLOCK(q->lanev);
+		}
+		else if (++spin % QOPS_FC_SPIN == 0)
+			sched_yield();
+	}
+	ret = slot->ret;
+	return (ret);
+}
+
+static void
+qfc_release(struct qfc_slot *slot)
+{
+	atomic_store_explicit(&slot->op, QFC_FREE, memory_order_release);
+}
+
+static int
+threadsafeq_flatcomb_append(struct threadsafeq *q, struct qnode *node)
+{
+	struct qfc_slot	*slot;
+	int		ret;
+
+	slot = qfc_claim(q);
+	slot->node = *node;
+	ret = qfc_apply(q, slot, QFC_APPEND);
+	qfc_release(slot);
+	return (ret);
+}
+
+static int
+threadsafeq_flatcomb_append_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	struct qfc_slot	*slot;
+	int		ret;
+
+	slot = qfc_claim(q);
+	slot->nodev = nodev;
+	slot->nof_node = n;
+	ret = qfc_apply(q, slot, QFC_APPEND_BATCH);
+	qfc_release(slot);
+	return (ret);
+}
+
+static int
+threadsafeq_flatcomb_remove(struct threadsafeq *q, struct qnode *node)
+{
+	struct qfc_slot	*slot;
+	int		ret;
+
+	if (!atomic_load(&q->lanev->n) && !qspill_count(q->lanev))
+		return (-1);
+	slot = qfc_claim(q);
+	ret = qfc_apply(q, slot, QFC_REMOVE);
+	if (!ret)
+		*node = slot->node;
+	qfc_release(slot);
+	return (ret);
+}
+
+static size_t
+threadsafeq_flatcomb_remove_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	struct qfc_slot	*slot;
+	int		ret;
+
+	if (!atomic_load(&q->lanev->n) && !qspill_count(q->lanev))
+		return (0);
+	slot = qfc_claim(q);
+	slot->nodev = nodev;
+	slot->nof_node = n;
+	ret = qfc_apply(q, slot, QFC_REMOVE_BATCH);
+	qfc_release(slot);
+	return ((size_t)ret);
+}
+
+static void
+threadsafeq_flatcomb_delete(struct threadsafeq *q)
+{
+	threadsafeq_list_delete(q);
+	qops_free(q->alloc, q->fc, sizeof (*q->fc) * QOPS_FC_SLOTS, QOPS_CACHELINE);
+}
+
+static const struct threadsafeq_ops threadsafeq_flatcomb_ops =
+{
+	.append = threadsafeq_flatcomb_append,
+	.append_batch = threadsafeq_flatcomb_append_batch,
+	.remove = threadsafeq_flatcomb_remove,
+	.reserve = threadsafeq_list_reserve,
+	.remove_batch = threadsafeq_flatcomb_remove_batch,
+	.size = threadsafeq_list_size,
+	.delete = threadsafeq_flatcomb_delete,
+};
+
+/*
+ * Ring shared between processes (Vyukov, like the RING backend) in a memfd
+ * segment. A cell carries a task class id, a data word and an inline
+ * payload, so no pointer into one process is needed by another. Class ids
+ * are those of qclass_register(), which must agree in every process; only
+ * the `nof_class` classes registered when the segment was created may
+ * cross it.
+ *
+ * A consumer process sleeps on the `bell` futex in a thread of its own,
+ * counted in `sleeping`, and passes appends on to its workers. A producer
+ * only rings when a process sleeps and the ring was empty before its cell,
+ * that is when no worker may be running to find it.
+ */
+static size_t
+qshm_cell_bytes(size_t inline_sz)
+{
+	return (sizeof (struct qshm_cell) + QOPS_ALIGN_UP(inline_sz, _Alignof (max_align_t)));
+}
+
+static struct qshm_cell *
+qshm_cell(struct qshm *shm, size_t pos)
+{
+	return ((struct qshm_cell *)(void *)((char *)shm + QOPS_ALIGN_UP(sizeof (*shm), QOPS_CACHELINE)
+		+ (pos & shm->mask) * shm->cell_sz));
+}
+
+/* Creates the segment, or maps the one of `fd` when it is not -1. */
+static int
+qshm_new(struct threadsafeq *q, const struct threadsafeq_attr *attr, int fd)
+{
+	struct qshm	*shm;
+	struct stat	st;
+	size_t		cap;
+	size_t		bytes;
+
+	if (fd < 0)
+	{
+		cap = 1;
+		while (cap < (attr->buff_sz ? attr->buff_sz : QNODE_BUFF_DEFSIZE))
+			cap <<= 1;
+		bytes = QOPS_ALIGN_UP(sizeof (*shm), QOPS_CACHELINE) + cap * qshm_cell_bytes(attr->inline_sz);
+		fd = memfd_create("qops", MFD_CLOEXEC);
+		if (fd < 0)
+			return (-1);
+		if (ftruncate(fd, (off_t)bytes))
+			goto err;
+	}
+	else
+	{
+		fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0)
+			return (-1);
+		if (fstat(fd, &st) || (size_t)st.st_size < QOPS_ALIGN_UP(sizeof (*shm), QOPS_CACHELINE))
+			goto err;
+		bytes = (size_t)st.st_size;
+		cap = 0;
+	}
+	shm = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		goto err;
+	if (cap)
+	{
+		shm->magic = QSHM_MAGIC;
+		shm->mask = cap - 1;
+		shm->cell_sz = qshm_cell_bytes(attr->inline_sz);
+		shm->bytes = bytes;
+		shm->nof_class = atomic_load(&qclass_cnt);
+		atomic_init(&shm->wpos, 0);
+		atomic_init(&shm->rpos, 0);
+		atomic_init(&shm->bell, 0);
+		atomic_init(&shm->sleeping, 0);
+		while (cap--)
+			atomic_init(&qshm_cell(shm, cap)->seq, cap);
+	}
+	/* The geometry of a mapped segment is checked before a cell is touched. */
+	else if (shm->magic != QSHM_MAGIC || shm->bytes != bytes || shm->nof_class > QCLASS_MAX
+		|| (shm->mask & (shm->mask + 1)) || shm->cell_sz < sizeof (struct qshm_cell)
+		|| shm->cell_sz % _Alignof (max_align_t) || shm->mask >= (bytes - QOPS_ALIGN_UP(sizeof (*shm), QOPS_CACHELINE))
+		/ shm->cell_sz)
+	{
+		munmap(shm, bytes);
+		goto err;
+	}
+	q->shm = shm;
+	q->shm_fd = fd;
+	return (0);
+err:
+	close(fd);
+	return (-1);
+}
+
+/* Claims the cell at the write position, or returns NULL if the ring is full. */
+static struct qshm_cell *
+qshm_claim(struct qshm *shm, size_t *posp)
+{
+	struct qshm_cell	*cell;
+	size_t			pos;
+	intptr_t		dif;
+
+	pos = atomic_load_explicit(&shm->wpos, memory_order_relaxed);
+	while (1)
+	{
+		cell = qshm_cell(shm, pos);
+		dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+		if (!dif)
+		{
+			if (atomic_compare_exchange_weak(&shm->wpos, &pos, pos + 1))
+				break ;
+		}
+		else if (dif < 0)
+			return (NULL);
+		else
+			pos = atomic_load_explicit(&shm->wpos, memory_order_relaxed);
+	}
+	*posp = pos;
+	return (cell);
+}
+
+static void
+qshm_publish(struct qshm *shm, struct qshm_cell *cell, size_t pos)
+{
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_seq_cst);
+	if (atomic_load(&shm->sleeping) && atomic_load(&shm->rpos) >= pos)
+	{
+		atomic_fetch_add(&shm->bell, 1);
+		qlock_futex(&shm->bell, FUTEX_WAKE, INT_MAX);
+	}
+}
+
+/*
+ * Class of `node` on the segment: registered explicitly, and before the
+ * segment was created. SIZE_MAX otherwise, as the consumers would not know it.
+ */
+static size_t
+qshm_class(struct qshm *shm, const struct qnode *node)
+{
+	size_t	cls;
+
+	cls = qclass_find(node);
+	return (cls < shm->nof_class ? cls : SIZE_MAX);
+}
+
+/* Data words are stored as they are, see threadsafeq_shm_attach(). */
+static int
+threadsafeq_shm_append(struct threadsafeq *q, struct qnode *node)
+{
+	struct qshm_cell	*cell;
+	size_t			cls;
+	size_t			pos;
+
+	cls = qshm_class(q->shm, node);
+	if (cls == SIZE_MAX)
+		return (-1);
+	cell = qshm_claim(q->shm, &pos);
+	if (!cell)
+		return (-1);
+	cell->cls = (uint32_t)cls;
+	cell->len = QSHM_WORD;
+	cell->word = (uintptr_t)node->data;
+	cell->deadline = node->deadline;
+	qshm_publish(q->shm, cell, pos);
+	return (0);
+}
+
+/* Runs the cleanup of a task with an inline payload, then gives its cell back to the producers. */
+static void
+qshm_cleanup(void *data)
+{
+	struct qshm_cell	*cell;
+	void			(*cleanup)(void *data);
+
+	cell = (struct qshm_cell *)data - 1;
+	cleanup = qclass_tab[cell->cls].cleanup;
+	if (cleanup)
+		cleanup(data);
+	atomic_store_explicit(&cell->seq, cell->word, memory_order_release);
+}
+
+/*
+ * The cell of a data word is released at once. The cell of a payload is
+ * released by its cleanup, so the payload stays valid while the task runs;
+ * until then a producer coming round to it finds the ring full. Cells of
+ * cancelled reservations and of classes unknown to this process are skipped.
+ */
+static int
+threadsafeq_shm_remove(struct threadsafeq *q, struct qnode *node)
+{
+	struct qshm		*shm;
+	struct qshm_cell	*cell;
+	struct qclass		*cls;
+	size_t			pos;
+	intptr_t		dif;
+
+	shm = q->shm;
+	pos = atomic_load_explicit(&shm->rpos, memory_order_relaxed);
+	while (1)
+	{
+		cell = qshm_cell(shm, pos);
+		dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+		if (dif < 0)
+			return (-1);
+		if (dif > 0 || !atomic_compare_exchange_weak(&shm->rpos, &pos, pos + 1))
+		{
+			pos = atomic_load_explicit(&shm->rpos, memory_order_relaxed);
+			continue ;
+		}
+		if (cell->len == QSHM_SKIP || cell->cls >= shm->nof_class
+			|| cell->cls >= atomic_load_explicit(&qclass_cnt, memory_order_acquire))
+		{
+			atomic_store_explicit(&cell->seq, pos + shm->mask + 1, memory_order_release);
+			pos = atomic_load_explicit(&shm->rpos, memory_order_relaxed);
+			continue ;
+		}
+		break ;
+	}
+	cls = qclass_tab + cell->cls;
+	*node = (struct qnode){.func = cls->func, .err = cls->err, .cleanup = cls->cleanup, .data = (void *)cell->word,
+		.deadline = cell->deadline};
+	if (cell->len == QSHM_WORD)
+	{
+		atomic_store_explicit(&cell->seq, pos + shm->mask + 1, memory_order_release);
+		return (0);
+	}
+	/* The word is free once the payload is out, it holds the sequence to release. */
+	cell->word = pos + shm->mask + 1;
+	node->data = cell + 1;
+	node->cleanup = qshm_cleanup;
+	return (0);
+}
+
+static size_t
+threadsafeq_shm_size(struct threadsafeq *q)
+{
+	size_t	r;
+	size_t	w;
+
+	r = atomic_load(&q->shm->rpos);
+	w = atomic_load(&q->shm->wpos);
+	return (w > r ? w - r : 0);
+}
+
+static void *
+qshm_bell(void *data)
+{
+	struct threadsafeq	*q;
+	struct qshm		*shm;
+	size_t			n;
+	int			v;
+
+	q = data;
+	shm = q->shm;
+	while (!atomic_load(&q->bell_stop))
+	{
+		v = atomic_load(&shm->bell);
+		atomic_fetch_add(&shm->sleeping, 1);
+		n = threadsafeq_shm_size(q);
+		if (n)
+		{
+			pthread_mutex_lock(&q->lock);
+			if (q->on_append)
+				q->on_append(q->signal_data, n);
+			pthread_mutex_unlock(&q->lock);
+		}
+		if (!atomic_load(&q->bell_stop))
+			qlock_futex(&shm->bell, FUTEX_WAIT, v);
+		atomic_fetch_sub(&shm->sleeping, 1);
+	}
+	return (NULL);
+}
+
+/* Started by the first pool on the queue, a process that only appends needs no thread. */
+static void
+qshm_bell_start(struct threadsafeq *q)
+{
+	if (!q->bell_on && !pthread_create(&q->bell_thread, NULL, qshm_bell, q))
+		q->bell_on = 1;
+}
+
+static void
+threadsafeq_shm_delete(struct threadsafeq *q)
+{
+	if (!q->shm)
+		return ;
+	if (q->bell_on)
+	{
+		atomic_store(&q->bell_stop, 1);
+		atomic_fetch_add(&q->shm->bell, 1);
+		qlock_futex(&q->shm->bell, FUTEX_WAKE, INT_MAX);
+		pthread_join(q->bell_thread, NULL);
+	}
+	munmap(q->shm, q->shm->bytes);
+	close(q->shm_fd);
+}
+
+static const struct threadsafeq_ops threadsafeq_shm_ops =
+{
+	.append = threadsafeq_shm_append,
+	.remove = threadsafeq_shm_remove,
+	.size = threadsafeq_shm_size,
+	.delete = threadsafeq_shm_delete,
+};
+
+/* Claims a cell for threadsafeq_reserve_slot(); it is published or skipped by the commit. */
+static void *
+qshm_reserve_slot(struct threadsafeq *q, size_t len)
+{
+	struct qshm_cell	*cell;
+	size_t			pos;
+
+	if (len > q->shm->cell_sz - sizeof (*cell))
+		return (NULL);
+	cell = qshm_claim(q->shm, &pos);
+	if (!cell)
+		return (NULL);
+	cell->word = pos;
+	cell->len = (uint32_t)len;
+	qshm_slot_held = cell;
+	return (cell + 1);
+}
+
+static int
+qshm_commit_slot(struct threadsafeq *q, void *slot, struct qnode *node)
+{
+	struct qshm_cell	*cell;
+	size_t			cls;
+
+	cell = qshm_slot_held;
+	qshm_slot_held = NULL;
+	/* A wrong slot still gives up the claimed cell, or it would hold up the consumers for good. */
+	cls = node && slot == cell + 1 ? qshm_class(q->shm, node) : SIZE_MAX;
+	cell->cls = (uint32_t)(cls == SIZE_MAX ? 0 : cls);
+	cell->deadline = node ? node->deadline : 0;
+	if (cls == SIZE_MAX)
+		cell->len = QSHM_SKIP;
+	qshm_publish(q->shm, cell, cell->word);
+	if (cls == SIZE_MAX)
+		return (node || slot != cell + 1 ? -1 : 0);
+	if (q->on_append)
+		q->on_append(q->signal_data, 1);
+	return (0);
+}
+
+/*
+ * Priority levels of a LIST queue: lane i holds level i, level 0 first.
+ * Bit i of `map` is set while lane i may hold nodes, so the next level is a
+ * single find-first-set. An append sets the bit after counting its node; a
+ * remove that finds the lane empty clears it and sets it again if a node
+ * came in meanwhile, so a set bit may be stale but a non-empty lane always
+ * has its bit.
+ */
+static int
+qprio_new(struct threadsafeq *q, const struct threadsafeq_attr *attr)
+{
+	struct qprio	*pr;
+	size_t		i;
+
+	pr = qops_alloc(q->alloc, sizeof (*pr), _Alignof (struct qprio));
+	if (!pr)
+		return (-1);
+	pr->policy = attr->prio_policy;
+	pr->aging_usec = attr->prio_aging_usec;
+	pr->nof_level = q->nof_lane;
+	pr->quantum_ns = (int64_t)(attr->prio_quantum_usec ? attr->prio_quantum_usec : QPRIO_QUANTUM) * 1000;
+	pr->period_usec = attr->prio_period_usec ? attr->prio_period_usec : QPRIO_PERIOD;
+	pr->quota_on = attr->prio_quota_usec != NULL;
+	atomic_init(&pr->map, 0);
+	atomic_init(&pr->period_start, qops_now_usec());
+	atomic_init(&pr->cursor, 0);
+	atomic_init(&pr->round, 0);
+	i = 0;
+	while (i < q->nof_lane)
+	{
+		pr->weightv[i] = attr->prio_weights && attr->prio_weights[i] ? attr->prio_weights[i]
+			: pr->policy == THREADSAFEQ_PRIO_FAIR ? 1 : q->nof_lane - i;
+		pr->quotav[i] = attr->prio_quota_usec ? (uint64_t)attr->prio_quota_usec[i] * 1000 : 0;
+		atomic_init(&pr->creditv[i], pr->weightv[i]);
+		atomic_init(&pr->sincev[i], 0);
+		atomic_init(&pr->deficitv[i], 0);
+		atomic_init(&pr->estv[i], 0);
+		atomic_init(&pr->usedv[i], 0);
+		atomic_init(&pr->cpuv[i], 0);
+		++i;
+	}
+	q->prio = pr;
+	qmem_charge(&q->mem, sizeof (*pr), 0);
+	return (0);
+}
+
+static void
+qprio_mark(struct threadsafeq *q, size_t level)
+{
+	uint64_t	bit;
+
+	bit = (uint64_t)1 << level;
+	if (!(atomic_fetch_or(&q->prio->map, bit) & bit) && q->prio->aging_usec)
+		atomic_store_explicit(&q->prio->sincev[level], qops_now_usec(), memory_order_relaxed);
+}
+
+static void
+qprio_unmark(struct threadsafeq *q, size_t level)
+{
+	uint64_t	bit;
+
+	bit = (uint64_t)1 << level;
+	atomic_fetch_and(&q->prio->map, ~bit);
+	if (atomic_load(&q->lanev[level].n) || qspill_count(q->lanev + level))
+		atomic_fetch_or(&q->prio->map, bit);
+}
+
+/*
+ * THREADSAFEQ_PRIO_WEIGHTED: the first level of `map` with credit left,
+ * which pays one credit per task; `*n` is cut down to the credit taken.
+ * Once every waiting level has used up its credit, all levels start a new
+ * round with their weight.
+ */
+static size_t
+qprio_pick(struct qprio *pr, uint64_t map, size_t nof_level, size_t *n)
+{
+	uint64_t	m;
+	size_t		c;
+	size_t		k;
+	size_t		i;
+
+	if (pr->policy != THREADSAFEQ_PRIO_WEIGHTED)
+		return ((size_t)__builtin_ctzll(map));
+	m = map;
+	while (m)
+	{
+		i = (size_t)__builtin_ctzll(m);
+		c = atomic_load_explicit(&pr->creditv[i], memory_order_relaxed);
+		k = c < *n ? c : *n;
+		while (c && !atomic_compare_exchange_weak(&pr->creditv[i], &c, c - k))
+			k = c < *n ? c : *n;
+		if (c)
+		{
+			*n = k;
+			return (i);
+		}
+		m &= m - 1;
+	}
+	i = (size_t)__builtin_ctzll(map);
+	k = pr->weightv[i] < *n ? pr->weightv[i] : *n;
+	c = 0;
+	while (c < nof_level)
+	{
+		atomic_store_explicit(&pr->creditv[c], pr->weightv[c] - (c == i ? k : 0), memory_order_relaxed);
+		++c;
+	}
+	*n = k;
+	return (i);
+}
+
+/* With aging, the first waiting level that was not served for `aging_usec`. */
+static size_t
+qprio_aged(struct qprio *pr, uint64_t map)
+{
+	uint64_t	now;
+	size_t		i;
+
+	if (!pr->aging_usec || !(map & (map - 1)))
+		return (SIZE_MAX);
+	now = qops_now_usec();
+	map &= map - 1;
+	while (map)
+	{
+		i = (size_t)__builtin_ctzll(map);
+		if (now - atomic_load_explicit(&pr->sincev[i], memory_order_relaxed) >= pr->aging_usec)
+			return (i);
+		map &= map - 1;
+	}
+	return (SIZE_MAX);
+}
+
+/*
+ * THREADSAFEQ_PRIO_FAIR with quotas: the tenants of `map` that used up their
+ * quota in the current period, which starts over once `period_usec` passed.
+ * `wait` gets the microseconds left in the period.
+ */
+static uint64_t
+qprio_throttled(struct qprio *pr, uint64_t map, uint64_t *wait)
+{
+	uint64_t	start;
+	uint64_t	now;
+	uint64_t	out;
+	size_t		i;
+
+	*wait = 0;
+	if (!pr->quota_on)
+		return (0);
+	now = qops_now_usec();
+	start = atomic_load(&pr->period_start);
+	if (now - start >= pr->period_usec && atomic_compare_exchange_strong(&pr->period_start, &start, now))
+	{
+		start = now;
+		i = 0;
+		while (i < pr->nof_level)
+			atomic_store_explicit(&pr->usedv[i++], 0, memory_order_relaxed);
+	}
+	out = 0;
+	while (map)
+	{
+		i = (size_t)__builtin_ctzll(map);
+		if (pr->quotav[i] && atomic_load_explicit(&pr->usedv[i], memory_order_relaxed) >= pr->quotav[i])
+			out |= (uint64_t)1 << i;
+		map &= map - 1;
+	}
+	*wait = now - start < pr->period_usec ? start + pr->period_usec - now : 1;
+	return (out);
+}
+
+/*
+ * No tenant of `map` has deficit left: each gets its quantum times its
+ * weight, for as many rounds as the least indebted one needs. Deficits are
+ * capped at one round, a tenant does not bank the rounds it sat out.
+ */
+static void
+qprio_round(struct qprio *pr, uint64_t map)
+{
+	uint64_t	m;
+	uint64_t	r;
+	uint64_t	need;
+	int64_t		d;
+	int64_t		q;
+	size_t		round;
+	size_t		i;
+
+	round = atomic_load(&pr->round);
+	r = UINT64_MAX;
+	m = map;
+	while (m)
+	{
+		i = (size_t)__builtin_ctzll(m);
+		d = atomic_load(&pr->deficitv[i]);
+		q = pr->quantum_ns * (int64_t)pr->weightv[i];
+		need = d > 0 ? 0 : (uint64_t)(-d) / (uint64_t)q + 1;
+		r = need < r ? need : r;
+		m &= m - 1;
+	}
+	if (!r || !atomic_compare_exchange_strong(&pr->round, &round, round + 1))
+		return ;
+	while (map)
+	{
+		i = (size_t)__builtin_ctzll(map);
+		q = pr->quantum_ns * (int64_t)pr->weightv[i];
+		d = atomic_fetch_add(&pr->deficitv[i], (int64_t)r * q) + (int64_t)r * q;
+		while (d > q && !atomic_compare_exchange_weak(&pr->deficitv[i], &d, q))
+			;
+		map &= map - 1;
+	}
+}
+
+/*
+ * THREADSAFEQ_PRIO_FAIR: deficit round robin over the CPU time of the
+ * tenants, from the tenant served last. A pick lets through as many tasks
+ * (at most `*n`) as the deficit of the tenant covers at their average cost
+ * and reserves that cost; qprio_charge() settles it with the measured time.
+ * Returns SIZE_MAX if every tenant of `map` is over its quota.
+ */
+static size_t
+qprio_pick_fair(struct qprio *pr, uint64_t map, size_t *n)
+{
+	uint64_t	wait;
+	uint64_t	est;
+	uint64_t	m;
+	int64_t		d;
+	size_t		cur;
+	size_t		i;
+	size_t		k;
+
+	map &= ~qprio_throttled(pr, map, &wait);
+	if (!map)
+		return (SIZE_MAX);
+	while (1)
+	{
+		cur = atomic_load_explicit(&pr->cursor, memory_order_relaxed);
+		m = cur ? (map >> cur) | (map << (64 - cur)) : map;
+		while (m)
+		{
+			i = ((size_t)__builtin_ctzll(m) + cur) & 63;
+			d = atomic_load_explicit(&pr->deficitv[i], memory_order_relaxed);
+			if (d > 0)
+			{
+				est = atomic_load_explicit(&pr->estv[i], memory_order_relaxed);
+				k = !est ? 1 : (uint64_t)d / est;
+				k = k < 1 ? 1 : k > *n ? *n : k;
+				atomic_fetch_sub(&pr->deficitv[i], (int64_t)(k * est));
+				if (i != cur)
+					atomic_store_explicit(&pr->cursor, i, memory_order_relaxed);
+				*n = k;
+				return (i);
+			}
+			m &= m - 1;
+		}
+		qprio_round(pr, map);
+	}
+}
+
+/* Settles the last fair pick of this thread with the CPU time its `n` tasks took. */
+static void
+qprio_charge(struct qprio *pr, size_t n, uint64_t ns)
+{
+	uint64_t	est;
+	size_t		i;
+
+	i = qprio_taken_level;
+	atomic_fetch_add(&pr->deficitv[i], (int64_t)qprio_taken_ns - (int64_t)ns);
+	atomic_fetch_add_explicit(&pr->usedv[i], ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pr->cpuv[i], ns, memory_order_relaxed);
+	est = atomic_load_explicit(&pr->estv[i], memory_order_relaxed);
+	ns = ns / (n ? n : 1);
+	atomic_store_explicit(&pr->estv[i], est ? (est * 7 + ns) / 8 + 1 : ns + 1, memory_order_relaxed);
+}
+
+/* With the workers of a fair queue parked, how long every waiting tenant stays over its quota. */
+static uint64_t
+qprio_throttle_wait(struct threadsafeq *q)
+{
+	uint64_t	map;
+	uint64_t	wait;
+
+	if (!q->prio || q->prio->policy != THREADSAFEQ_PRIO_FAIR || !q->prio->quota_on)
+		return (0);
+	map = atomic_load(&q->prio->map);
+	if (!map || (map & ~qprio_throttled(q->prio, map, &wait)))
+		return (0);
+	return (wait);
+}
+
+static size_t
+qprio_remove_level(struct threadsafeq *q, size_t level, struct qnode *nodev, size_t n)
+{
+	int64_t	d;
+	size_t	m;
+
+	m = n == 1 ? !qlane_remove(q->lanev + level, nodev) : qlane_remove_batch(q->lanev + level, nodev, n);
+	if (!m || !atomic_load(&q->lanev[level].n))
+	{
+		qprio_unmark(q, level);
+		/* An idle tenant keeps its debt but no credit. */
+		d = atomic_load(&q->prio->deficitv[level]);
+		while (d > 0 && !atomic_compare_exchange_weak(&q->prio->deficitv[level], &d, 0))
+			;
+	}
+	if (m && q->prio->aging_usec)
+		atomic_store_explicit(&q->prio->sincev[level], qops_now_usec(), memory_order_relaxed);
+	return (m);
+}
+
+static size_t
+threadsafeq_prio_remove_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	uint64_t	map;
+	uint64_t	est;
+	size_t		level;
+	size_t		m;
+	size_t		k;
+	int		credit;
+
+	map = atomic_load(&q->prio->map);
+	while (map)
+	{
+		k = n;
+		credit = 0;
+		if (q->prio->policy == THREADSAFEQ_PRIO_FAIR)
+			level = qprio_pick_fair(q->prio, map, &k);
+		else if ((level = qprio_aged(q->prio, map)) == SIZE_MAX)
+		{
+			level = qprio_pick(q->prio, map, q->nof_lane, &k);
+			credit = q->prio->policy == THREADSAFEQ_PRIO_WEIGHTED;
+		}
+		if (level == SIZE_MAX)
+			return (0);
+		m = qprio_remove_level(q, level, nodev, k);
+		/* Credit taken for tasks the level did not have goes back. */
+		if (credit && k > m)
+			atomic_fetch_add_explicit(&q->prio->creditv[level], k - m, memory_order_relaxed);
+		if (q->prio->policy == THREADSAFEQ_PRIO_FAIR)
+		{
+			/* Give back the reservation of the tasks not taken. */
+			est = atomic_load_explicit(&q->prio->estv[level], memory_order_relaxed);
+			atomic_fetch_add(&q->prio->deficitv[level], (int64_t)((k - m) * est));
+			if (m)
+			{
+				qprio_taken_q = q;
+				qprio_taken_level = level;
+				qprio_taken_ns = m * est;
+			}
+		}
+		if (m)
+			return (m);
+		map &= ~((uint64_t)1 << level);
+	}
+	return (0);
+}
+
+static int
+threadsafeq_prio_remove(struct threadsafeq *q, struct qnode *node)
+{
+	return (threadsafeq_prio_remove_batch(q, node, 1) ? 0 : -1);
+}
+
+/*
+ * The oldest node of the last level, for THREADSAFEQ_FULL_DROP_OLDEST; of the
+ * deepest tenant with THREADSAFEQ_PRIO_FAIR.
+ */
+static int
+qprio_remove_last(struct threadsafeq *q, struct qnode *node)
+{
+	uint64_t	map;
+	uint64_t	m;
+	size_t		level;
+
+	map = atomic_load(&q->prio->map);
+	while (map)
+	{
+		level = 63 - (size_t)__builtin_clzll(map);
+		m = map;
+		while (q->prio->policy == THREADSAFEQ_PRIO_FAIR && m)
+		{
+			if (atomic_load(&q->lanev[__builtin_ctzll(m)].n) > atomic_load(&q->lanev[level].n))
+				level = (size_t)__builtin_ctzll(m);
+			m &= m - 1;
+		}
+		if (qprio_remove_level(q, level, node, 1))
+			return (0);
+		map &= ~((uint64_t)1 << level);
+	}
+	return (-1);
+}
+
+static int
+qprio_append(struct threadsafeq *q, struct qnode *node, size_t level)
+{
+	if (qlane_append(q->lanev + level, node))
+		return (-1);
+	qprio_mark(q, level);
+	return (0);
+}
+
+/* Without a level, nodes go to the last one. */
+static int
+threadsafeq_prio_append(struct threadsafeq *q, struct qnode *node)
+{
+	return (qprio_append(q, node, q->nof_lane - 1));
+}
+
+static int
+threadsafeq_prio_append_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	if (qlane_append_batch(q->lanev + q->nof_lane - 1, nodev, n))
 		return (-1);
-	ret = 0;
-	THREADSAFEQ_LOCK(q);
-	curr = q->tail;
-	if (curr && curr->wi == curr->sz)
+	qprio_mark(q, q->nof_lane - 1);
+	return (0);
+}
+
+static void
+threadsafeq_prio_delete(struct threadsafeq *q)
+{
+	threadsafeq_list_delete(q);
+	qops_free(q->alloc, q->prio, sizeof (*q->prio), _Alignof (struct qprio));
+}
+
+static const struct threadsafeq_ops threadsafeq_prio_ops =
+{
+	.append = threadsafeq_prio_append,
+	.append_batch = threadsafeq_prio_append_batch,
+	.remove = threadsafeq_prio_remove,
+	.reserve = threadsafeq_list_reserve,
+	.remove_batch = threadsafeq_prio_remove_batch,
+	.size = threadsafeq_list_size,
+	.delete = threadsafeq_prio_delete,
+};
+
+/* Absolute CLOCK_REALTIME time `usec` from now, for pthread_cond_timedwait. */
+static void
+qops_deadline(struct timespec *ts, size_t usec)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Capacity accounting. The load of the nodes is reserved before they are
+ * appended and released once they are removed, so the queue never holds
+ * more than `capacity`. A node heavier than the whole capacity is still
+ * admitted into an empty queue, otherwise it could never be appended.
+ */
+static size_t
+threadsafeq_weigh(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	size_t	w;
+
+	if (!q->weigh)
+		return (n);
+	w = 0;
+	while (n--)
+		w += q->weigh(nodev++);
+	return (w);
+}
+
+static int
+threadsafeq_try_admit(struct threadsafeq *q, size_t w)
+{
+	size_t	load;
+
+	load = atomic_load(&q->load);
+	while (!load || load + w <= q->capacity)
 	{
-		curr->next = qnode_buff_new(q->buff_sz);
-		curr = curr->next;
-		q->tail =  curr;
+		if (atomic_compare_exchange_weak(&q->load, &load, load + w))
+			return (0);
 	}
-	else if (!curr)
+	return (-1);
+}
+
+static void
+threadsafeq_release(struct threadsafeq *q, size_t w)
+{
+	if (!q->capacity || !w)
+		return ;
+	atomic_fetch_sub(&q->load, w);
+	/* seq_cst: either the blocked producer sees the room or we see the producer. */
+	if (atomic_load(&q->full_waiters))
 	{
-		curr = qnode_buff_new(q->buff_sz);
-		q->head =  curr;
-		q->tail =  curr;
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_broadcast(&q->not_full);
+		pthread_mutex_unlock(&q->lock);
 	}
-	if (curr)
+}
+
+/* Releases the weight of the spilled tasks dropped since, which no remove returned. */
+static void
+threadsafeq_release_dropped(struct threadsafeq *q)
+{
+	if (q->capacity && atomic_load_explicit(&q->spill_dropped, memory_order_relaxed))
+		threadsafeq_release(q, atomic_exchange(&q->spill_dropped, 0));
+}
+
+/*
+ * Reserves `w` for `n` nodes. Returns 0 when admitted, 1 when the nodes
+ * were run by the caller and -1 when rejected. Without `wait`,
+ * THREADSAFEQ_FULL_BLOCK rejects instead of blocking.
+ */
+static int
+threadsafeq_admit(struct threadsafeq *q, struct qnode *nodev, size_t n, size_t w, int wait)
+{
+	struct qnode	old;
+	struct timespec	ts;
+	int		ret;
+
+	if (!q->capacity || !threadsafeq_try_admit(q, w))
+		return (0);
+	switch (q->full_policy)
 	{
-		curr->nodev[curr->wi++] = *node;
-		atomic_fetch_add(&q->n, 1);
+	case THREADSAFEQ_FULL_FAIL:
+		return (-1);
+	case THREADSAFEQ_FULL_CALLER_RUNS:
+		while (n--)
+			qnode_exec(nodev++);
+		return (1);
+	case THREADSAFEQ_FULL_DROP_OLDEST:
+		while (threadsafeq_try_admit(q, w))
+		{
+			/* Empty but full: appends in flight hold the load, let them land. */
+			if (q->prio ? qprio_remove_last(q, &old) : q->ops->remove(q, &old))
+			{
+				threadsafeq_release_dropped(q);
+				sched_yield();
+				continue ;
+			}
+			threadsafeq_release(q, threadsafeq_weigh(q, &old, 1));
+			if (old.cleanup)
+				old.cleanup(old.data);
+		}
+		return (0);
 	}
-	else
-		ret = -1;
-	THREADSAFEQ_UNLOCK(q);
+	if (!wait)
+		return (-1);
+	if (q->full_timeout_ms)
+		qops_deadline(&ts, q->full_timeout_ms * 1000);
+	ret = 0;
+	pthread_mutex_lock(&q->lock);
+	atomic_fetch_add(&q->full_waiters, 1);
+	while (!ret && threadsafeq_try_admit(q, w))
+	{
+		if (!q->full_timeout_ms)
+			pthread_cond_wait(&q->not_full, &q->lock);
+		else if (pthread_cond_timedwait(&q->not_full, &q->lock, &ts))
+			ret = -1;
+	}
+	atomic_fetch_sub(&q->full_waiters, 1);
+	pthread_mutex_unlock(&q->lock);
+	return (ret);
+}
+
+/* `level` is a priority level of the queue, SIZE_MAX for the default one. */
+static int
+threadsafeq_append_ops(struct threadsafeq *q, struct qnode *node, size_t level, int signal_f)
+{
+	size_t	w;
+	int	ret;
+
+	if (!q || !node)
+		return (-1);
+	w = q->capacity ? threadsafeq_weigh(q, node, 1) : 0;
+	ret = threadsafeq_admit(q, node, 1, w, 1);
+	if (ret)
+		return (ret < 0 ? -1 : 0);
+	ret = level == SIZE_MAX || !q->prio ? q->ops->append(q, node) : qprio_append(q, node, level);
+	if (ret)
+		threadsafeq_release(q, w);
 	if (signal_f && !ret && q->on_append)
-		q->on_append(q->signal_data);
+		q->on_append(q->signal_data, 1);
+	return (ret);
+}
+
+static int
+threadsafeq_append_batch_ops(struct threadsafeq *q, struct qnode *nodev, size_t n, int wait)
+{
+	size_t	w;
+	size_t	i;
+	int	ret;
+
+	if (!q || (!nodev && n))
+		return (-1);
+	if (!n)
+		return (0);
+	w = q->capacity ? threadsafeq_weigh(q, nodev, n) : 0;
+	ret = threadsafeq_admit(q, nodev, n, w, wait);
+	if (ret)
+		return (ret < 0 ? -1 : 0);
+	if (q->ops->append_batch)
+	{
+		ret = q->ops->append_batch(q, nodev, n);
+		i = ret ? 0 : n;
+	}
+	else
+	{
+		i = 0;
+		while (i < n && !ret)
+			ret = q->ops->append(q, nodev + i++);
+		i = ret ? i - 1 : n;
+	}
+	if (i < n && q->capacity)
+		threadsafeq_release(q, threadsafeq_weigh(q, nodev + i, n - i));
+	if (i && q->on_append)
+		q->on_append(q->signal_data, i);
 	return (ret);
 }
 
+int
+threadsafeq_append_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	return (threadsafeq_append_batch_ops(q, nodev, n, 1));
+}
+
 int
 threadsafeq_append(struct threadsafeq *q, struct qnode *node)
 {
 	if (!q || !node)
 		return (-1);
-	return (threadsafeq_append_ops(q, node, 1));
+	return (threadsafeq_append_ops(q, node, SIZE_MAX, 1));
 }
 
 int
@@ -227,7 +4403,101 @@ threadsafeq_append_quiet(struct threadsafeq *q, struct qnode *node)
 {
 	if (!q || !node)
 		return (-1);
-	return (threadsafeq_append_ops(q, node, 0));
+	return (threadsafeq_append_ops(q, node, SIZE_MAX, 0));
+}
+
+/*
+ * A coalesced append counts against the capacity like any other, it is
+ * admitted before the index is looked up.
+ */
+int
+threadsafeq_append_key(struct threadsafeq *q, struct qnode *node, uint64_t key)
+{
+	size_t	wv[2];
+	size_t	w;
+	int	ret;
+
+	if (!q || !node || !q->lanev || !q->lanev->keys)
+		return (-1);
+	/* A pending key is updated in place: it needs no room, only its new weight. */
+	w = 0;
+	ret = qlane_append_key(q->lanev, node, key, q->coalesce, q->weigh, 0, wv);
+	if (ret == 2)
+	{
+		w = q->capacity ? threadsafeq_weigh(q, node, 1) : 0;
+		ret = threadsafeq_admit(q, node, 1, w, 1);
+		if (ret)
+			return (ret < 0 ? -1 : 0);
+		ret = qlane_append_key(q->lanev, node, key, q->coalesce, q->weigh, 1, wv);
+		if (ret)
+			threadsafeq_release(q, w);
+	}
+	if (ret == 1 && q->capacity && wv[1] > wv[0])
+		atomic_fetch_add(&q->load, wv[1] - wv[0]);
+	else if (ret == 1 && q->capacity)
+		threadsafeq_release(q, wv[0] - wv[1]);
+	if (!ret && q->on_append)
+		q->on_append(q->signal_data, 1);
+	return (ret < 0 ? -1 : 0);
+}
+
+/* Queues without levels have the single level 0. */
+int
+threadsafeq_append_prio(struct threadsafeq *q, struct qnode *node, size_t level)
+{
+	if (!q || !node || level >= (q->prio ? q->nof_lane : 1))
+		return (-1);
+	return (threadsafeq_append_ops(q, node, level, 1));
+}
+
+/*
+ * A reservation counts as one task against the capacity. Producers that
+ * would run the task themselves cannot do it before the payload is written,
+ * so THREADSAFEQ_FULL_CALLER_RUNS rejects it like THREADSAFEQ_FULL_FAIL.
+ */
+void *
+threadsafeq_reserve_slot(struct threadsafeq *q, size_t len)
+{
+	struct qlane	*lane;
+	void		*slot;
+
+	if (!q || qlane_slot_held || qshm_slot_held)
+		return (NULL);
+	if (q->shm)
+		return (qshm_reserve_slot(q, len));
+	if (!q->lanev || !q->lanev->inline_sz)
+		return (NULL);
+	if (q->capacity && (q->weigh || threadsafeq_admit(q, NULL, 0, 1, 1)))
+		return (NULL);
+	lane = q->lanev + threadsafeq_home_lane(q);
+	slot = qlane_reserve_slot(lane, len);
+	if (!slot)
+	{
+		threadsafeq_release(q, q->capacity ? 1 : 0);
+		return (NULL);
+	}
+	qlane_slot_held = lane;
+	return (slot);
+}
+
+int
+threadsafeq_commit_slot(struct threadsafeq *q, void *slot, struct qnode *node)
+{
+	struct qlane	*lane;
+	int		ret;
+
+	if (q && slot && q->shm && qshm_slot_held)
+		return (qshm_commit_slot(q, slot, node));
+	lane = qlane_slot_held;
+	if (!q || !slot || !lane)
+		return (-1);
+	qlane_slot_held = NULL;
+	ret = qlane_commit_slot(lane, slot, node);
+	if (ret || !node)
+		threadsafeq_release(q, q->capacity ? 1 : 0);
+	else if (q->on_append)
+		q->on_append(q->signal_data, 1);
+	return (ret);
 }
 
 void
@@ -241,98 +4511,454 @@ threadsafeq_broadcast(struct threadsafeq *q)
 
 int
 threadsafeq_remove(struct threadsafeq *q, struct qnode *node)
+{
+	if (!q || !node)
+		return (-1);
+	if (q->ops->remove(q, node))
+	{
+		threadsafeq_release_dropped(q);
+		return (-1);
+	}
+	if (q->capacity)
+		threadsafeq_release(q, threadsafeq_weigh(q, node, 1));
+	threadsafeq_release_dropped(q);
+	return (0);
+}
+
+size_t
+threadsafeq_remove_batch(struct threadsafeq *q, struct qnode *nodev, size_t n)
+{
+	size_t	i;
+
+	if (!q || !nodev || !n)
+		return (0);
+	if (q->ops->remove_batch)
+		i = q->ops->remove_batch(q, nodev, n);
+	else
+	{
+		i = 0;
+		while (i < n && !q->ops->remove(q, nodev + i))
+			++i;
+	}
+	if (i && q->capacity)
+		threadsafeq_release(q, threadsafeq_weigh(q, nodev, i));
+	threadsafeq_release_dropped(q);
+	return (i);
+}
+
+/* Free slots of a bounded ring, SIZE_MAX for the unbounded backends. */
+static size_t
+threadsafeq_room(struct threadsafeq *q)
+{
+	size_t	bound;
+	size_t	n;
+
+	if (q->ring)
+		bound = q->ring->mask + 1;
+	else if (q->spsc)
+		bound = q->spsc->mask + 1;
+	else if (q->shm)
+		bound = q->shm->mask + 1;
+	else
+		return (SIZE_MAX);
+	n = q->ops->size(q);
+	return (n < bound ? bound - n : 0);
+}
+
+/*
+ * One node at a time through the backend ops, for the queues that have no
+ * buffers to relink or account a capacity. It stops before taking a node
+ * that `dst` has no room for, so the backlog keeps its order. A node the
+ * destination refuses all the same goes back to the back of the source.
+ */
+static size_t
+threadsafeq_splice_slow(struct threadsafeq *dst, struct threadsafeq *src, size_t n)
+{
+	struct qnode	node;
+	size_t		moved;
+	size_t		w;
+
+	moved = 0;
+	while (moved < n)
+	{
+		/* Room first: a node taken from `src` has no way back to its front. */
+		if ((dst->capacity && atomic_load(&dst->load) >= dst->capacity) || !threadsafeq_room(dst))
+			break ;
+		if (threadsafeq_remove(src, &node))
+			break ;
+		if (dst->capacity)
+			atomic_fetch_add(&dst->load, threadsafeq_weigh(dst, &node, 1));
+		if (dst->ops->append(dst, &node))
+		{
+			threadsafeq_release(dst, dst->capacity ? threadsafeq_weigh(dst, &node, 1) : 0);
+			/*
+			 * Refused all the same (a producer took the room, no memory, a class
+			 * `dst` cannot store): back to `src` past its capacity, so it is not lost.
+			 */
+			w = src->capacity ? threadsafeq_weigh(src, &node, 1) : 0;
+			atomic_fetch_add(&src->load, w);
+			if (src->ops->append(src, &node))
+			{
+				threadsafeq_release(src, w);
+				if (node.cleanup)
+					node.cleanup(node.data);
+			}
+			break ;
+		}
+		++moved;
+	}
+	return (moved);
+}
+
+size_t
+threadsafeq_splice_n(struct threadsafeq *dst, struct threadsafeq *src, size_t n)
+{
+	size_t	moved;
+
+	if (!dst || !src || dst == src || !n)
+		return (0);
+	if (dst->lanev && src->lanev && !dst->capacity && !src->capacity && dst->lanev->compact == src->lanev->compact
+		&& dst->lanev->inline_sz == src->lanev->inline_sz && dst->lanev->alloc == src->lanev->alloc
+		&& !dst->lanev->spill && !src->lanev->spill && !dst->prio && !src->prio && !dst->lanev->keys && !src->lanev->keys)
+		moved = threadsafeq_list_splice(dst, src, n);
+	else
+		moved = threadsafeq_splice_slow(dst, src, n);
+	if (moved && dst->on_append)
+		dst->on_append(dst->signal_data, moved);
+	return (moved);
+}
+
+size_t
+threadsafeq_splice(struct threadsafeq *dst, struct threadsafeq *src)
+{
+	return (threadsafeq_splice_n(dst, src, SIZE_MAX));
+}
+
+int
+threadsafeq_reserve(struct threadsafeq *q, size_t n)
+{
+	if (!q || !q->ops->reserve)
+		return (-1);
+	return (q->ops->reserve(q, n));
+}
+
+size_t
+threadsafeq_size(struct threadsafeq *q)
+{
+	if (!q)
+		return (0);
+	return (q->ops->size(q));
+}
+
+size_t
+threadsafeq_size_level(struct threadsafeq *q, size_t level)
+{
+	if (!q || level >= (q->prio ? q->nof_lane : 1))
+		return (0);
+	if (!q->prio)
+		return (q->ops->size(q));
+	return (atomic_load(&q->lanev[level].n) + qspill_count(q->lanev + level));
+}
+
+uint64_t
+threadsafeq_level_cpu_usec(struct threadsafeq *q, size_t level)
+{
+	if (!q || !q->prio || q->prio->policy != THREADSAFEQ_PRIO_FAIR || level >= q->nof_lane)
+		return (0);
+	return (atomic_load_explicit(&q->prio->cpuv[level], memory_order_relaxed) / 1000);
+}
+
+/*
+ * Frees the cached buffers of the lane, drops the bound raised by a reserve,
+ * and frees the drained buffers in front of it, which otherwise wait for
+ * the next remove, or for good when the lane stopped short of their end.
+ */
+static size_t
+qlane_trim(struct qlane *lane)
+{
+	struct qnode_buff	*curr;
+	size_t			bytes;
+
+	bytes = 0;
+	THREADSAFEQ_LOCK(lane);
+	while ((curr = lane->free))
+	{
+		lane->free = curr->next;
+		bytes += qlane_chunk_bytes(lane, curr->sz);
+		qlane_chunk_free(lane, curr);
+	}
+	lane->nof_free = 0;
+	lane->max_free = QLANE_FREE_MAX;
+	while ((curr = lane->head) && curr->ri == curr->wi)
+	{
+		lane->head = curr->next;
+		if (!lane->head)
+			lane->tail = NULL;
+		bytes += qlane_chunk_bytes(lane, curr->sz);
+		--lane->nof_linked;
+		lane->linked_bytes -= qlane_chunk_bytes(lane, curr->sz);
+		qlane_chunk_free(lane, curr);
+	}
+	lane->chunk_sz = lane->chunk_min;
+	THREADSAFEQ_UNLOCK(lane);
+	return (bytes);
+}
+
+size_t
+threadsafeq_trim(struct threadsafeq *q)
+{
+	size_t	bytes;
+	size_t	i;
+
+	if (!q || !q->lanev)
+		return (0);
+	bytes = 0;
+	i = 0;
+	while (i < q->nof_lane)
+		bytes += qlane_trim(q->lanev + i++);
+	return (bytes);
+}
+
+int
+threadsafeq_memory_stats(struct threadsafeq *q, struct threadsafeq_memstats *st)
 {
 	struct qnode_buff	*curr;
+	struct qlane		*lane;
+	size_t			slot;
 	size_t			n;
+	size_t			i;
 
-	if (!q || !node)
+	if (!q || !st)
 		return (-1);
-	n = atomic_load(&q->n);
-	while (n)
+	*st = (struct threadsafeq_memstats){.bytes_allocated = atomic_load(&q->mem.bytes), .peak_bytes = atomic_load(&q->mem.peak),
+		.nof_chunk = atomic_load(&q->mem.chunks)};
+	if (q->ring)
+		slot = sizeof (struct qring_cell);
+	else if (q->lf)
+		slot = sizeof (struct qseg_cell);
+	else if (q->spsc)
+		slot = sizeof (struct qnode);
+	else if (q->shm)
+		slot = q->shm->cell_sz;
+	else
+		slot = (q->lanev->compact ? sizeof (struct qcnode) : sizeof (struct qnode)) + q->lanev->inline_sz;
+	i = 0;
+	while (q->lanev && i < q->nof_lane)
+		st->spilled += qspill_count(q->lanev + i++);
+	n = threadsafeq_size(q);
+	st->bytes_in_use = (n > st->spilled ? n - st->spilled : 0) * slot;
+	i = 0;
+	while (q->lanev && i < q->nof_lane)
+	{
+		lane = q->lanev + i++;
+		THREADSAFEQ_LOCK(lane);
+		curr = lane->free;
+		while (curr)
+		{
+			st->bytes_cached += qlane_chunk_bytes(lane, curr->sz);
+			curr = curr->next;
+		}
+		THREADSAFEQ_UNLOCK(lane);
+	}
+	return (0);
+}
+
+void
+threadsafeq_delete(struct threadsafeq *q)
+{
+	if (!q)
+		return ;
+	q->ops->delete(q);
+	pthread_cond_destroy(&q->not_full);
+	pthread_mutex_destroy(&q->lock);
+	qops_free(q->alloc, q, sizeof (*q), _Alignof (struct threadsafeq));
+}
+
+/* Creates a queue; a THREADSAFEQ_SHM queue maps the segment of `fd` unless it is -1. */
+static struct threadsafeq *
+threadsafeq_new_fd(const struct threadsafeq_attr *attr, int fd)
+{
+	const struct qops_allocator	*a;
+	struct threadsafeq		*q;
+	struct threadsafeq_attr		def;
+	size_t				i;
+
+	if (!attr)
+	{
+		def = (struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = 0};
+		attr = &def;
+	}
+	if (attr->type < THREADSAFEQ_LIST || attr->type > THREADSAFEQ_SHM)
+		goto attr_err;
+	if (attr->full_policy < THREADSAFEQ_FULL_BLOCK || attr->full_policy > THREADSAFEQ_FULL_CALLER_RUNS)
+		goto attr_err;
+	if ((attr->compact || attr->inline_sz || (attr->arena & THREADSAFEQ_ARENA_CHUNKS) || attr->spill_dir)
+		&& attr->type != THREADSAFEQ_LIST && attr->type != THREADSAFEQ_SHARDED && attr->type != THREADSAFEQ_FLATCOMB
+		&& (attr->type != THREADSAFEQ_SHM || attr->compact || (attr->arena & THREADSAFEQ_ARENA_CHUNKS) || attr->spill_dir))
+		goto attr_err;
+	/* The load of a shared ring is not known to a single process. */
+	if (attr->type == THREADSAFEQ_SHM && attr->capacity)
+		goto attr_err;
+	if (attr->spill_dir && attr->inline_sz)
+		goto attr_err;
+	if (attr->levels > THREADSAFEQ_PRIO_MAX || attr->prio_policy < THREADSAFEQ_PRIO_STRICT
+		|| attr->prio_policy > THREADSAFEQ_PRIO_FAIR
+		|| (attr->prio_quota_usec && attr->prio_policy != THREADSAFEQ_PRIO_FAIR)
+		|| (attr->levels > 1 && (attr->type != THREADSAFEQ_LIST || attr->inline_sz)))
+		goto attr_err;
+	if (attr->keyed && (attr->type != THREADSAFEQ_LIST || attr->levels > 1 || attr->inline_sz || attr->spill_dir))
+		goto attr_err;
+	a = attr->allocator ? attr->allocator : &qops_std_allocator;
+	q = qops_alloc(a, sizeof (*q), _Alignof (struct threadsafeq));
+	if (!q)
+		goto alloc_err;
+	*q = (struct threadsafeq){.ops = &threadsafeq_list_ops, .capacity = attr->capacity, .weigh = attr->weigh,
+		.full_policy = attr->full_policy, .full_timeout_ms = attr->full_timeout_ms, .arena = attr->arena, .alloc = a,
+		.shm_fd = -1, .coalesce = attr->coalesce};
+	atomic_init(&q->n, 0);
+	atomic_init(&q->bell_stop, 0);
+	atomic_init(&q->load, 0);
+	atomic_init(&q->full_waiters, 0);
+	atomic_init(&q->spill_dropped, 0);
+	atomic_init(&q->mem.bytes, 0);
+	atomic_init(&q->mem.peak, 0);
+	atomic_init(&q->mem.chunks, 0);
+	qmem_charge(&q->mem, sizeof (*q), 0);
+	if (0 != pthread_mutex_init(&q->lock, NULL))
+		goto mutex_err;
+	if (0 != pthread_cond_init(&q->not_full, NULL))
+		goto cond_err;
+	if (attr->type == THREADSAFEQ_LIST || attr->type == THREADSAFEQ_SHARDED || attr->type == THREADSAFEQ_FLATCOMB)
+	{
+		if (qlane_new(q, attr))
+			goto backend_err;
+	}
+	if (attr->keyed && !(q->lanev->keys = qkeys_new(q->alloc, &q->mem)))
+		goto fc_err;
+	if (attr->type == THREADSAFEQ_LIST && attr->levels > 1)
+	{
+		q->ops = &threadsafeq_prio_ops;
+		if (qprio_new(q, attr))
+			goto fc_err;
+	}
+	else if (attr->type == THREADSAFEQ_FLATCOMB)
 	{
-		if (!atomic_compare_exchange_strong(&q->n, &n, n - 1))
-			continue ;
-		THREADSAFEQ_LOCK(q);
-		curr = q->head;
-		*node = curr->nodev[curr->ri++];
-		if (curr->sz == curr->ri)
-		{
-			q->head = curr->next;
-			qnode_buff_delete(curr);
-			if (!q->head)
-				q->tail = NULL;
-		}
-		THREADSAFEQ_UNLOCK(q);
-		return (0);
+		q->ops = &threadsafeq_flatcomb_ops;
+		q->fc = qops_alloc(q->alloc, sizeof (*q->fc) * QOPS_FC_SLOTS, QOPS_CACHELINE);
+		if (!q->fc)
+			goto fc_err;
+		qmem_charge(&q->mem, sizeof (*q->fc) * QOPS_FC_SLOTS, 0);
+		i = 0;
+		while (i < QOPS_FC_SLOTS)
+			atomic_init(&q->fc[i++].op, QFC_FREE);
 	}
-	return (-1);
+	else if (attr->type == THREADSAFEQ_RING)
+	{
+		q->ops = &threadsafeq_ring_ops;
+		q->ring = qring_new(attr->buff_sz, q->alloc);
+		if (!q->ring)
+			goto backend_err;
+		qmem_charge(&q->mem, qring_bytes(q->ring->mask + 1), 1);
+	}
+	else if (attr->type == THREADSAFEQ_LFLIST)
+	{
+		q->ops = &threadsafeq_lflist_ops;
+		q->lf = qseg_list_new(attr->buff_sz ? attr->buff_sz : QNODE_BUFF_DEFSIZE, q->alloc);
+		if (!q->lf)
+			goto backend_err;
+		qmem_charge(&q->mem, sizeof (*q->lf) + qseg_bytes(atomic_load(&q->lf->head)->sz), 1);
+	}
+	else if (attr->type == THREADSAFEQ_SPSC)
+	{
+		q->ops = &threadsafeq_spsc_ops;
+		q->spsc = qspsc_new(attr->buff_sz, q->alloc);
+		if (!q->spsc)
+			goto backend_err;
+		qmem_charge(&q->mem, qspsc_bytes(q->spsc->mask + 1), 1);
+	}
+	else if (attr->type == THREADSAFEQ_SHM)
+	{
+		q->ops = &threadsafeq_shm_ops;
+		if (qshm_new(q, attr, fd))
+			goto backend_err;
+		qmem_charge(&q->mem, q->shm->bytes, 1);
+	}
+	return (q);
+fc_err:
+	threadsafeq_list_delete(q);
+backend_err:
+	pthread_cond_destroy(&q->not_full);
+cond_err:
+	pthread_mutex_destroy(&q->lock);
+mutex_err:
+	qops_free(a, q, sizeof (*q), _Alignof (struct threadsafeq));
+alloc_err:
+attr_err:
+	return (NULL);
 }
 
-size_t
-threadsafeq_size(struct threadsafeq *q)
+struct threadsafeq *
+threadsafeq_new_attr(const struct threadsafeq_attr *attr)
 {
-	if (!q)
-		return (0);
-	return (atomic_load(&q->n));
+	return (threadsafeq_new_fd(attr, -1));
 }
 
-void
-threadsafeq_delete(struct threadsafeq *q)
+struct threadsafeq *
+threadsafeq_shm_attach(int fd)
 {
-	struct qnode_buff	*buff;
+	if (fd < 0)
+		return (NULL);
+	return (threadsafeq_new_fd(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHM}, fd));
+}
 
-	if (!q)
-		return ;
-	THREADSAFEQ_LOCK(q);
-	while (q->head)
-	{
-		buff = q->head;
-		q->head = q->head->next;
-		qnode_buff_delete(buff);
-	}
-	THREADSAFEQ_UNLOCK(q);
-	pthread_mutex_destroy(&q->lock);
-	free(q);
+int
+threadsafeq_shm_fd(struct threadsafeq *q)
+{
+	return (q ? q->shm_fd : -1);
 }
 
 struct threadsafeq *
 threadsafeq_new(size_t buff_sz)
 {
-	struct threadsafeq	*q;
-
-	q = malloc(sizeof (*q));
-	if (!q)
-		goto alloc_err;
-	if (0 != pthread_mutex_init(&q->lock, NULL))
-		goto mutex_err;
-	q->head = NULL;
-	q->tail = NULL;
-	q->on_append = NULL;
-	q->on_broadcast = NULL;
-	q->signal_data = NULL;
-	atomic_store(&q->n, 0);
-	q->buff_sz = buff_sz;
-	return (q);
-mutex_err:
-	free(q);
-alloc_err:
-	return (NULL);
+	return (threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = buff_sz}));
 }
 
-_Thread_local static int workerp_local_index = -1;
 
+/*
+ * A parked worker waits on its own condition. Whoever unparks it, under
+ * the pool lock, also takes it off `idle`, and may hand it a task directly.
+ */
+struct workerp_thread
+{
+	pthread_t			tid;
+	pthread_cond_t			cond;
+	struct workerp_thread		*next;
+	int				parked;
+	int				handoff;
+	struct qnode			node;
+	_Atomic size_t			nof_exec;
+	_Atomic size_t			nof_expired;
+};
 
 struct workerp
 {
 	struct threadsafeq		*q;
 	struct qbuff			*b;
-	pthread_cond_t			cond;
 	pthread_mutex_t			lock;
+	struct workerp_thread		*parked;
+	struct workerp_thread		**parked_tail;
+	size_t				nof_thread;
 	_Atomic size_t			nof_worker;
 	_Atomic size_t			idle;
 	_Atomic size_t			started;
 	_Atomic int			done;
-	pthread_t			tid[];
+	_Atomic size_t			staged;
+	_Atomic size_t			stage_max;
+	_Atomic size_t			stage_usec;
+	struct workerp_stage		*stagev;
+	char				*stackv;
+	const struct qops_allocator	*alloc;
+	struct workerp_thread		thv[];
 };
 
 static void
@@ -341,11 +4967,40 @@ workerp_on_finish(void *data)
 	atomic_fetch_sub(&((struct workerp *)data)->nof_worker, 1);
 }
 
+/*
+ * Pool lock held. Wakes the longest parked worker; waking the one that just
+ * parked would keep bouncing a single worker under a steady stream.
+ */
+static struct workerp_thread *
+workerp_unpark(struct workerp *pool)
+{
+	struct workerp_thread	*th;
+
+	th = pool->parked;
+	if (!th)
+		return (NULL);
+	pool->parked = th->next;
+	if (!pool->parked)
+		pool->parked_tail = &pool->parked;
+	th->parked = 0;
+	atomic_fetch_sub(&pool->idle, 1);
+	pthread_cond_signal(&th->cond);
+	return (th);
+}
+
 static void
-workerp_on_append(struct workerp *pool)
+workerp_on_append(struct workerp *pool, size_t n)
 {
+	/*
+	 * The queue publishes the node with a seq_cst operation before this
+	 * load, and a parking worker bumps `idle` before it checks the size,
+	 * so either the worker sees the node or we see the worker.
+	 */
+	if (!atomic_load(&pool->idle))
+		return ;
 	pthread_mutex_lock(&pool->lock);
-	pthread_cond_signal(&pool->cond);
+	while (n-- && workerp_unpark(pool))
+		;
 	pthread_mutex_unlock(&pool->lock);
 }
 
@@ -353,54 +5008,330 @@ static void
 workerp_on_broadcast(struct workerp *pool)
 {
 	pthread_mutex_lock(&pool->lock);
-	pthread_cond_broadcast(&pool->cond);
+	while (workerp_unpark(pool))
+		;
 	pthread_mutex_unlock(&pool->lock);
 }
 
+/*
+ * Producer side buffers of workerp_append_buffered(). A producer owns one
+ * stage per pool; its lock is only contended when a worker, a broadcast,
+ * the pool delete or the thread exit flushes it on the owner's behalf.
+ * workerp_stage_lock guards the per pool lists and the `pool` back link.
+ */
+struct workerp_stage
+{
+	pthread_mutex_t			lock;
+	struct workerp *_Atomic		pool;
+	struct workerp_stage		*pool_next;
+	struct workerp_stage		*self_next;
+	const struct qops_allocator	*alloc;
+	uint64_t			since;
+	size_t				n;
+	struct qnode			nodev[WORKERP_BATCH_MAX];
+};
+
+static pthread_mutex_t			workerp_stage_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t			workerp_stage_key;
+static pthread_once_t			workerp_stage_once = PTHREAD_ONCE_INIT;
+_Thread_local static struct workerp_stage	*workerp_stage_self = NULL;
+
+/*
+ * Caller holds `st->lock`. On failure the nodes stay staged. Only the owner
+ * may `wait` for room in a full queue, others must not block on its behalf.
+ */
+static int
+workerp_stage_flush(struct workerp *pool, struct workerp_stage *st, int wait)
+{
+	if (!st->n)
+		return (0);
+	if (threadsafeq_append_batch_ops(pool->q, st->nodev, st->n, wait))
+		return (-1);
+	/* Published before `staged` drops, so workerp_is_idle never sees neither. */
+	atomic_fetch_sub(&pool->staged, st->n);
+	st->n = 0;
+	return (0);
+}
+
+/* Caller holds `st->lock`. Flushes the stage for good, cleaning up what the queue refuses. */
+static void
+workerp_stage_drain(struct workerp *pool, struct workerp_stage *st, int wait)
+{
+	struct qnode	*node;
+
+	if (!workerp_stage_flush(pool, st, wait))
+		return ;
+	atomic_fetch_sub(&pool->staged, st->n);
+	while (st->n)
+	{
+		node = st->nodev + --st->n;
+		if (node->cleanup)
+			node->cleanup(node->data);
+	}
+}
+
+/* Flushes the stages of `pool`; with `expired` only the ones past their deadline and not busy. */
+static void
+workerp_stage_flush_all(struct workerp *pool, int expired)
+{
+	struct workerp_stage	*st;
+	uint64_t		now;
+	size_t			usec;
+
+	now = expired ? qops_now_usec() : 0;
+	usec = atomic_load(&pool->stage_usec);
+	pthread_mutex_lock(&workerp_stage_lock);
+	st = pool->stagev;
+	while (st)
+	{
+		if (!expired)
+			pthread_mutex_lock(&st->lock);
+		else if (pthread_mutex_trylock(&st->lock))
+		{
+			st = st->pool_next;
+			continue ;
+		}
+		if (!expired || (st->n && now - st->since >= usec))
+			workerp_stage_flush(pool, st, 0);
+		pthread_mutex_unlock(&st->lock);
+		st = st->pool_next;
+	}
+	pthread_mutex_unlock(&workerp_stage_lock);
+}
+
+/*
+ * Flushes and unlinks every stage of `pool`; their owners free them lazily.
+ * The workers are gone, so what a full queue does not take is cleaned up.
+ */
+static void
+workerp_stage_detach(struct workerp *pool)
+{
+	struct workerp_stage	*st;
+	struct workerp_stage	*next;
+
+	pthread_mutex_lock(&workerp_stage_lock);
+	st = pool->stagev;
+	while (st)
+	{
+		next = st->pool_next;
+		pthread_mutex_lock(&st->lock);
+		workerp_stage_drain(pool, st, 0);
+		pthread_mutex_unlock(&st->lock);
+		atomic_store(&st->pool, NULL);
+		st = next;
+	}
+	pool->stagev = NULL;
+	pthread_mutex_unlock(&workerp_stage_lock);
+}
+
+/* Thread exit: flush what the thread still holds and drop its stages. */
+static void
+workerp_stage_release(void *data)
+{
+	struct workerp_stage	*st;
+	struct workerp_stage	**link;
+	struct workerp		*pool;
+
+	(void)data;
+	pthread_mutex_lock(&workerp_stage_lock);
+	while ((st = workerp_stage_self))
+	{
+		workerp_stage_self = st->self_next;
+		pool = atomic_load(&st->pool);
+		if (pool)
+		{
+			pthread_mutex_lock(&st->lock);
+			workerp_stage_drain(pool, st, 1);
+			pthread_mutex_unlock(&st->lock);
+			link = &pool->stagev;
+			while (*link != st)
+				link = &(*link)->pool_next;
+			*link = st->pool_next;
+		}
+		pthread_mutex_destroy(&st->lock);
+		qops_free(st->alloc, st, sizeof (*st), _Alignof (struct workerp_stage));
+	}
+	pthread_mutex_unlock(&workerp_stage_lock);
+}
+
 static void
-workerp_wait(struct workerp *pool)
+workerp_stage_init(void)
+{
+	pthread_key_create(&workerp_stage_key, workerp_stage_release);
+}
+
+static struct workerp_stage *
+workerp_stage_get(struct workerp *pool)
+{
+	struct workerp_stage	**link;
+	struct workerp_stage	*st;
+
+	link = &workerp_stage_self;
+	while ((st = *link))
+	{
+		if (atomic_load(&st->pool) == pool)
+			return (st);
+		if (!atomic_load(&st->pool))
+		{
+			*link = st->self_next;
+			pthread_mutex_destroy(&st->lock);
+			qops_free(st->alloc, st, sizeof (*st), _Alignof (struct workerp_stage));
+			continue ;
+		}
+		link = &st->self_next;
+	}
+	pthread_once(&workerp_stage_once, workerp_stage_init);
+	st = qops_alloc(pool->alloc, sizeof (*st), _Alignof (struct workerp_stage));
+	if (!st)
+		return (NULL);
+	if (pthread_mutex_init(&st->lock, NULL))
+	{
+		qops_free(pool->alloc, st, sizeof (*st), _Alignof (struct workerp_stage));
+		return (NULL);
+	}
+	st->alloc = pool->alloc;
+	atomic_init(&st->pool, pool);
+	st->n = 0;
+	st->since = 0;
+	pthread_mutex_lock(&workerp_stage_lock);
+	st->pool_next = pool->stagev;
+	pool->stagev = st;
+	pthread_mutex_unlock(&workerp_stage_lock);
+	st->self_next = workerp_stage_self;
+	workerp_stage_self = st;
+	pthread_setspecific(workerp_stage_key, st);
+	return (st);
+}
+
+/*
+ * Parks the calling worker until it is woken. With `check` it does not
+ * park while the queue holds tasks, and wakes up by itself when staged
+ * tasks reach their deadline. Returns 1 with `*node` set when a producer
+ * handed it a task.
+ */
+static int
+workerp_park(struct workerp *pool, struct workerp_thread *self, int check, struct qnode *node)
 {
+	struct workerp_thread	**link;
+	struct timespec		ts;
+	uint64_t		wait;
+	size_t			usec;
+	int			ret;
+
+	usec = atomic_load(&pool->stage_usec);
+	if (check && usec && atomic_load(&pool->staged))
+		workerp_stage_flush_all(pool, 1);
+	ret = 0;
 	pthread_mutex_lock(&pool->lock);
 	if (!atomic_load(&pool->done))
 	{
+		self->parked = 1;
+		self->next = NULL;
+		*pool->parked_tail = self;
+		pool->parked_tail = &self->next;
 		atomic_fetch_add(&pool->idle, 1);
-		pthread_cond_wait(&pool->cond, &pool->lock);
-		atomic_fetch_sub(&pool->idle, 1);
+		wait = check ? qprio_throttle_wait(pool->q) : 0;
+		if (check && !wait && threadsafeq_size(pool->q))
+			;
+		else if (check && (wait || (usec && atomic_load(&pool->staged))))
+		{
+			/*
+			 * Somebody holds staged tasks, or every waiting tenant is over its
+			 * quota: come back when the first deadline passes.
+			 */
+			if (usec && atomic_load(&pool->staged) && (!wait || usec < wait))
+				wait = usec;
+			qops_deadline(&ts, (size_t)wait);
+			pthread_cond_timedwait(&self->cond, &pool->lock, &ts);
+		}
+		else
+			pthread_cond_wait(&self->cond, &pool->lock);
+		if (self->parked)
+		{
+			link = &pool->parked;
+			while (*link != self)
+				link = &(*link)->next;
+			*link = self->next;
+			if (!self->next)
+				pool->parked_tail = link;
+			self->parked = 0;
+			atomic_fetch_sub(&pool->idle, 1);
+		}
+		ret = self->handoff;
+		if (ret)
+			*node = self->node;
+		self->handoff = 0;
 	}
 	pthread_mutex_unlock(&pool->lock);
+	return (ret);
 }
 
+/*
+ * Runs a removed batch. The clock is read once, by the first task with a
+ * deadline, so a run of expired tasks costs their err and cleanup calls only.
+ */
 static void
-workerp_wait_and_sz(struct workerp *pool)
+workerp_exec_batch(struct workerp_thread *self, struct qnode *nodev, size_t n)
 {
-	pthread_mutex_lock(&pool->lock);
-	if (!atomic_load(&pool->done) && !threadsafeq_size(pool->q))
+	struct threadsafeq	*fair;
+	uint64_t		now;
+	uint64_t		cpu;
+	size_t			expired;
+	size_t			i;
+
+	/* A batch of a fair queue is charged to its tenant. */
+	fair = qprio_taken_q;
+	qprio_taken_q = NULL;
+	cpu = fair ? qops_cpu_nsec() : 0;
+	now = 0;
+	expired = 0;
+	i = 0;
+	while (i < n)
 	{
-		atomic_fetch_add(&pool->idle, 1);
-		pthread_cond_wait(&pool->cond, &pool->lock);
-		atomic_fetch_sub(&pool->idle, 1);
+		if (nodev[i].deadline && nodev[i].deadline <= (now ? now : (now = qops_now_usec())))
+		{
+			qnode_expire(nodev + i++);
+			++expired;
+			continue ;
+		}
+		qnode_run(nodev + i++);
 	}
-	pthread_mutex_unlock(&pool->lock);
+	if (fair)
+		qprio_charge(fair->prio, n, qops_cpu_nsec() - cpu);
+	atomic_store_explicit(&self->nof_exec, atomic_load_explicit(&self->nof_exec, memory_order_relaxed) + n - expired,
+		memory_order_relaxed);
+	if (expired)
+		atomic_store_explicit(&self->nof_expired, atomic_load_explicit(&self->nof_expired, memory_order_relaxed)
+			+ expired, memory_order_relaxed);
 }
 
 static void *
 workerp_loop(void *data)
 {
-	struct workerp	*pool;
-	struct qnode	node;
-	int		ret;
+	struct workerp		*pool;
+	struct workerp_thread	*self;
+	struct qnode		nodev[WORKERP_BATCH_MAX];
+	size_t			n;
+	size_t			i;
 
 	pool = data;
 	workerp_local_index = atomic_fetch_add(&pool->started, 1);
+	self = pool->thv + workerp_local_index;
 	pthread_cleanup_push(workerp_on_finish, data);
-	workerp_wait(pool);
-	while (!atomic_load(&pool->done))
+	n = workerp_park(pool, self, 0, nodev);
+	while (1)
 	{
-		ret = threadsafeq_remove(pool->q, &node);
-		if (ret)
-			workerp_wait_and_sz(pool);
-		else
-			qnode_exec(&node);
+		workerp_exec_batch(self, nodev, n);
+		if (atomic_load(&pool->done))
+			break ;
+		/* Take a fair share of the backlog, so a short queue still spreads over all workers. */
+		i = atomic_load(&pool->nof_worker);
+		n = threadsafeq_size(pool->q) / (i ? i : 1);
+		n = n < 1 ? 1 : n > WORKERP_BATCH_MAX ? WORKERP_BATCH_MAX : n;
+		qprio_taken_q = NULL;
+		n = threadsafeq_remove_batch(pool->q, nodev, n);
+		if (!n)
+			n = workerp_park(pool, self, 1, nodev);
 	}
 	pthread_cleanup_pop(1);
 	return (NULL);
@@ -409,14 +5340,17 @@ workerp_loop(void *data)
 static void *
 workerp_loop_exec(void *data)
 {
-	struct workerp	*pool;
-	size_t		idx;
-	struct qbuff	*buff;
+	struct workerp		*pool;
+	struct workerp_thread	*self;
+	struct qnode		node;
+	size_t			idx;
+	struct qbuff		*buff;
 
 	pool = data;
 	workerp_local_index = atomic_fetch_add(&pool->started, 1);
+	self = pool->thv + workerp_local_index;
 	pthread_cleanup_push(workerp_on_finish, data);
-	workerp_wait(pool);
+	workerp_park(pool, self, 0, &node);
 	while (!atomic_load(&pool->done))
 	{
 		buff = pool->b;
@@ -426,7 +5360,7 @@ workerp_loop_exec(void *data)
 			qbuff_exec(buff, idx);
 			idx += pool->nof_worker;
 		}
-		workerp_wait(pool);
+		workerp_park(pool, self, 0, &node);
 	}
 	pthread_cleanup_pop(1);
 	return (NULL);
@@ -464,7 +5398,8 @@ workerp_is_idle(struct workerp *pool, size_t timeout_ms)
 		i = 10;
 		while (i--)
 		{
-			f = ((atomic_load(&pool->nof_worker) == atomic_load(&pool->idle)) && !threadsafeq_size(pool->q));
+			f = (!atomic_load(&pool->staged) && (atomic_load(&pool->nof_worker) == atomic_load(&pool->idle))
+				&& !threadsafeq_size(pool->q));
 			if (f || !timeout_ms)
 				goto endof_loop;
 			usleep(100);
@@ -482,17 +5417,41 @@ workerp_get_local_index(void)
 	return (workerp_local_index);
 }
 
+/*
+ * Workers on arena stacks are joinable: their stacks go back to the arena
+ * only once the threads are gone, not when they leave the loop.
+ */
+static void
+workerp_stack_release(struct workerp *pool, size_t n)
+{
+	size_t	i;
+
+	if (!pool->stackv)
+		return ;
+	i = 0;
+	while (i < n)
+		pthread_join(pool->thv[i++].tid, NULL);
+	qops_free(&qarena_allocator, pool->stackv, QARENA_STACK * pool->nof_thread, QOPS_CACHELINE);
+	pool->stackv = NULL;
+}
+
 int
 workerp_delete(struct workerp *pool)
 {
+	size_t	n;
+
 	if (!pool)
 		return (0);
 	if (workerp_finish_request(pool, 100))
 		return (-1);
+	workerp_stage_detach(pool);
 	threadsafeq_disconnect(pool->q);
+	workerp_stack_release(pool, pool->nof_thread);
 	pthread_mutex_destroy(&pool->lock);
-	pthread_cond_destroy(&pool->cond);
-	free(pool);
+	n = pool->nof_thread;
+	while (pool->nof_thread)
+		pthread_cond_destroy(&pool->thv[--pool->nof_thread].cond);
+	qops_free(pool->alloc, pool, sizeof (*pool) + (sizeof (struct workerp_thread) * n), _Alignof (struct workerp));
 	return (0);
 }
 
@@ -514,15 +5473,142 @@ workerp_exec(struct workerp *pool, struct qbuff *buff)
 void
 workerp_broadcast(struct workerp *pool)
 {
+	if (atomic_load(&pool->staged))
+		workerp_stage_flush_all(pool, 0);
 	workerp_on_broadcast(pool);
 }
 
+/* Returns 0 if a parked worker took the task. */
+static int
+workerp_handoff(struct workerp *pool, struct qnode *node)
+{
+	struct workerp_thread	*th;
+
+	/*
+	 * A parked worker takes the task directly. Workers only park on an empty
+	 * queue; if it is not empty any more the task is queued, so queued tasks
+	 * are not overtaken. Tasks of a fair queue always go through it, to be
+	 * charged to their tenant.
+	 */
+	if (pool && pool->q && node && atomic_load(&pool->idle) && !threadsafeq_size(pool->q)
+		&& (!pool->q->prio || pool->q->prio->policy != THREADSAFEQ_PRIO_FAIR))
+	{
+		pthread_mutex_lock(&pool->lock);
+		th = NULL;
+		if (!threadsafeq_size(pool->q))
+			th = workerp_unpark(pool);
+		if (th)
+		{
+			th->node = *node;
+			th->handoff = 1;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (th)
+			return (0);
+	}
+	return (-1);
+}
+
 int
 workerp_append(struct workerp *pool, struct qnode *node)
 {
+	if (!workerp_handoff(pool, node))
+		return (0);
 	return (threadsafeq_append(pool->q, node));
 }
 
+/* With the queue empty, no pending task shares the key. */
+int
+workerp_append_key(struct workerp *pool, struct qnode *node, uint64_t key)
+{
+	if (!pool || !pool->q || !pool->q->lanev || !pool->q->lanev->keys)
+		return (-1);
+	if (!workerp_handoff(pool, node))
+		return (0);
+	return (threadsafeq_append_key(pool->q, node, key));
+}
+
+/* A worker only parks on an empty queue, so a handoff overtakes no level. */
+int
+workerp_append_prio(struct workerp *pool, struct qnode *node, size_t level)
+{
+	if (!pool || level >= (pool->q && pool->q->prio ? pool->q->nof_lane : 1))
+		return (-1);
+	if (!workerp_handoff(pool, node))
+		return (0);
+	return (threadsafeq_append_prio(pool->q, node, level));
+}
+
+int
+workerp_append_batch(struct workerp *pool, struct qnode *nodev, size_t n)
+{
+	return (threadsafeq_append_batch(pool->q, nodev, n));
+}
+
+int
+workerp_append_buffered(struct workerp *pool, struct qnode *node)
+{
+	struct workerp_stage	*st;
+	uint64_t		now;
+	size_t			max;
+	size_t			usec;
+	int			ret;
+
+	if (!pool || !pool->q || !node)
+		return (-1);
+	st = workerp_stage_get(pool);
+	if (!st)
+		return (workerp_append(pool, node));
+	max = atomic_load(&pool->stage_max);
+	usec = atomic_load(&pool->stage_usec);
+	ret = 0;
+	pthread_mutex_lock(&st->lock);
+	if (st->n >= max && workerp_stage_flush(pool, st, 1) && st->n == WORKERP_BATCH_MAX)
+	{
+		ret = -1;
+		goto unlock;
+	}
+	now = usec ? qops_now_usec() : 0;
+	if (!st->n)
+		st->since = now;
+	st->nodev[st->n++] = *node;
+	/* First staged task of the pool: make a parked worker arm the deadline. */
+	if (!atomic_fetch_add(&pool->staged, 1) && usec)
+		workerp_on_append(pool, 1);
+	if (st->n >= max || (usec && now - st->since >= usec))
+		workerp_stage_flush(pool, st, 1);
+unlock:
+	pthread_mutex_unlock(&st->lock);
+	return (ret);
+}
+
+int
+workerp_flush(struct workerp *pool)
+{
+	struct workerp_stage	*st;
+	int			ret;
+
+	if (!pool || !pool->q)
+		return (-1);
+	st = workerp_stage_self;
+	while (st && atomic_load(&st->pool) != pool)
+		st = st->self_next;
+	if (!st)
+		return (0);
+	pthread_mutex_lock(&st->lock);
+	ret = workerp_stage_flush(pool, st, 1);
+	pthread_mutex_unlock(&st->lock);
+	return (ret);
+}
+
+void
+workerp_set_buffered(struct workerp *pool, size_t max, size_t usec)
+{
+	max = max < 1 ? 1 : max > WORKERP_BATCH_MAX ? WORKERP_BATCH_MAX : max;
+	atomic_store(&pool->stage_max, max);
+	atomic_store(&pool->stage_usec, usec);
+}
+
 int
 workerp_append_quiet(struct workerp *pool, struct qnode *node)
 {
@@ -530,7 +5616,7 @@ workerp_append_quiet(struct workerp *pool, struct qnode *node)
 }
 
 struct workerp	*
-workerp_new_sched(struct threadsafeq *q, size_t n, int sched, int priority)
+workerp_new_alloc(struct threadsafeq *q, size_t n, int sched, int priority, const struct qops_allocator *alloc)
 {
 	struct workerp		*pool;
 	pthread_attr_t		attr;
@@ -541,6 +5627,8 @@ workerp_new_sched(struct threadsafeq *q, size_t n, int sched, int priority)
 	if (!n)
 		goto sz_err;
 	n = n > QOPS_MAX_WORKER ? QOPS_MAX_WORKER : n;
+	if (q && q->ops == &threadsafeq_spsc_ops)
+		n = 1;
 	if (pthread_attr_init(&attr))
 		goto attr_err;
 	if (pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED))
@@ -550,14 +5638,26 @@ workerp_new_sched(struct threadsafeq *q, size_t n, int sched, int priority)
 	param.sched_priority = priority > WORKERP_MAX_PRIORITY? WORKERP_MAX_PRIORITY: priority;
 	if (pthread_attr_setschedparam(&attr, &param))
 		goto set_attr_err;
-	pool = malloc(sizeof(*pool) + (sizeof(pthread_t) * n));
+	if (!alloc)
+		alloc = &qops_std_allocator;
+	pool = qops_alloc(alloc, sizeof(*pool) + (sizeof(struct workerp_thread) * n), _Alignof (struct workerp));
 	if (!pool)
 		goto alloc_err;
-	*pool = (struct workerp){.q = q, .b = NULL, .nof_worker = 0, .idle = 0, .started = 0, .done = 0};
-	if (q && threadsafeq_connect(q, pool, (void (*)(void *))workerp_on_append, (void (*)(void *))workerp_on_broadcast))
+	*pool = (struct workerp){.q = q, .b = NULL, .parked = NULL, .nof_thread = 0, .nof_worker = 0, .idle = 0,
+		.started = 0, .done = 0, .staged = 0, .stage_max = WORKERP_BATCH_MAX, .stage_usec = WORKERP_STAGE_USEC,
+		.stagev = NULL, .stackv = NULL, .alloc = alloc};
+	pool->parked_tail = &pool->parked;
+	if (q && (q->arena & THREADSAFEQ_ARENA_STACKS) && !(pool->stackv = qops_alloc(&qarena_allocator, QARENA_STACK * n, QOPS_CACHELINE)))
+		goto stack_err;
+	if (q && threadsafeq_connect(q, pool, (void (*)(void *, size_t))workerp_on_append, (void (*)(void *))workerp_on_broadcast))
 		goto connnect_err;
-	if (0 != pthread_cond_init(&pool->cond, NULL))
-		goto cond_err;
+	while (pool->nof_thread < n)
+	{
+		pool->thv[pool->nof_thread] = (struct workerp_thread){.next = NULL, .parked = 0, .handoff = 0};
+		if (0 != pthread_cond_init(&pool->thv[pool->nof_thread].cond, NULL))
+			goto cond_err;
+		++pool->nof_thread;
+	}
 	if (0 != pthread_mutex_init(&pool->lock, NULL))
 		goto mutex_err;
 	i = 0;
@@ -566,25 +5666,37 @@ workerp_new_sched(struct threadsafeq *q, size_t n, int sched, int priority)
 		loop = workerp_loop;
 	while (i < n)
 	{
-		if (0 != pthread_create(&pool->tid[i], &attr, loop, pool))
+		if (pool->stackv && pthread_attr_setstack(&attr, pool->stackv + QARENA_STACK * i, QARENA_STACK))
+			goto thread_err;
+		if (0 != pthread_create(&pool->thv[i].tid, &attr, loop, pool))
 			goto thread_err;
-		pthread_detach(pool->tid[i++]);
+		if (!pool->stackv)
+			pthread_detach(pool->thv[i].tid);
+		++i;
 		atomic_fetch_add(&pool->nof_worker, 1);
 	}
 	pthread_attr_destroy(&attr);
 	while (atomic_load(&pool->nof_worker) != atomic_load(&pool->idle))
 		;
+	/* Appends of other processes reach the workers through the bell thread. */
+	if (q && q->shm)
+		qshm_bell_start(q);
 	return (pool);
 thread_err:
 	while (workerp_finish_request(pool, 1))
 		;
+	workerp_stack_release(pool, i);
 	pthread_mutex_destroy(&pool->lock);
 mutex_err:
-	pthread_cond_destroy(&pool->cond);
 cond_err:
+	while (pool->nof_thread)
+		pthread_cond_destroy(&pool->thv[--pool->nof_thread].cond);
 	threadsafeq_disconnect(q);
 connnect_err:
-	free(pool);
+	if (pool->stackv)
+		qops_free(&qarena_allocator, pool->stackv, QARENA_STACK * n, QOPS_CACHELINE);
+stack_err:
+	qops_free(alloc, pool, sizeof(*pool) + (sizeof(struct workerp_thread) * n), _Alignof (struct workerp));
 alloc_err:
 set_attr_err:
 	pthread_attr_destroy(&attr);
@@ -593,6 +5705,12 @@ sz_err:
 	return (NULL);
 }
 
+struct workerp	*
+workerp_new_sched(struct threadsafeq *q, size_t n, int sched, int priority)
+{
+	return (workerp_new_alloc(q, n, sched, priority, NULL));
+}
+
 struct workerp	*
 workerp_new(struct threadsafeq *q, size_t n)
 {
@@ -616,3 +5734,46 @@ workerp_nof_idle_workers(struct workerp *pool)
 }
 #endif
 
+int
+workerp_task_stats(struct workerp *pool, struct workerp_taskstats *st)
+{
+	size_t	i;
+
+	if (!pool || !st)
+		return (-1);
+	*st = (struct workerp_taskstats){0};
+	i = 0;
+	while (i < pool->nof_thread)
+	{
+		st->executed += atomic_load_explicit(&pool->thv[i].nof_exec, memory_order_relaxed);
+		st->expired += atomic_load_explicit(&pool->thv[i].nof_expired, memory_order_relaxed);
+		++i;
+	}
+	return (0);
+}
+
+int
+workerp_memory_stats(struct workerp *pool, struct workerp_memstats *st)
+{
+	struct workerp_stage	*curr;
+
+	if (!pool || !st)
+		return (-1);
+	*st = (struct workerp_memstats){.nof_worker = atomic_load(&pool->nof_worker), .nof_idle = atomic_load(&pool->idle),
+		.staged = atomic_load(&pool->staged)};
+	st->bytes_allocated = sizeof (*pool) + (sizeof (struct workerp_thread) * pool->nof_thread);
+	if (pool->stackv)
+		st->bytes_allocated += QARENA_STACK * pool->nof_thread;
+	pthread_mutex_lock(&workerp_stage_lock);
+	curr = pool->stagev;
+	while (curr)
+	{
+		st->bytes_allocated += sizeof (*curr);
+		++st->nof_stage;
+		curr = curr->pool_next;
+	}
+	pthread_mutex_unlock(&workerp_stage_lock);
+	if (pool->q)
+		threadsafeq_memory_stats(pool->q, &st->queue);
+	return (0);
+}
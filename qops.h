@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdbool.h>
@@ -13,11 +14,44 @@ extern "C" {
 #define QOPS_MAX_WORKER		0xffff
 #define QNODE_BUFF_DEFSIZE	64
 #define WORKERP_MAX_PRIORITY	99
+#define WORKERP_BATCH_MAX	64
+#define WORKERP_STAGE_USEC	1000
+#define QCLASS_MAX		4096
 
 #define WORKERP_SCHED_OTHER	SCHED_OTHER
 #define WORKERP_SCHED_RR	SCHED_RR
 #define WORKERP_SCHED_FIFO	SCHED_FIFO
 
+#define THREADSAFEQ_LIST	0	/* Unbounded list of qnode_buff chunks guarded by a lock (default). */
+#define THREADSAFEQ_RING	1	/* Bounded lock-free MPMC ring with per-slot sequence numbers. */
+#define THREADSAFEQ_LFLIST	2	/* Unbounded lock-free list of segments, claimed with fetch-and-add. */
+#define THREADSAFEQ_SPSC	3	/* Bounded ring for exactly one producer thread and one consumer thread. */
+#define THREADSAFEQ_SHARDED	4	/* Several independent LIST lanes, threads append to their own lane. */
+#define THREADSAFEQ_FLATCOMB	5	/* LIST where one lock holder applies the pending operations of all threads. */
+#define THREADSAFEQ_SHM		6	/* Bounded ring in a memfd segment that other processes map, see threadsafeq_shm_attach(). */
+
+#define THREADSAFEQ_LOCK_MUTEX		0	/* Default pthread mutex. */
+#define THREADSAFEQ_LOCK_MCS		1	/* MCS queue lock, each waiter spins on its own cache line. */
+#define THREADSAFEQ_LOCK_TICKET		2	/* Ticket lock, strict FIFO handoff. */
+#define THREADSAFEQ_LOCK_ADAPTIVE	3	/* Spins for a while, then sleeps on a futex. */
+#define THREADSAFEQ_LOCK_PI		4	/* Priority-inheritance pthread mutex (PTHREAD_PRIO_INHERIT). */
+
+#define THREADSAFEQ_FULL_BLOCK		0	/* Wait for room, up to `full_timeout_ms` (default). */
+#define THREADSAFEQ_FULL_FAIL		1	/* Return -1 immediately. */
+#define THREADSAFEQ_FULL_DROP_OLDEST	2	/* Remove the oldest tasks, running their cleanup, until the new ones fit. */
+#define THREADSAFEQ_FULL_CALLER_RUNS	3	/* Run the tasks in the appending thread instead of queueing them. */
+
+#define THREADSAFEQ_ARENA_CHUNKS	1	/* Node buffers (LIST, SHARDED, FLATCOMB) come from the huge page arena, whose regions stay mapped for the life of the process. */
+#define THREADSAFEQ_ARENA_STACKS	2	/* Worker pools on the queue run their workers on 2M stacks from the arena, mapped apart and unmapped with the pool. */
+
+#define THREADSAFEQ_PRIO_MAX		64	/* Most priority levels of a queue. */
+#define THREADSAFEQ_PRIO_STRICT		0	/* Always remove from the first non-empty level (default). */
+#define THREADSAFEQ_PRIO_WEIGHTED	1	/* Each non-empty level gets `prio_weights[level]` tasks per round, however they are batched. */
+#define THREADSAFEQ_PRIO_FAIR		2	/* Levels are tenants sharing the workers' CPU time by deficit round robin. */
+
+#define THREADSAFEQ_ESPILL	(-1001)	/* Passed to `err` (with NULL data) for a spilled task whose payload could not be decoded. */
+#define THREADSAFEQ_EEXPIRED	(-1002)	/* Passed to `err` instead of running `func` for a task removed after its deadline. */
+
 struct qnode
 {
 	struct qnode	*next;			/* next node */
@@ -25,12 +59,15 @@ struct qnode
 	int	(*func)(void *data);		/* Task function. First call */
 	void	(*err)(void *data, int errcode);/* Error handling callback. Second call if first call returns non-zero. The return value of func is passed as errcode. */
 	void	(*cleanup)(void *data);		/* Cleanup callback. Third call */
+	uint64_t	deadline;		/* CLOCK_MONOTONIC time in microseconds after which the task is not run, see qnode_deadline(). 0 means none. */
 };
 
 /**
  * @brief Executes the task in the node.
  *
  * This function executes the `func` of a `qnode`, handling errors and cleaning up afterwards.
+ * A task whose `deadline` has passed is not run: `err` gets THREADSAFEQ_EEXPIRED, then `cleanup`
+ * is called.
  *
  * @param node A pointer to the `qnode` to execute.
  * @return The result of executing the function (0 for success, non-zero for failure).
@@ -38,6 +75,57 @@ struct qnode
 int
 qnode_exec(struct qnode *node);
 
+/**
+ * @brief Returns the deadline `usec` microseconds from now, for `qnode::deadline`.
+ *
+ * Deadlines are CLOCK_MONOTONIC times and hold across the processes of a THREADSAFEQ_SHM queue.
+ * They are kept by every backend and by spill files. `compact` queues have no room for them in
+ * their 16 byte nodes and refuse appends of a task with a deadline.
+ *
+ * @param usec Microseconds from now.
+ * @return The deadline.
+ */
+uint64_t
+qnode_deadline(size_t usec);
+
+/**
+ * @brief Registers a task class.
+ *
+ * A task class is a (func, err, cleanup) triple. Registering the same triple again returns the
+ * same id. Compact queues store the class id and the data pointer of a task instead of the whole
+ * `qnode`; classes they meet on append are registered automatically, so calling this function is
+ * only needed to claim ids up front. Classes are never unregistered.
+ *
+ * @param func Task function.
+ * @param err Error handling callback, may be NULL.
+ * @param cleanup Cleanup callback, may be NULL.
+ * @return The class id, or -1 if QCLASS_MAX classes are already registered.
+ */
+int
+qclass_register(int (*func)(void *data), void (*err)(void *data, int errcode), void (*cleanup)(void *data));
+
+struct qclass_codec
+{
+	size_t	(*encode)(const void *data, void *buf, size_t len);	/* Writes `data` to `buf` if it fits in `len` bytes. Returns the bytes needed, SIZE_MAX if `data` cannot be encoded. */
+	int	(*decode)(const void *buf, size_t len, void **data);	/* Rebuilds the data of a task from `len` bytes. Returns 0 on success. */
+};
+
+/**
+ * @brief Makes the tasks of a class serializable, so queues with a spill file may move them to disk.
+ *
+ * Once spilled, a task is held as its encoded bytes: its cleanup runs on the original data right
+ * after `encode`, and the task later runs on the data returned by `decode`, which its cleanup
+ * releases as usual. Both callbacks run with a lane of the queue locked and must not call into the
+ * queue. The codec must stay valid as long as a queue may hold tasks of the class.
+ *
+ * @param cls A class id returned by qclass_register().
+ * @param codec The encode and decode callbacks, or NULL to stop spilling tasks of the class. Tasks
+ * spilled already are decoded by the codec that encoded them.
+ * @return 0 on success, -1 if `cls` is not registered or a callback is missing.
+ */
+int
+qclass_set_codec(int cls, const struct qclass_codec *codec);
+
 struct qnode_buff
 {
 	size_t			sz;
@@ -48,15 +136,34 @@ struct qnode_buff
 };
 
 
+/**
+ * @brief Allocator for the memory owned by a queue, a worker pool or a buffer.
+ *
+ * `alloc` returns `size` bytes aligned to `align` (a power of two, at most the cache line
+ * size), or NULL. `free` receives the pointer with the same `size` and `align`. Both may be
+ * called from any thread, workers included, and with queue locks held. The allocator must stay
+ * valid until everything allocated through it is freed: for a queue that is after
+ * threadsafeq_delete() and after the cleanup of its last running inline payload (the delete of
+ * a THREADSAFEQ_LFLIST queue waits for its retired segments and frees them); for a pool,
+ * after its producer threads have exited if they used workerp_append_buffered().
+ */
+struct qops_allocator
+{
+	void	*(*alloc)(void *ctx, size_t size, size_t align);
+	void	(*free)(void *ctx, void *ptr, size_t size, size_t align);
+	void	*ctx;
+};
+
 struct qbuff
 {
-	size_t		sz;
-	size_t		ri;
-	size_t		wi;
-	int		(*func)(void *data);
-	void		(*err)(void *data, int errorcode);
-	void		(*cleanup)(void *data);
-	void		*datav[];
+	const struct qops_allocator	*alloc;
+	size_t				sz;
+	size_t				ri;
+	size_t				wi;
+	int				(*func)(void *data);
+	void				(*err)(void *data, int errorcode);
+	void				(*cleanup)(void *data);
+	void				*datav[];
 };
 
 /**
@@ -77,6 +184,25 @@ qbuff_new(size_t size,
 		void (*err)(void *data, int errorcode),
 		void (*cleanup)(void *data));
 
+/**
+ * @brief Allocate a new buffer through `alloc`.
+ *
+ * Same as qbuff_new(); the buffer is allocated and freed with `alloc`, or malloc() if NULL.
+ *
+ * @param size The maximum number of nodes the buffer can contain. If 0, the default size is used.
+ * @param func    The main function of the task (executed first).
+ * @param err     The error handler (executed if func returns non-zero).
+ * @param cleanup The cleanup function (always executed last).
+ * @param alloc   The allocator, or NULL.
+ * @return A pointer to the newly allocated buffer, or NULL if allocation fails.
+ */
+struct qbuff *
+qbuff_new_alloc(size_t size,
+		int (*func)(void *data),
+		void (*err)(void *data, int errorcode),
+		void (*cleanup)(void *data),
+		const struct qops_allocator *alloc);
+
 /**
  * @brief Clear a buffer and cleanup tasks.
  *
@@ -114,6 +240,35 @@ qbuff_write(struct qbuff *qbuff, void *data);
 
 
 struct threadsafeq;
+
+struct threadsafeq_attr
+{
+	int	type;		/* Queue backend. One of the THREADSAFEQ_* backend macros. */
+	size_t	buff_sz;	/* Nodes per buffer (LIST, LFLIST) or capacity of the ring (RING, SPSC, SHM, rounded up to a power of two). 0 means QNODE_BUFF_DEFSIZE. */
+	size_t	buff_max;	/* Adaptive buffers (LIST, SHARDED, FLATCOMB). If larger than `buff_sz`, buffers double up to `buff_max` nodes while the queue is deep and halve back towards `buff_sz` each time it drains. 0 disables. */
+	size_t	lanes;		/* Number of lanes (SHARDED). 0 means the number of online CPUs. */
+	int	lock;		/* Lock strategy of the lanes (LIST, SHARDED, FLATCOMB). One of the THREADSAFEQ_LOCK_* macros. */
+	size_t	capacity;	/* Maximum load of the queue, 0 means unbounded. Counted in tasks, or in the units returned by `weigh`. */
+	size_t	(*weigh)(const struct qnode *node);	/* Load of a task, e.g. the bytes it holds. Must return the same value on append and remove. NULL counts tasks. */
+	int	full_policy;	/* What appending to a full queue does. One of the THREADSAFEQ_FULL_* macros. */
+	size_t	full_timeout_ms;	/* THREADSAFEQ_FULL_BLOCK: how long to wait for room, 0 waits forever. */
+	int	compact;	/* LIST, SHARDED, FLATCOMB: store 16 byte nodes (task class id and data pointer), see qclass_register(). */
+	size_t	inline_sz;	/* LIST, SHARDED, FLATCOMB: inline payload bytes per node carved from each buffer. SHM: payload bytes of each cell. See threadsafeq_reserve_slot(). 0 disables. */
+	int	arena;		/* THREADSAFEQ_ARENA_* flags: allocate from the process wide huge page arena. */
+	const struct qops_allocator	*allocator;	/* Memory of the queue and its buffers (unless from the arena). NULL uses malloc(). */
+	const char	*spill_dir;	/* LIST, SHARDED, FLATCOMB: directory of the spill files, see qclass_set_codec(). NULL keeps every task in memory. */
+	size_t		spill_depth;	/* Nodes a lane holds in memory before it spills. 0 means 64 buffers. */
+	size_t		levels;		/* LIST: priority levels, level 0 first, each with its own buffers. 0 or 1 disables. At most THREADSAFEQ_PRIO_MAX. */
+	int		prio_policy;	/* How removes pick a level. One of the THREADSAFEQ_PRIO_* policies. */
+	const size_t	*prio_weights;	/* THREADSAFEQ_PRIO_WEIGHTED, FAIR: `levels` weights. NULL (or a 0 weight) gives level i a weight of `levels - i`, a tenant a weight of 1. */
+	size_t		prio_aging_usec;	/* Remove from a waiting level at least once per this many microseconds, whatever the policy. 0 disables. Not used by THREADSAFEQ_PRIO_FAIR. */
+	size_t		prio_quantum_usec;	/* THREADSAFEQ_PRIO_FAIR: CPU time a tenant of weight 1 gets per round. 0 means 1000. */
+	const size_t	*prio_quota_usec;	/* THREADSAFEQ_PRIO_FAIR: `levels` limits of the CPU time of each tenant per `prio_period_usec`, 0 for none. NULL sets no limit. */
+	size_t		prio_period_usec;	/* THREADSAFEQ_PRIO_FAIR: quota period. 0 means one second. */
+	int		keyed;		/* LIST: index pending tasks by key for threadsafeq_append_key(). Not with `levels`, `inline_sz` or `spill_dir`. */
+	void		*(*coalesce)(void *pending, void *incoming);	/* `keyed`: payload kept when a task meets a pending one of its key. NULL keeps `incoming`. */
+};
+
 /**
  * @brief Appends a node to the thread-safe queue and signals workers.
  *
@@ -138,6 +293,102 @@ threadsafeq_append(struct threadsafeq *q, struct qnode *node);
 int
 threadsafeq_append_quiet(struct threadsafeq *q, struct qnode *node);
 
+/**
+ * @brief Appends a node to a keyed queue, or coalesces it with the pending task of the same key.
+ *
+ * If a task appended under `key` is still queued, no task is added: the queued task takes the
+ * callbacks and deadline of `node` and keeps its place in the queue. Its payload becomes
+ * `attr->coalesce(pending, incoming)`, or the new payload without a coalesce callback; each
+ * payload no longer queued is passed to the cleanup of its own task. The callback is called
+ * with the queue locked and must not use the queue. A coalescing append needs no room: it is
+ * not subject to `attr->full_policy`, and the load of the queue changes by the new weight of
+ * the task minus its old one, which may take it past the capacity. Otherwise the node is
+ * appended like with threadsafeq_append() and indexed under `key`.
+ *
+ * The index is an open addressing table next to the buffers; entries of removed tasks are
+ * dropped when it grows, so appends and removes stay O(1). A removed task no longer coalesces,
+ * even while it runs.
+ *
+ * @param q A pointer to a queue created with `threadsafeq_attr::keyed`.
+ * @param node A pointer to the `qnode` to add.
+ * @param key The key of the task.
+ * @return 0 on success (appended or coalesced), -1 on failure or if the queue is not keyed.
+ */
+int
+threadsafeq_append_key(struct threadsafeq *q, struct qnode *node, uint64_t key);
+
+/**
+ * @brief Appends a node to a priority level of the thread-safe queue and signals workers.
+ *
+ * Level 0 is removed first, see `threadsafeq_attr::levels`. threadsafeq_append() and the batch
+ * appends use the last level. A queue without levels only has level 0.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @param node A pointer to the `qnode` to add.
+ * @param level The priority level, below the number of levels.
+ * @return 0 on success, -1 on failure or if `level` does not exist.
+ */
+int
+threadsafeq_append_prio(struct threadsafeq *q, struct qnode *node, size_t level);
+
+/**
+ * @brief Appends an array of nodes to the thread-safe queue and signals workers once.
+ *
+ * The nodes are copied in order under a single lock acquisition and published with a single
+ * update of the queue size, so consumers see either none or all of them. At most `n` idle
+ * workers are woken, with one notification.
+ *
+ * LIST, SHARDED, FLATCOMB and SPSC append the whole batch or nothing. RING also appends all or
+ * nothing, but the nodes become visible one by one. LFLIST appends node by node and may leave a
+ * prefix of the batch appended when it fails.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @param nodev An array of `n` nodes to add.
+ * @param n The number of nodes in `nodev`.
+ * @return 0 on success, -1 on failure.
+ */
+int
+threadsafeq_append_batch(struct threadsafeq *q, struct qnode *nodev, size_t n);
+
+/**
+ * @brief Reserves `len` payload bytes inside the queue's buffers.
+ *
+ * Only for queues created with `attr->inline_sz`. The payload is carved from the area behind
+ * the slots of the tail buffer of the caller's lane, so a task needs no allocation of its own:
+ * write the payload in place, then publish it with threadsafeq_commit_slot(). Payloads are
+ * aligned like max_align_t and may have any length up to `buff_sz * inline_sz` bytes;
+ * `inline_sz` bytes always fit in every slot.
+ *
+ * On a THREADSAFEQ_SHM queue the payload is the cell claimed at the tail of the shared ring and
+ * takes up to `inline_sz` bytes. No lock is held until the commit, but the cell holds up the
+ * consumers until it is committed; a NULL `node` leaves it to be skipped.
+ *
+ * The lane stays locked until the commit. Keep the window short and do not call any other
+ * function on the queue in between. Counts as one task against a capacity; a `weigh` based
+ * capacity is not supported and THREADSAFEQ_FULL_CALLER_RUNS rejects the reservation.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @param len The payload length in bytes.
+ * @return A pointer to the payload, or NULL on failure.
+ */
+void *
+threadsafeq_reserve_slot(struct threadsafeq *q, size_t len);
+
+/**
+ * @brief Publishes a payload reserved with threadsafeq_reserve_slot() and signals workers.
+ *
+ * The task runs `node->func`, `node->err` and `node->cleanup` with the payload as data
+ * (`node->data` is ignored). The payload stays valid until its cleanup returns, after that
+ * its buffer is recycled. If `node` is NULL, the reservation is dropped.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @param slot The pointer returned by threadsafeq_reserve_slot().
+ * @param node The callbacks of the task, or NULL.
+ * @return 0 on success, -1 on failure; the reservation is released either way.
+ */
+int
+threadsafeq_commit_slot(struct threadsafeq *q, void *slot, struct qnode *node);
+
 /**
  * @brief Broadcasts a signal to all workers in the queue.
  *
@@ -160,6 +411,69 @@ threadsafeq_broadcast(struct threadsafeq *q);
 int
 threadsafeq_remove(struct threadsafeq *q, struct qnode *node);
 
+/**
+ * @brief Removes up to `n` nodes from the thread-safe queue.
+ *
+ * The nodes are taken from the front of the queue in one critical section
+ * (one combining pass for FLATCOMB, one CAS for RING) and copied to `nodev` in order.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @param nodev An array of at least `n` nodes to store the removed nodes.
+ * @param n The maximum number of nodes to remove.
+ * @return The number of nodes removed, 0 if the queue is empty.
+ */
+size_t
+threadsafeq_remove_batch(struct threadsafeq *q, struct qnode *nodev, size_t n);
+
+/**
+ * @brief Moves up to `n` pending nodes from the front of `src` to the back of `dst`.
+ *
+ * Between LIST, SHARDED and FLATCOMB queues without a capacity, the node buffers are
+ * relinked under both locks: the cost depends on the number of buffers, not nodes, and
+ * only the buffer that is split is copied. Taking every node of a lane relinks its list
+ * at once, whatever its length. Lane i of a SHARDED `src` goes to lane i modulo
+ * the lanes of `dst`. Other backends, and queues with a capacity, move the nodes one by one;
+ * then the splice stops once `dst` is full, before taking a node it has no room for, so the
+ * nodes keep their order. A node `dst` refuses anyway (a concurrent producer took the room,
+ * no memory) goes back to the back of `src`, past its capacity. The last node moved may exceed a `weigh`
+ * based capacity by its own weight. The workers of `dst` are woken for the moved nodes.
+ *
+ * @param dst The queue receiving the nodes.
+ * @param src The queue giving the nodes.
+ * @param n The maximum number of nodes to move.
+ * @return The number of nodes moved.
+ */
+size_t
+threadsafeq_splice_n(struct threadsafeq *dst, struct threadsafeq *src, size_t n);
+
+/**
+ * @brief Moves all pending nodes of `src` to the back of `dst`.
+ *
+ * Same as threadsafeq_splice_n() without a limit.
+ *
+ * @param dst The queue receiving the nodes.
+ * @param src The queue giving the nodes.
+ * @return The number of nodes moved.
+ */
+size_t
+threadsafeq_splice(struct threadsafeq *dst, struct threadsafeq *src);
+
+/**
+ * @brief Preallocates room for `n` nodes.
+ *
+ * The LIST, SHARDED and FLATCOMB backends recycle drained buffers through a bounded
+ * freelist per lane. This function fills the freelists with enough buffers for `n` nodes
+ * (spread over the lanes) and raises their bound to keep them, so a queue that stays
+ * below `n` nodes never calls the allocator. RING and SPSC are preallocated and only
+ * check that `n` fits. THREADSAFEQ_LFLIST is not supported.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @param n The number of nodes to reserve room for.
+ * @return 0 on success, -1 on allocation failure, if `n` does not fit or if unsupported.
+ */
+int
+threadsafeq_reserve(struct threadsafeq *q, size_t n);
+
 /**
  * @brief Returns the size of the thread-safe queue.
  *
@@ -171,6 +485,67 @@ threadsafeq_remove(struct threadsafeq *q, struct qnode *node);
 size_t
 threadsafeq_size(struct threadsafeq *q);
 
+/**
+ * @brief Returns the number of tasks in a priority level of the thread-safe queue.
+ *
+ * threadsafeq_size() sums the levels. A queue without levels only has level 0.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @param level The priority level.
+ * @return The size of the level, 0 if it does not exist.
+ */
+size_t
+threadsafeq_size_level(struct threadsafeq *q, size_t level);
+
+/**
+ * @brief Returns the CPU time the workers spent on the tasks of a tenant.
+ *
+ * @param q A pointer to a queue with THREADSAFEQ_PRIO_FAIR levels.
+ * @param level The tenant.
+ * @return The CPU time in microseconds, 0 if the queue has no such tenant.
+ */
+uint64_t
+threadsafeq_level_cpu_usec(struct threadsafeq *q, size_t level);
+
+struct threadsafeq_memstats
+{
+	size_t	bytes_allocated;	/* Bytes held by the queue: its structures, node buffers or segments, cached buffers included. */
+	size_t	bytes_in_use;		/* Bytes of the slots (and inline payload areas) of the queued nodes. */
+	size_t	bytes_cached;		/* Bytes of drained buffers kept for reuse (LIST, SHARDED, FLATCOMB). */
+	size_t	nof_chunk;		/* Node buffers, segments or rings allocated, cached buffers included. */
+	size_t	peak_bytes;		/* High-water mark of `bytes_allocated`. */
+	size_t	spilled;		/* Tasks held in spill files, not part of the other fields. */
+};
+
+/**
+ * @brief Reports the memory held by the queue.
+ *
+ * `bytes_allocated`, `nof_chunk` and `peak_bytes` are read from counters kept on allocation and
+ * free; `bytes_cached` walks the freelists under the lane locks. Under load the fields are not a
+ * consistent snapshot of each other. A buffer that still backs running inline payloads is no
+ * longer counted once the queue drained it.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @param st Receives the statistics.
+ * @return 0 on success, -1 if `q` or `st` is NULL.
+ */
+int
+threadsafeq_memory_stats(struct threadsafeq *q, struct threadsafeq_memstats *st);
+
+/**
+ * @brief Releases the memory the queue keeps but does not need.
+ *
+ * For LIST, SHARDED and FLATCOMB, frees the cached buffers (including those preallocated by
+ * threadsafeq_reserve()) and the drained buffers at the front of each lane, and resets adaptive
+ * buffers to `buff_sz`. The buffers holding queued nodes are kept. Other backends hold no spare
+ * memory.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @return The number of bytes released.
+ */
+size_t
+threadsafeq_trim(struct threadsafeq *q);
+
 /**
  * @brief Deletes the thread-safe queue and cleans up all resources.
  *
@@ -192,6 +567,125 @@ threadsafeq_delete(struct threadsafeq *q);
 struct threadsafeq *
 threadsafeq_new(size_t buff_sz);
 
+/**
+ * @brief Creates a new thread-safe queue with the given attributes.
+ *
+ * This function initializes a new `threadsafeq` using the backend selected by `attr->type`.
+ * threadsafeq_new(buff_sz) is equivalent to a THREADSAFEQ_LIST queue with the same `buff_sz`.
+ *
+ * - THREADSAFEQ_LIST: unbounded, appends never fail unless allocation fails.
+ * - THREADSAFEQ_RING: bounded to `buff_sz` nodes, append returns -1 while the ring is full.
+ *   No lock is taken on append or remove.
+ * - THREADSAFEQ_LFLIST: unbounded and lock-free. Segments of `buff_sz` nodes are linked with CAS
+ *   and released through epoch based reclamation once every consumer has left them.
+ * - THREADSAFEQ_SPSC: bounded to `buff_sz` nodes like RING, but only one thread may append and
+ *   one thread may remove. No atomic read-modify-write is done on append or remove.
+ *   A worker pool created on it is limited to a single worker.
+ * - THREADSAFEQ_SHARDED: `lanes` independent LIST queues, each with its own buffers and lock.
+ *   A thread appends to its home lane (its worker index, or a per-thread id) and removes from
+ *   its home lane first, then from the others. threadsafeq_size() sums the lanes.
+ * - THREADSAFEQ_FLATCOMB: a LIST queue with flat combining. Threads publish their append or remove
+ *   in a slot; the thread that wins the lock applies every published operation in one pass.
+ * - THREADSAFEQ_SHM: a ring of `buff_sz` cells of `inline_sz` payload bytes, like RING, in shared
+ *   memory that other processes attach to with threadsafeq_shm_attach(). No `capacity`.
+ *
+ * With a `capacity`, every append reserves the load of its tasks first and every remove releases it,
+ * so the queue never holds more. A full queue is handled by `attr->full_policy`; blocked producers
+ * are woken by the removes, not by polling. A task heavier than the whole capacity is accepted by
+ * an empty queue. Batch appends are admitted as a whole.
+ *
+ * With `attr->compact`, a node takes 16 bytes instead of sizeof(struct qnode): its callbacks are
+ * interned as a task class (see qclass_register()) and restored on remove. An append fails when
+ * it would need a new class and QCLASS_MAX classes exist, or when a task has a `deadline`.
+ *
+ * With THREADSAFEQ_ARENA_CHUNKS in `attr->arena`, the node buffers are carved from 2M pages
+ * (MAP_HUGETLB, or transparent huge pages through madvise() when none are reserved) shared by all
+ * such queues, which cuts the dTLB misses of walking a deep queue. Buffer sizes are rounded up
+ * to size classes (powers of two and their midpoints), and freed buffers are reused for their
+ * class. The 2M regions stay mapped for the life of the process, so threadsafeq_trim() gives
+ * arena buffers back to the arena, not to the system. THREADSAFEQ_ARENA_STACKS puts the workers
+ * of pools created on the queue on 2M arena stacks, without a guard page; blocks of 2M or more
+ * like these are mapped apart and unmapped when freed.
+ *
+ * With `attr->spill_dir`, each lane keeps an unlinked file in that directory. Once a lane holds
+ * `spill_depth` nodes, tasks of classes with a codec (see qclass_set_codec()) are encoded into 4M
+ * segments of the file, written through a shared mapping, instead of growing the buffers. They are
+ * read back in order, with sequential readahead, a buffer at a time as the lane drains, and segments
+ * read are punched out of the file. While tasks are spilled, the following serializable tasks are
+ * spilled behind them; other tasks, and tasks that cannot be spilled (encode refuses them, they are
+ * larger than a segment, or the file cannot grow), stay in memory and may overtake them. Spilled
+ * tasks count in threadsafeq_size() and against a capacity. A batch appended while the lane spills
+ * is appended node by node. Splices between spilling queues move node by node. Not available with
+ * `inline_sz`.
+ *
+ * With `attr->levels`, a LIST queue keeps one list of buffers per priority level and a bitmap of
+ * the levels holding tasks, so a remove finds its level with a single find-first-set. With
+ * THREADSAFEQ_PRIO_STRICT a remove takes the oldest task of the first non-empty level; with
+ * THREADSAFEQ_PRIO_WEIGHTED the non-empty levels take turns, each taking up to its weight in tasks
+ * per round, higher levels first. With `attr->prio_aging_usec`, a level that has waited that long
+ * since its last remove (or since it became non-empty) is served next, so low levels never starve.
+ * Tasks are FIFO within a level. THREADSAFEQ_FULL_DROP_OLDEST drops from the last non-empty level.
+ * Splices move node by node into the last level. Not available with `inline_sz`.
+ *
+ * With THREADSAFEQ_PRIO_FAIR the levels are tenants, with the tenant id as the level of
+ * threadsafeq_append_prio(). The workers of a pool measure the CPU time (CLOCK_THREAD_CPUTIME_ID)
+ * of each batch and charge it to its tenant; tenants take turns by deficit round robin, each
+ * getting `prio_quantum_usec` times its weight per round, so a tenant that floods the queue only
+ * delays the others by the batches in flight. A batch holds as many tasks as the tenant's deficit
+ * covers at their average cost. A tenant that used its `prio_quota_usec` is not served until the
+ * period ends, even with workers idle. Tasks removed outside a pool are charged their average
+ * cost. THREADSAFEQ_FULL_DROP_OLDEST drops from the deepest tenant.
+ *
+ * The lock of the lock based backends is selected with `attr->lock`. MCS and TICKET spin and only
+ * yield the CPU after a while; do not use them when threads of different real-time priorities share
+ * a CPU, THREADSAFEQ_LOCK_PI is meant for that case.
+ *
+ * @param attr The queue attributes. If NULL, a THREADSAFEQ_LIST queue with default buffer size is created.
+ * @return A pointer to the newly created queue, or NULL if allocation fails or the attributes are invalid.
+ */
+struct threadsafeq *
+threadsafeq_new_attr(const struct threadsafeq_attr *attr);
+
+/**
+ * @brief Maps the segment of a THREADSAFEQ_SHM queue created by another process.
+ *
+ * The segment of a THREADSAFEQ_SHM queue is a memfd, see threadsafeq_shm_fd(); a process inherits
+ * it across fork() or receives it over a unix socket (SCM_RIGHTS). Every process that maps it can
+ * append to and remove from the same ring with the usual functions; `fd` stays owned by the caller.
+ *
+ * Tasks cross the segment as a task class id, a data word and an optional inline payload. Class ids
+ * come from qclass_register() and must name the same callbacks in every process: register the
+ * classes in the same order before forking or in each process at start up. Only the classes
+ * registered before the queue was created cross the segment; appending a task of another class
+ * fails, and a cell naming another class is skipped by the consumers. A node appended with
+ * threadsafeq_append() has its `data` pointer passed on as an opaque word, which only makes sense
+ * to another process as a number or as an address in memory mapped at the same place. A payload
+ * written between threadsafeq_reserve_slot() and threadsafeq_commit_slot() is passed by address in
+ * the segment, without a copy; its cell is given back to the producers after the task's cleanup.
+ *
+ * Appends and removes are lock-free and make no system call, except an append to an empty ring
+ * while a consumer process waits for work. A process that creates a worker pool on the queue runs
+ * one more thread that sleeps on a futex in the segment and wakes the workers for the appends of
+ * other processes.
+ *
+ * @param fd A file descriptor of the segment.
+ * @return A pointer to the queue, or NULL if `fd` is not the segment of a THREADSAFEQ_SHM queue.
+ */
+struct threadsafeq *
+threadsafeq_shm_attach(int fd);
+
+/**
+ * @brief Returns the memfd holding the segment of a THREADSAFEQ_SHM queue.
+ *
+ * The descriptor is close-on-exec and is closed by threadsafeq_delete(). The segment lives as
+ * long as a process maps it; tasks left in it when a process deletes its queue stay there.
+ *
+ * @param q A pointer to the `threadsafeq`.
+ * @return The file descriptor, or -1 if `q` is not a THREADSAFEQ_SHM queue.
+ */
+int
+threadsafeq_shm_fd(struct threadsafeq *q);
+
 struct workerp;
 
 /**
@@ -230,7 +724,9 @@ workerp_broadcast(struct workerp *pool);
 /**
  * @brief Appends a task to the worker pool's queue.
  *
- * This function adds a task to the queue of the worker pool.
+ * This function adds a task to the queue of the worker pool. If a worker is parked and the queue
+ * is empty, the task is handed to that worker directly and only that worker is woken; the queue
+ * (and its capacity) is bypassed.
  *
  * @param pool A pointer to the worker pool.
  * @param node A pointer to the `qnode` representing the task.
@@ -239,6 +735,84 @@ workerp_broadcast(struct workerp *pool);
 int
 workerp_append(struct workerp *pool, struct qnode *node);
 
+/**
+ * @brief Appends a task to the worker pool's keyed queue, coalescing it with a pending one.
+ *
+ * See threadsafeq_append_key(). Like workerp_append(), the task is handed to a parked worker
+ * when the queue is empty.
+ *
+ * @param pool A pointer to the worker pool.
+ * @param node A pointer to the `qnode` representing the task.
+ * @param key The key of the task.
+ * @return 0 on success, -1 on failure or if the queue is not keyed.
+ */
+int
+workerp_append_key(struct workerp *pool, struct qnode *node, uint64_t key);
+
+/**
+ * @brief Appends a task to a priority level of the worker pool's queue.
+ *
+ * See threadsafeq_append_prio(). Like workerp_append(), the task is handed to a parked worker
+ * when the queue is empty, unless the levels are THREADSAFEQ_PRIO_FAIR tenants.
+ *
+ * @param pool A pointer to the worker pool.
+ * @param node A pointer to the `qnode` representing the task.
+ * @param level The priority level, below the number of levels of the queue.
+ * @return 0 on success, -1 on failure or if `level` does not exist.
+ */
+int
+workerp_append_prio(struct workerp *pool, struct qnode *node, size_t level);
+
+/**
+ * @brief Appends an array of tasks to the worker pool's queue.
+ *
+ * See threadsafeq_append_batch(). Wakes at most min(idle workers, `n`) workers.
+ *
+ * @param pool A pointer to the worker pool.
+ * @param nodev An array of `n` tasks.
+ * @param n The number of tasks in `nodev`.
+ * @return 0 on success, -1 on failure.
+ */
+int
+workerp_append_batch(struct workerp *pool, struct qnode *nodev, size_t n);
+
+/**
+ * @brief Stages a task in the calling thread's append buffer of the pool.
+ *
+ * The buffer is flushed into the queue with one threadsafeq_append_batch() when it holds the
+ * configured number of tasks, when its oldest task is older than the configured deadline, or
+ * on workerp_flush(). An idle worker flushes buffers whose deadline passed, so a producer that
+ * goes quiet does not strand its tasks. workerp_broadcast(), workerp_delete() and the exit of
+ * the producer thread flush everything. Do not mix with direct appends on a THREADSAFEQ_SPSC queue.
+ *
+ * @param pool A pointer to the worker pool.
+ * @param node A pointer to the `qnode` representing the task.
+ * @return 0 on success, -1 if the buffer is full and cannot be flushed.
+ */
+int
+workerp_append_buffered(struct workerp *pool, struct qnode *node);
+
+/**
+ * @brief Flushes the calling thread's append buffer of the pool into the queue.
+ *
+ * @param pool A pointer to the worker pool.
+ * @return 0 on success, -1 if the queue did not accept the tasks; they stay buffered.
+ */
+int
+workerp_flush(struct workerp *pool);
+
+/**
+ * @brief Sets the flush thresholds of workerp_append_buffered().
+ *
+ * Defaults are WORKERP_BATCH_MAX tasks and WORKERP_STAGE_USEC microseconds.
+ *
+ * @param pool A pointer to the worker pool.
+ * @param max Flush once a buffer holds this many tasks, clamped to 1..WORKERP_BATCH_MAX.
+ * @param usec Flush once the oldest buffered task is this old; 0 disables the deadline.
+ */
+void
+workerp_set_buffered(struct workerp *pool, size_t max, size_t usec);
+
 /**
  * @brief Appends a task to the worker pool's queue without signaling workers.
  *
@@ -257,7 +831,7 @@ workerp_append_quiet(struct workerp *pool, struct qnode *node);
  * This function creates a new worker pool, initializes threads, and prepares the pool for processing tasks.
  *
  * @param q A pointer to the `threadsafeq` for task distribution.
- * @param n The number of worker threads to create.
+ * @param n The number of worker threads to create. Always 1 for a THREADSAFEQ_SPSC queue.
  * @return A pointer to the newly created worker pool, or NULL if allocation fails.
  */
 struct workerp *
@@ -275,7 +849,7 @@ workerp_new(struct threadsafeq *q, size_t n);
  * - WORKERP_SCHED_FIFO (real-time first-in-first-out)
  *
  * @param q A pointer to the `threadsafeq` for task distribution.
- * @param n The number of worker threads to create.
+ * @param n The number of worker threads to create. Always 1 for a THREADSAFEQ_SPSC queue.
  * @param sched The scheduling policy to use for worker threads. Use one of the WORKERP_SCHED_* macros.
  * @param priority The thread priority (used with real-time policies such as RR or FIFO). Ignored for SCHED_OTHER.
  * @return A pointer to the newly created worker pool, or NULL if allocation or thread setup fails.
@@ -283,6 +857,22 @@ workerp_new(struct threadsafeq *q, size_t n);
 struct workerp *
 workerp_new_sched(struct threadsafeq *q, size_t n, int sched, int priority);
 
+/**
+ * @brief Creates a new worker pool whose memory comes from `alloc`.
+ *
+ * Same as workerp_new_sched(). The pool and the append buffers of workerp_append_buffered()
+ * are allocated through `alloc`; the queue keeps its own allocator.
+ *
+ * @param q A pointer to the `threadsafeq` for task distribution.
+ * @param n The number of worker threads to create. Always 1 for a THREADSAFEQ_SPSC queue.
+ * @param sched The scheduling policy to use for worker threads. Use one of the WORKERP_SCHED_* macros.
+ * @param priority The thread priority. Ignored for SCHED_OTHER.
+ * @param alloc The allocator, or NULL for malloc().
+ * @return A pointer to the newly created worker pool, or NULL if allocation or thread setup fails.
+ */
+struct workerp *
+workerp_new_alloc(struct threadsafeq *q, size_t n, int sched, int priority, const struct qops_allocator *alloc);
+
 /**
  * @brief Gets the index of the currently executing worker thread.
  *
@@ -312,8 +902,8 @@ workerp_nof_workers(struct workerp *pool);
 /**
  * @brief Get the current number of idle worker threads in the pool.
  *
- * Returns the number of workers that are currently idle (i.e., waiting on the
- * pool's condition variable because the queue is empty). The value is read from
+ * Returns the number of workers that are currently idle (i.e., parked on their
+ * condition variable because the queue is empty). The value is read from
  * an atomic counter and represents a moment-in-time snapshot; it may change
  * immediately under contention.
  *
@@ -336,6 +926,46 @@ workerp_nof_idle_workers(struct workerp *pool);
 int
 workerp_exec(struct workerp *pool, struct qbuff *buff);
 
+struct workerp_taskstats
+{
+	size_t	executed;	/* Tasks whose `func` the workers ran. */
+	size_t	expired;	/* Tasks the workers removed after their deadline and did not run. */
+};
+
+/**
+ * @brief Counts the tasks the workers of the pool took from its queue.
+ *
+ * Workers check the deadlines of a removed batch against one reading of the clock, so a run
+ * of expired tasks is shed at the cost of its err and cleanup calls. Tasks run through
+ * workerp_exec() are not counted.
+ *
+ * @param pool A pointer to the worker pool.
+ * @param st Filled with the counts, summed over the workers.
+ * @return 0 on success, -1 if `pool` or `st` is NULL.
+ */
+int
+workerp_task_stats(struct workerp *pool, struct workerp_taskstats *st);
+
+struct workerp_memstats
+{
+	size_t				bytes_allocated;	/* Pool, its arena worker stacks and the append buffers of its producers. */
+	size_t				nof_worker;
+	size_t				nof_idle;
+	size_t				nof_stage;	/* Append buffers of producer threads (workerp_append_buffered()). */
+	size_t				staged;		/* Tasks waiting in those buffers. */
+	struct threadsafeq_memstats	queue;		/* The pool's queue, zeroed if it has none. */
+};
+
+/**
+ * @brief Reports the memory held by the worker pool and its queue.
+ *
+ * @param pool Pointer to the worker pool instance.
+ * @param st Receives the statistics.
+ * @return 0 on success, -1 if `pool` or `st` is NULL.
+ */
+int
+workerp_memory_stats(struct workerp *pool, struct workerp_memstats *st);
+
 #ifdef __cplusplus
 }
 #endif
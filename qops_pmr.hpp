@@ -0,0 +1,66 @@
+#ifndef QOPS_PMR_HPP
+# define QOPS_PMR_HPP
+
+# include <cstddef>
+# include <memory_resource>
+# include "qops.h"
+
+namespace qops
+{
+
+/**
+ * @brief A `qops_allocator` that forwards to a std::pmr::memory_resource.
+ *
+ * Pass it as `threadsafeq_attr::allocator`, to workerp_new_alloc() or to qbuff_new_alloc()
+ * to place and account the memory of qops through any memory resource (pools, monotonic
+ * buffers, NUMA or jemalloc backed resources). The adapter and the resource must outlive
+ * the objects using them, see `qops_allocator`. An allocation failure of the resource is
+ * reported to qops as NULL; the resource must be safe to use from several threads.
+ */
+class pmr_allocator : public qops_allocator
+{
+public:
+	explicit pmr_allocator(std::pmr::memory_resource *mr = std::pmr::get_default_resource()) noexcept
+		: qops_allocator{&pmr_allocator::do_alloc, &pmr_allocator::do_free, mr}
+	{
+	}
+
+	pmr_allocator(const pmr_allocator &) = delete;
+	pmr_allocator &operator=(const pmr_allocator &) = delete;
+
+	std::pmr::memory_resource *
+	resource() const noexcept
+	{
+		return (static_cast<std::pmr::memory_resource *>(ctx));
+	}
+
+	const qops_allocator *
+	get() const noexcept
+	{
+		return (this);
+	}
+
+private:
+	static void *
+	do_alloc(void *ctx, std::size_t size, std::size_t align) noexcept
+	{
+		try
+		{
+			return (static_cast<std::pmr::memory_resource *>(ctx)->allocate(size, align));
+		}
+		catch (...)
+		{
+			return (nullptr);
+		}
+	}
+
+	static void
+	do_free(void *ctx, void *ptr, std::size_t size, std::size_t align) noexcept
+	{
+		static_cast<std::pmr::memory_resource *>(ctx)->deallocate(ptr, size, align);
+	}
+};
+
+}
+
+#endif
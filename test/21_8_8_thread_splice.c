@@ -0,0 +1,231 @@
+
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DATA	"Lorem ipsum"
+#define LOOP	10000000
+#define LOOP2	1000
+#define RSZ	1024
+
+#define BSZ 1024
+#define WSZ 8
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int cnt = 0;
+
+int
+func(void *data)
+{
+	if (!data || strcmp(DATA, (char *)data))
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	(void)data;
+}
+
+int
+func2(void *data)
+{
+	struct threadsafeq	*q;
+
+	q = (struct threadsafeq *)data;
+	while (atomic_fetch_add(&cnt, 1) < LOOP)
+	{
+		struct qnode node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+		threadsafeq_append(q, &node);
+	}
+	return (0);
+}
+
+/* A whole source with a partly drained head is relinked at once, with its buffers. */
+static int
+relink_test(void)
+{
+	struct threadsafeq		*dst;
+	struct threadsafeq		*src;
+	struct threadsafeq_memstats	st;
+	struct qnode			node;
+	size_t				i;
+
+	dst = threadsafeq_new(64);
+	src = threadsafeq_new(64);
+	i = 0;
+	while (i++ < LOOP2)
+	{
+		node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = (void *)(uintptr_t)i};
+		threadsafeq_append(src, &node);
+	}
+	i = 0;
+	while (i++ < 10)
+		threadsafeq_remove(src, &node);
+	if (threadsafeq_splice(dst, src) != LOOP2 - 10 || threadsafeq_size(src) || threadsafeq_size(dst) != LOOP2 - 10)
+		return (-1);
+	threadsafeq_memory_stats(src, &st);
+	if (st.nof_chunk)
+		return (-1);
+	threadsafeq_memory_stats(dst, &st);
+	if (st.nof_chunk != (LOOP2 + 63) / 64)
+		return (-1);
+	i = 10;
+	while (i++ < LOOP2)
+		if (threadsafeq_remove(dst, &node) || node.data != (void *)(uintptr_t)i)
+			return (-1);
+	threadsafeq_delete(src);
+	threadsafeq_delete(dst);
+	return (0);
+}
+
+/* A backlog moved to a ring smaller than it comes out in order, a ringful at a time. */
+static int
+order_test(void)
+{
+	struct threadsafeq	*dst;
+	struct threadsafeq	*src;
+	struct qnode		node;
+	size_t			i;
+
+	dst = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_RING, .buff_sz = 16});
+	src = threadsafeq_new(64);
+	i = 0;
+	while (i++ < 100)
+	{
+		node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = (void *)(uintptr_t)i};
+		threadsafeq_append(src, &node);
+	}
+	i = 0;
+	while (i < 100)
+	{
+		if (threadsafeq_splice(dst, src) != (100 - i < 16 ? 100 - i : 16))
+			return (-1);
+		while (!threadsafeq_remove(dst, &node))
+			if (node.data != (void *)(uintptr_t)++i)
+				return (-1);
+	}
+	if (threadsafeq_size(src))
+		return (-1);
+	threadsafeq_delete(src);
+	threadsafeq_delete(dst);
+	return (0);
+}
+
+int
+main()
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	struct threadsafeq	*qa;
+	struct threadsafeq	*qr;
+	struct threadsafeq	*qf;
+	struct workerp		*pf;
+	struct threadsafeq_memstats	st;
+	struct threadsafeq_memstats	stf;
+	struct qnode		node;
+	size_t			i;
+
+	if (order_test())
+	{
+		fprintf(stderr, "Error: splicing into a full ring reordered the backlog\n");
+		return (1);
+	}
+	if (relink_test())
+	{
+		fprintf(stderr, "Error: relinking a whole queue\n");
+		return (1);
+	}
+	q = threadsafeq_new(BSZ);
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	/* Backlog of a pool that is going away: the producers fill `qa`, nobody consumes it. */
+	qa = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHARDED, .buff_sz = BSZ, .lanes = 4});
+	qr = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_RING, .buff_sz = RSZ});
+	node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+	i = 0;
+	while (i++ < RSZ)
+		threadsafeq_append(qr, &node);
+	i = 0;
+	while (i < WSZ)
+	{
+		node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = qa};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || threadsafeq_size(qa))
+		threadsafeq_splice_n(q, qa, 777);
+	threadsafeq_splice(q, qa);
+	if (threadsafeq_splice(q, qr) != RSZ || threadsafeq_size(qr))
+	{
+		fprintf(stderr, "Error: ring was not drained\n");
+		return (1);
+	}
+	/* A FLATCOMB source with consumers of its own: the splices race the combiner for its nodes. */
+	qf = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_FLATCOMB, .buff_sz = BSZ});
+	pf = workerp_new(qf, WSZ);
+	atomic_store(&cnt, 0);
+	i = 0;
+	while (i < WSZ)
+	{
+		node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = qf};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || threadsafeq_size(qf))
+	{
+		if (threadsafeq_size(qf) > LOOP)
+		{
+			fprintf(stderr, "Error: flat combining queue size is %zu\n", threadsafeq_size(qf));
+			return (1);
+		}
+		threadsafeq_splice_n(q, qf, 777);
+	}
+	while (!workerp_is_idle(pf, 100) || !workerp_is_idle(p, 100))
+		;
+	/* Relinked buffers are accounted to the queue holding them. */
+	threadsafeq_trim(qa);
+	threadsafeq_trim(qf);
+	threadsafeq_memory_stats(qa, &st);
+	threadsafeq_memory_stats(qf, &stf);
+	if (st.nof_chunk || stf.nof_chunk)
+	{
+		fprintf(stderr, "Error: drained sources hold %zu and %zu buffers\n", st.nof_chunk, stf.nof_chunk);
+		return (1);
+	}
+	workerp_delete(pf);
+	threadsafeq_delete(qf);
+	threadsafeq_delete(qa);
+	threadsafeq_delete(qr);
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	if (atomic_load(&inc) != 2 * LOOP + RSZ || atomic_load(&erc))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	return (0);
+}
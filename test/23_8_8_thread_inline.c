@@ -0,0 +1,154 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DATA	"Lorem ipsum"
+#define LOOP	4000000
+#define LOOP2	1000
+
+#define BSZ 1024
+#define WSZ 8
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int cln = 0;
+_Atomic int cnt = 0;
+
+/* Variable length payload: a length, then that many bytes of DATA. */
+int
+func(void *data)
+{
+	size_t	len;
+
+	if (!data || (uintptr_t)data % _Alignof (max_align_t))
+		return (-1);
+	len = *(size_t *)data;
+	if (len > sizeof (DATA) || memcmp(DATA, (char *)data + sizeof (size_t), len))
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	/* The payload must still be intact when the cleanup runs. */
+	if (*(size_t *)data > sizeof (DATA))
+		atomic_fetch_add(&erc, 1);
+	atomic_fetch_add(&cln, 1);
+}
+
+static int
+put(struct threadsafeq *q, size_t len)
+{
+	char	*slot;
+
+	slot = threadsafeq_reserve_slot(q, sizeof (size_t) + len);
+	if (!slot)
+		return (-1);
+	*(size_t *)(void *)slot = len;
+	memcpy(slot + sizeof (size_t), DATA, len);
+	return (threadsafeq_commit_slot(q, slot, &(struct qnode){.func = func, .err = error, .cleanup = cleanup}));
+}
+
+int
+func2(void *data)
+{
+	struct threadsafeq	*q;
+	int			i;
+
+	q = (struct threadsafeq *)data;
+	while ((i = atomic_fetch_add(&cnt, 1)) < LOOP)
+	{
+		while (put(q, (size_t)i % sizeof (DATA)))
+			atomic_fetch_add(&erc, 1);
+	}
+	return (0);
+}
+
+/* Reservations that are dropped or too large, and tasks left in a deleted queue. */
+static int
+edge_test(void)
+{
+	struct threadsafeq	*q;
+	void			*slot;
+	int			i;
+
+	q = threadsafeq_new(BSZ);
+	slot = threadsafeq_reserve_slot(q, 8);
+	threadsafeq_delete(q);
+	if (slot || threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_RING, .inline_sz = 32}))
+		return (-1);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHARDED, .lanes = 2, .buff_sz = 4,
+		.inline_sz = 32, .compact = 1});
+	if (!q || threadsafeq_reserve_slot(q, 4 * 64))
+		return (-1);
+	slot = threadsafeq_reserve_slot(q, 16);
+	if (!slot || threadsafeq_commit_slot(q, slot, NULL) || threadsafeq_size(q))
+		return (-1);
+	i = 0;
+	while (i < LOOP2)
+		if (put(q, (size_t)i++ % sizeof (DATA)))
+			return (-1);
+	if (threadsafeq_size(q) != LOOP2)
+		return (-1);
+	threadsafeq_delete(q);
+	return (atomic_load(&cln) == LOOP2 ? 0 : -1);
+}
+
+int
+main()
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	size_t			i;
+
+	if (edge_test())
+	{
+		fprintf(stderr, "Error: edge cases, cln = %d\n", atomic_load(&cln));
+		return (1);
+	}
+	atomic_store(&cln, 0);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = BSZ,
+		.inline_sz = sizeof (size_t) + sizeof (DATA)});
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = q};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	if (atomic_load(&inc) != LOOP || atomic_load(&cln) != LOOP || atomic_load(&erc))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, cln = %d, erc = %d\n", LOOP, atomic_load(&inc),
+			atomic_load(&cln), atomic_load(&erc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	return (0);
+}
@@ -0,0 +1,217 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define DATA	"Lorem ipsum"
+#define LOOP	10000000
+#define LOOP2	4000000
+
+#define BSZ 1024
+#define WSZ 8
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int cnt = 0;
+
+int
+func(void *data)
+{
+	char	buf[4096];
+
+	/* Touch the arena stack well below the top. */
+	memset(buf, 0, sizeof (buf));
+	if (!data || strcmp(DATA, (char *)data) || buf[sizeof (buf) - 1])
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	(void)data;
+}
+
+int
+func2(void *data)
+{
+	struct workerp		*p;
+
+	p = (struct workerp *)data;
+	while (atomic_fetch_add(&cnt, 1) < LOOP)
+	{
+		struct qnode node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+		workerp_append(p, &node);
+	}
+	return (0);
+}
+
+/* Pages of address space of the process. */
+static long
+vm_pages(void)
+{
+	FILE	*f;
+	long	n;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return (-1);
+	if (fscanf(f, "%ld", &n) != 1)
+		n = -1;
+	fclose(f);
+	return (n);
+}
+
+/*
+ * Queues of 80 buffer sizes, filled, drained and deleted round after round:
+ * freed buffers are reused for their size class, so the arena stops growing
+ * after the first round.
+ */
+static int
+reuse_test(void)
+{
+	struct threadsafeq	*q;
+	struct qnode		node;
+	long			vm;
+	int			r;
+	int			i;
+	int			k;
+
+	node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+	vm = -1;
+	r = 0;
+	while (r < 20)
+	{
+		if (r == 1)
+			vm = vm_pages();
+		i = 0;
+		while (i < 80)
+		{
+			q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = 100 + 8 * i,
+				.arena = THREADSAFEQ_ARENA_CHUNKS});
+			k = 0;
+			while (k++ < 1000)
+				threadsafeq_append_quiet(q, &node);
+			while (!threadsafeq_remove(q, &node))
+				;
+			threadsafeq_delete(q);
+			++i;
+		}
+		++r;
+	}
+	return (vm >= 0 && vm_pages() == vm ? 0 : -1);
+}
+
+/*
+ * dTLB load misses of the calling thread while LOOP2 nodes are queued and
+ * drained again. Returns -1 if the counter is not available.
+ */
+static long long
+tlb_misses(int arena)
+{
+	struct perf_event_attr	pe;
+	struct threadsafeq	*q;
+	struct qnode		node;
+	long long		n;
+	int			fd;
+	int			i;
+
+	memset(&pe, 0, sizeof (pe));
+	pe.type = PERF_TYPE_HW_CACHE;
+	pe.size = sizeof (pe);
+	pe.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	fd = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+	if (fd < 0)
+		return (-1);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = BSZ, .arena = arena});
+	node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	i = 0;
+	while (i++ < LOOP2)
+		threadsafeq_append_quiet(q, &node);
+	while (!threadsafeq_remove(q, &node))
+		qnode_exec(&node);
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &n, sizeof (n)) != sizeof (n))
+		n = -1;
+	close(fd);
+	threadsafeq_delete(q);
+	return (n);
+}
+
+int
+main()
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	long long		base;
+	long long		huge;
+	size_t			i;
+
+	if (threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_RING, .arena = THREADSAFEQ_ARENA_CHUNKS}))
+	{
+		fprintf(stderr, "Error: arena buffers accepted on a ring\n");
+		return (1);
+	}
+	if (reuse_test())
+	{
+		fprintf(stderr, "Error: the arena kept growing for buffers it had freed\n");
+		return (1);
+	}
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = BSZ,
+		.arena = THREADSAFEQ_ARENA_CHUNKS | THREADSAFEQ_ARENA_STACKS});
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = p};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	if (atomic_load(&inc) != LOOP || atomic_load(&erc))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	base = tlb_misses(0);
+	huge = tlb_misses(THREADSAFEQ_ARENA_CHUNKS);
+	if (base < 0 || huge < 0)
+	{
+		fprintf(stdout, "LOG: dTLB load misses not measured, perf events unavailable\n");
+		return (2);
+	}
+	fprintf(stdout, "LOG: dTLB load misses for %d nodes: malloc %lld, arena %lld\n", LOOP2, base, huge);
+	return (0);
+}
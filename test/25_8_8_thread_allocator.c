@@ -0,0 +1,168 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DATA	"Lorem ipsum"
+#define LOOP	1000000
+#define LOOP2	1000
+
+#define BSZ 1024
+#define WSZ 8
+#define HDR 64
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int cnt = 0;
+
+struct arena
+{
+	_Atomic long	live;
+	_Atomic long	total;
+	_Atomic long	bad;
+};
+
+/* Each block records its size and alignment in front, free must pass the same. */
+static void *
+test_alloc(void *ctx, size_t size, size_t align)
+{
+	struct arena	*a;
+	char		*p;
+
+	a = ctx;
+	if (!align || (align & (align - 1)) || align > HDR)
+		atomic_fetch_add(&a->bad, 1);
+	p = aligned_alloc(HDR, HDR + (size + HDR - 1) / HDR * HDR);
+	if (!p)
+		return (NULL);
+	((size_t *)(void *)p)[0] = size;
+	((size_t *)(void *)p)[1] = align;
+	atomic_fetch_add(&a->live, 1);
+	atomic_fetch_add(&a->total, 1);
+	return (p + HDR);
+}
+
+static void
+test_free(void *ctx, void *ptr, size_t size, size_t align)
+{
+	struct arena	*a;
+	char		*p;
+
+	a = ctx;
+	p = (char *)ptr - HDR;
+	if (((size_t *)(void *)p)[0] != size || ((size_t *)(void *)p)[1] != align)
+		atomic_fetch_add(&a->bad, 1);
+	atomic_fetch_sub(&a->live, 1);
+	free(p);
+}
+
+int
+func(void *data)
+{
+	if (!data || strcmp(DATA, (char *)data))
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	(void)data;
+}
+
+int
+func2(void *data)
+{
+	struct workerp		*p;
+
+	p = (struct workerp *)data;
+	while (atomic_fetch_add(&cnt, 1) < LOOP)
+	{
+		struct qnode node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+		while (workerp_append_buffered(p, &node))
+			usleep(10);
+	}
+	workerp_flush(p);
+	return (0);
+}
+
+/* One producer pool feeding one pool of `type`, everything allocated through `a`. */
+static int
+run(int type, struct arena *ar)
+{
+	struct qops_allocator	a;
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	struct qbuff		*b;
+	size_t			i;
+
+	a = (struct qops_allocator){.alloc = test_alloc, .free = test_free, .ctx = ar};
+	atomic_store(&inc, 0);
+	atomic_store(&cnt, 0);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = type, .buff_sz = type == THREADSAFEQ_RING
+		|| type == THREADSAFEQ_SPSC ? 65536 : BSZ, .lanes = 4, .allocator = &a});
+	p = workerp_new_alloc(q, WSZ, WORKERP_SCHED_OTHER, 0, &a);
+	q2 = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = BSZ, .allocator = &a});
+	/* A single producer keeps the SPSC contract. */
+	p2 = workerp_new_alloc(q2, type == THREADSAFEQ_SPSC ? 1 : WSZ, WORKERP_SCHED_OTHER, 0, &a);
+	if (!q || !p || !q2 || !p2)
+		return (-1);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = p};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	b = qbuff_new_alloc(LOOP2, func, error, cleanup, &a);
+	if (!b)
+		return (-1);
+	qbuff_delete(b);
+	return (atomic_load(&inc) == LOOP ? 0 : -1);
+}
+
+int
+main()
+{
+	struct arena	arv[THREADSAFEQ_FLATCOMB + 1];
+	int		type;
+
+	type = THREADSAFEQ_LIST;
+	while (type <= THREADSAFEQ_FLATCOMB)
+	{
+		arv[type] = (struct arena){0};
+		/* Nothing is left to free once the queue is gone, LFLIST segments retired to other threads included. */
+		if (run(type, arv + type) || atomic_load(&erc) || atomic_load(&arv[type].bad) || atomic_load(&arv[type].live))
+		{
+			fprintf(stderr, "Error: type = %d, inc = %d, erc = %d, live = %ld, bad = %ld\n", type, atomic_load(&inc),
+				atomic_load(&erc), atomic_load(&arv[type].live), atomic_load(&arv[type].bad));
+			return (1);
+		}
+		fprintf(stdout, "LOG: type = %d, allocations = %ld\n", type, atomic_load(&arv[type].total));
+		++type;
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	return (0);
+}
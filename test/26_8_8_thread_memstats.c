@@ -0,0 +1,176 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DATA	"Lorem ipsum"
+#define LOOP	4000000
+#define LOOP2	200000
+
+#define BSZ 1024
+#define WSZ 8
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int cnt = 0;
+
+/* Live bytes handed out, to compare with what the queue reports. */
+_Atomic long live = 0;
+
+static void *
+test_alloc(void *ctx, size_t size, size_t align)
+{
+	void	*p;
+
+	(void)ctx;
+	p = aligned_alloc(align, (size + align - 1) / align * align);
+	if (p)
+		atomic_fetch_add(&live, (long)size);
+	return (p);
+}
+
+static void
+test_free(void *ctx, void *ptr, size_t size, size_t align)
+{
+	(void)ctx;
+	(void)align;
+	atomic_fetch_sub(&live, (long)size);
+	free(ptr);
+}
+
+int
+func(void *data)
+{
+	if (!data || strcmp(DATA, (char *)data))
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	(void)data;
+}
+
+int
+func2(void *data)
+{
+	struct workerp		*p;
+
+	p = (struct workerp *)data;
+	while (atomic_fetch_add(&cnt, 1) < LOOP)
+	{
+		struct qnode node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+		while (workerp_append_buffered(p, &node))
+			usleep(10);
+	}
+	workerp_flush(p);
+	return (0);
+}
+
+/* A burst fills a queue, draining and trimming it must give the memory back. */
+static int
+burst_test(int type)
+{
+	struct qops_allocator		a;
+	struct threadsafeq_memstats	st;
+	struct threadsafeq_memstats	st2;
+	struct threadsafeq		*q;
+	struct qnode			node;
+	size_t				peak;
+	int				i;
+
+	a = (struct qops_allocator){.alloc = test_alloc, .free = test_free};
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = type, .buff_sz = 64, .lanes = 4, .allocator = &a});
+	if (!q || threadsafeq_memory_stats(q, &st) || st.bytes_allocated != (size_t)atomic_load(&live) || st.bytes_in_use)
+		return (-1);
+	node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+	i = 0;
+	while (i++ < LOOP2)
+		threadsafeq_append_quiet(q, &node);
+	threadsafeq_memory_stats(q, &st);
+	if (st.bytes_allocated != (size_t)atomic_load(&live) || st.bytes_in_use < LOOP2 * sizeof (struct qnode)
+		|| st.bytes_in_use > st.bytes_allocated || st.peak_bytes != st.bytes_allocated || st.nof_chunk < LOOP2 / 64)
+		return (-1);
+	peak = st.peak_bytes;
+	while (!threadsafeq_remove(q, &node))
+		qnode_exec(&node);
+	threadsafeq_trim(q);
+	threadsafeq_memory_stats(q, &st2);
+	fprintf(stdout, "LOG: type = %d, burst %zu bytes in %zu buffers, after trim %zu bytes in %zu buffers, peak %zu\n",
+		type, st.bytes_allocated, st.nof_chunk, st2.bytes_allocated, st2.nof_chunk, st2.peak_bytes);
+	if (st2.bytes_allocated != (size_t)atomic_load(&live) || st2.bytes_in_use || st2.bytes_cached
+		|| st2.peak_bytes != peak || st2.bytes_allocated * 100 > peak || threadsafeq_trim(q))
+		return (-1);
+	threadsafeq_delete(q);
+	return (atomic_load(&live) ? -1 : 0);
+}
+
+int
+main()
+{
+	struct workerp_memstats	st;
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	size_t			i;
+
+	if (burst_test(THREADSAFEQ_LIST) || burst_test(THREADSAFEQ_SHARDED) || burst_test(THREADSAFEQ_FLATCOMB))
+	{
+		fprintf(stderr, "Error: burst, live = %ld\n", atomic_load(&live));
+		return (1);
+	}
+	atomic_store(&inc, 0);
+	q = threadsafeq_new(BSZ);
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = p};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+	{
+		/* Trimming races with the workers and producers. */
+		threadsafeq_trim(q);
+		workerp_memory_stats(p, &st);
+	}
+	if (workerp_memory_stats(p, &st) || st.nof_worker != WSZ || st.nof_stage != WSZ || st.staged
+		|| st.queue.bytes_in_use || st.queue.peak_bytes < st.queue.bytes_allocated)
+	{
+		fprintf(stderr, "Error: pool stats, workers = %zu, stages = %zu, staged = %zu\n", st.nof_worker,
+			st.nof_stage, st.staged);
+		return (1);
+	}
+	fprintf(stdout, "LOG: pool %zu bytes, %zu stages, queue %zu bytes, peak %zu\n", st.bytes_allocated,
+		st.nof_stage, st.queue.bytes_allocated, st.queue.peak_bytes);
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	if (atomic_load(&inc) != LOOP || atomic_load(&erc))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	return (0);
+}
@@ -0,0 +1,312 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DATA	"Lorem ipsum"
+#define LOOP	4000000
+#define LOOP2	1000000
+#define DEPTH	4096
+#define BAD	1000	/* Every BAD-th payload fails to decode. */
+
+#define BSZ 1024
+#define WSZ 8
+
+_Atomic int erc = 0;
+_Atomic int esp = 0;
+_Atomic int inc = 0;
+_Atomic int cnt = 0;
+_Atomic long live = 0;
+int bad = 0;
+
+struct task
+{
+	size_t	seq;
+	char	str[sizeof (DATA)];
+};
+
+static struct task *
+task_new(size_t seq)
+{
+	struct task	*t;
+
+	t = malloc(sizeof (*t));
+	if (!t)
+		return (NULL);
+	t->seq = seq;
+	memcpy(t->str, DATA, sizeof (DATA));
+	atomic_fetch_add(&live, 1);
+	return (t);
+}
+
+static size_t
+encode(const void *data, void *buf, size_t len)
+{
+	if (len >= sizeof (struct task))
+		memcpy(buf, data, sizeof (struct task));
+	return (sizeof (struct task));
+}
+
+static int
+decode(const void *buf, size_t len, void **data)
+{
+	struct task	*t;
+
+	if (len != sizeof (struct task))
+		return (-1);
+	t = task_new(((const struct task *)buf)->seq);
+	if (!t || (bad && t->seq % BAD == BAD - 1))
+	{
+		free(t);
+		if (t)
+			atomic_fetch_sub(&live, 1);
+		return (-1);
+	}
+	*data = t;
+	return (0);
+}
+
+int
+func(void *data)
+{
+	if (!data || strcmp(DATA, ((struct task *)data)->str))
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	if (!data && errorcode == THREADSAFEQ_ESPILL)
+		atomic_fetch_add(&esp, 1);
+	else
+		atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	free(data);
+	atomic_fetch_sub(&live, 1);
+}
+
+/* Tasks without a codec, kept in memory. */
+int
+func_mem(void *data)
+{
+	(void)data;
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+int
+func2(void *data)
+{
+	struct workerp		*p;
+	int			i;
+
+	p = (struct workerp *)data;
+	while ((i = atomic_fetch_add(&cnt, 1)) < LOOP)
+	{
+		struct qnode node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = task_new((size_t)i)};
+		workerp_append(p, &node);
+	}
+	return (0);
+}
+
+/*
+ * One producer, one consumer: serializable tasks come back in order, the
+ * in-memory part stays small and payloads that fail to decode are reported.
+ */
+static int
+order_test(void)
+{
+	struct threadsafeq_memstats	st;
+	struct threadsafeq		*q;
+	struct qnode			node;
+	size_t				spilled;
+	size_t				next;
+	size_t				i;
+
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = 256, .spill_dir = "/tmp",
+		.spill_depth = DEPTH});
+	if (!q)
+		return (-1);
+	i = 0;
+	while (i < LOOP2)
+	{
+		node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = task_new(i)};
+		if (threadsafeq_append_quiet(q, &node))
+			return (-1);
+		/* Now and then a task without codec. */
+		if (++i % 100000 == 0 && threadsafeq_append_quiet(q, &(struct qnode){.func = func_mem}))
+			return (-1);
+	}
+	threadsafeq_memory_stats(q, &st);
+	spilled = st.spilled;
+	if (threadsafeq_size(q) != LOOP2 + LOOP2 / 100000 || spilled < LOOP2 - 2 * DEPTH)
+		return (-1);
+	next = 0;
+	while (!threadsafeq_remove(q, &node))
+	{
+		if (node.func == func)
+		{
+			if (((struct task *)node.data)->seq < next)
+				return (-1);
+			next = ((struct task *)node.data)->seq + 1;
+		}
+		qnode_exec(&node);
+	}
+	threadsafeq_memory_stats(q, &st);
+	fprintf(stdout, "LOG: %zu of %d tasks spilled, peak %zu bytes in memory\n", spilled, LOOP2, st.peak_bytes);
+	if (atomic_load(&inc) + atomic_load(&esp) != LOOP2 + LOOP2 / 100000 || !atomic_load(&esp) || threadsafeq_size(q) || st.spilled || st.peak_bytes > (size_t)DEPTH * 4 * sizeof (struct qnode))
+		return (-1);
+	threadsafeq_delete(q);
+	return (0);
+}
+
+/* Spilled tasks left in a deleted queue are decoded and cleaned up. */
+static int
+delete_test(void)
+{
+	struct threadsafeq	*q;
+	struct qnode		node;
+	size_t			i;
+
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHARDED, .lanes = 2, .spill_dir = "/tmp",
+		.spill_depth = 16, .compact = 1});
+	if (!q || threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_RING, .spill_dir = "/tmp"})
+		|| threadsafeq_new_attr(&(struct threadsafeq_attr){.spill_dir = "/tmp", .inline_sz = 16}))
+		return (-1);
+	i = 0;
+	while (i < LOOP2 / 10)
+	{
+		node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = task_new(i++)};
+		if (threadsafeq_append_quiet(q, &node))
+			return (-1);
+	}
+	threadsafeq_delete(q);
+	return (atomic_load(&live) ? -1 : 0);
+}
+
+/*
+ * Clearing the codec of a class stops its spilling, the tasks spilled
+ * before are still decoded. Dropped tasks give their room back.
+ */
+static int
+codec_test(const struct qclass_codec *codec, int cls)
+{
+	struct threadsafeq	*q;
+	struct qnode		node;
+	size_t			i;
+	int			round;
+
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .spill_dir = "/tmp", .spill_depth = 4});
+	if (!q)
+		return (-1);
+	i = 0;
+	while (i < 16)
+	{
+		node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = task_new(i++)};
+		if (threadsafeq_append_quiet(q, &node))
+			return (-1);
+	}
+	qclass_set_codec(cls, NULL);
+	while (!threadsafeq_remove(q, &node))
+		qnode_exec(&node);
+	qclass_set_codec(cls, codec);
+	threadsafeq_delete(q);
+	if (atomic_load(&inc) != 16)
+		return (-1);
+	/* Every spilled payload fails to decode, the queue must take 16 tasks again. */
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .spill_dir = "/tmp", .spill_depth = 4,
+		.capacity = 16, .full_policy = THREADSAFEQ_FULL_FAIL});
+	if (!q)
+		return (-1);
+	round = 0;
+	while (round++ < 2)
+	{
+		i = 0;
+		while (i < 16)
+		{
+			node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = task_new(i++ * BAD + BAD - 1)};
+			if (threadsafeq_append_quiet(q, &node))
+			{
+				cleanup(node.data);
+				return (-1);
+			}
+		}
+		while (!threadsafeq_remove(q, &node))
+			qnode_exec(&node);
+	}
+	threadsafeq_delete(q);
+	return (atomic_load(&esp) == 2 * 12 && atomic_load(&inc) == 16 + 2 * 4 ? 0 : -1);
+}
+
+int
+main()
+{
+	static const struct qclass_codec	codec = {.encode = encode, .decode = decode};
+	struct threadsafeq			*q;
+	struct workerp				*p;
+	struct threadsafeq			*q2;
+	struct workerp				*p2;
+	size_t					i;
+
+	if (qclass_set_codec(qclass_register(func, error, cleanup), &codec) || !qclass_set_codec(QCLASS_MAX, &codec))
+		return (1);
+	bad = 1;
+	if (codec_test(&codec, qclass_register(func, error, cleanup)) || atomic_load(&erc) || atomic_load(&live))
+	{
+		fprintf(stderr, "Error: codec, inc = %d, esp = %d, erc = %d, live = %ld\n", atomic_load(&inc), atomic_load(&esp),
+			atomic_load(&erc), atomic_load(&live));
+		return (1);
+	}
+	atomic_store(&inc, 0);
+	atomic_store(&esp, 0);
+	if (order_test() || atomic_load(&erc) || atomic_load(&live))
+	{
+		fprintf(stderr, "Error: order, esp = %d, erc = %d, live = %ld\n", atomic_load(&esp), atomic_load(&erc),
+			atomic_load(&live));
+		return (1);
+	}
+	bad = 0;
+	if (delete_test())
+	{
+		fprintf(stderr, "Error: delete, live = %ld\n", atomic_load(&live));
+		return (1);
+	}
+	atomic_store(&inc, 0);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = BSZ, .spill_dir = "/tmp",
+		.spill_depth = DEPTH});
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = p};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	if (atomic_load(&inc) != LOOP || atomic_load(&erc) || atomic_load(&live))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, erc = %d, live = %ld\n", LOOP, atomic_load(&inc),
+			atomic_load(&erc), atomic_load(&live));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	return (0);
+}
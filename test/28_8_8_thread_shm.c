@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DATA	"Lorem ipsum"
+#define LOOP	4000000
+#define SLOW	100
+
+#define BSZ 1024
+#define WSZ 8
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int cln = 0;
+
+struct payload
+{
+	size_t	seq;
+	char	str[sizeof (DATA)];
+};
+
+int
+func(void *data)
+{
+	struct payload	*p;
+
+	p = data;
+	if (!p || (uintptr_t)p % _Alignof (max_align_t) || strcmp(DATA, p->str) || p->seq >= LOOP)
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+/* Tasks passed as a data word: the word is the sequence number. */
+int
+func_word(void *data)
+{
+	if ((uintptr_t)data >= LOOP)
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	/* The payload is still in the segment. */
+	if (strcmp(DATA, ((struct payload *)data)->str))
+		atomic_fetch_add(&erc, 1);
+	atomic_fetch_add(&cln, 1);
+}
+
+/* A producer process: attaches to the segment and appends its share. */
+static int
+producer(int fd, size_t id)
+{
+	struct threadsafeq	*q;
+	struct payload		*p;
+	size_t			i;
+
+	q = threadsafeq_shm_attach(fd);
+	if (!q)
+		return (1);
+	i = id;
+	while (i < LOOP)
+	{
+		if (i % 2)
+		{
+			while (threadsafeq_append(q, &(struct qnode){.func = func_word, .err = error, .data = (void *)(uintptr_t)i}))
+				sched_yield();
+		}
+		else
+		{
+			while (!(p = threadsafeq_reserve_slot(q, sizeof (*p))))
+				sched_yield();
+			p->seq = i;
+			memcpy(p->str, DATA, sizeof (DATA));
+			if (threadsafeq_commit_slot(q, p, &(struct qnode){.func = func, .err = error, .cleanup = cleanup}))
+				return (1);
+		}
+		i += WSZ;
+	}
+	threadsafeq_delete(q);
+	return (0);
+}
+
+/* Appends one by one to a drained ring, so every task has to wake a parked worker. */
+static int
+slow_producer(int fd)
+{
+	struct threadsafeq	*q;
+	size_t			i;
+
+	q = threadsafeq_shm_attach(fd);
+	if (!q)
+		return (1);
+	i = 0;
+	while (i < SLOW)
+	{
+		usleep(500);
+		if (threadsafeq_append(q, &(struct qnode){.func = func_word, .err = error, .data = (void *)(uintptr_t)i++}))
+			return (1);
+	}
+	threadsafeq_delete(q);
+	return (0);
+}
+
+static int
+edge_test(struct threadsafeq *q)
+{
+	struct threadsafeq	*q2;
+	void			*slot;
+	void			*map;
+	int			fd;
+
+	if (threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHM, .capacity = 10})
+		|| threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHM, .compact = 1})
+		|| threadsafeq_reserve_slot(q, 4096) || threadsafeq_shm_fd(NULL) != -1)
+		return (-1);
+	fd = memfd_create("test", 0);
+	if (fd < 0 || ftruncate(fd, 4096) || threadsafeq_shm_attach(fd))
+		return (-1);
+	close(fd);
+	/* A cancelled reservation is skipped by the consumers. */
+	q2 = threadsafeq_shm_attach(threadsafeq_shm_fd(q));
+	slot = threadsafeq_reserve_slot(q2, 16);
+	if (!slot || threadsafeq_commit_slot(q2, slot, NULL) || threadsafeq_size(q) != 1
+		|| threadsafeq_remove(q, &(struct qnode){0}) != -1 || threadsafeq_size(q))
+		return (-1);
+	/* So is a commit of the wrong slot. */
+	slot = threadsafeq_reserve_slot(q2, 16);
+	if (!slot || threadsafeq_commit_slot(q2, (char *)slot + 16, &(struct qnode){.func = func_word}) != -1
+		|| threadsafeq_size(q) != 1 || threadsafeq_remove(q, &(struct qnode){0}) != -1 || threadsafeq_size(q))
+		return (-1);
+	/* Classes registered after the segment was created do not cross it. */
+	if (qclass_register(func_word, NULL, NULL) < 0 || threadsafeq_append(q2, &(struct qnode){.func = func_word}) != -1
+		|| threadsafeq_size(q))
+		return (-1);
+	threadsafeq_delete(q2);
+	/* A segment whose ring does not fit is refused. */
+	q2 = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHM, .buff_sz = 4});
+	map = q2 ? mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, threadsafeq_shm_fd(q2), 0) : MAP_FAILED;
+	if (map == MAP_FAILED)
+		return (-1);
+	/* The head starts with the magic, then the mask. */
+	((size_t *)map)[1] = 1024 - 1;
+	if (threadsafeq_shm_attach(threadsafeq_shm_fd(q2)))
+		return (-1);
+	((size_t *)map)[1] = 5;
+	if (threadsafeq_shm_attach(threadsafeq_shm_fd(q2)))
+		return (-1);
+	munmap(map, 4096);
+	threadsafeq_delete(q2);
+	return (0);
+}
+
+int
+main()
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	pid_t			pidv[WSZ];
+	size_t			i;
+	int			status;
+	int			fail;
+
+	if (qclass_register(func, error, cleanup) < 0 || qclass_register(func_word, error, NULL) < 0)
+		return (1);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHM, .buff_sz = BSZ,
+		.inline_sz = sizeof (struct payload)});
+	if (!q || edge_test(q))
+	{
+		fprintf(stderr, "Error: edge cases\n");
+		return (1);
+	}
+	p = workerp_new(q, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		pidv[i] = fork();
+		if (!pidv[i])
+			_exit(producer(threadsafeq_shm_fd(q), i));
+		++i;
+	}
+	fail = 0;
+	i = 0;
+	while (i < WSZ)
+		if (waitpid(pidv[i++], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			fail = 1;
+	while (!workerp_is_idle(p, 100))
+		;
+	pidv[0] = fork();
+	if (!pidv[0])
+		_exit(slow_producer(threadsafeq_shm_fd(q)));
+	if (waitpid(pidv[0], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		fail = 1;
+	while (atomic_load(&inc) != LOOP + SLOW)
+		usleep(1000);
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	if (fail || atomic_load(&inc) != LOOP + SLOW || atomic_load(&cln) != LOOP / 2 || atomic_load(&erc))
+	{
+		fprintf(stderr, "Error: fail = %d, LOOP = %d, inc = %d, cln = %d, erc = %d\n", fail, LOOP,
+			atomic_load(&inc), atomic_load(&cln), atomic_load(&erc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	return (0);
+}
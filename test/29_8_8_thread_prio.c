@@ -0,0 +1,302 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOOP	4000000
+#define LOOP2	1000
+
+#define BSZ 1024
+#define WSZ 8
+#define LVL 4
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int cnt = 0;
+_Atomic int levelv[LVL];
+_Atomic int gate = 1;
+_Atomic int snap = -1;
+
+/* The data of a task is its level plus one. */
+int
+func(void *data)
+{
+	uintptr_t	level;
+
+	level = (uintptr_t)data;
+	if (!level || level > LVL)
+		return (-1);
+	while (!atomic_load(&gate))
+		usleep(100);
+	/* Half way through LOOP2 tasks of level 0, record how far level 1 got. */
+	if (atomic_fetch_add(&levelv[level - 1], 1) + 1 == LOOP2 / 2 && level == 1)
+		atomic_store(&snap, atomic_load(&levelv[1]));
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	(void)data;
+}
+
+int
+func2(void *data)
+{
+	struct workerp		*p;
+	int			i;
+
+	p = (struct workerp *)data;
+	while ((i = atomic_fetch_add(&cnt, 1)) < LOOP)
+	{
+		struct qnode node = (struct qnode){.func = func, .cleanup = cleanup, .err = error,
+			.data = (void *)(uintptr_t)(i % LVL + 1)};
+		workerp_append_prio(p, &node, (size_t)(i % LVL));
+	}
+	return (0);
+}
+
+static int
+put(struct threadsafeq *q, size_t level)
+{
+	return (threadsafeq_append_prio(q, &(struct qnode){.func = func, .cleanup = cleanup, .err = error,
+		.data = (void *)(uintptr_t)(level + 1)}, level));
+}
+
+/* Level of the next task, -1 if the queue is empty. */
+static int
+take(struct threadsafeq *q)
+{
+	struct qnode	node;
+
+	if (threadsafeq_remove(q, &node))
+		return (-1);
+	return ((int)(uintptr_t)node.data - 1);
+}
+
+static int
+strict_test(void)
+{
+	struct threadsafeq	*q;
+	int			last;
+	int			l;
+	int			i;
+
+	if (threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_RING, .levels = 2})
+		|| threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = THREADSAFEQ_PRIO_MAX + 1})
+		|| threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = 2, .inline_sz = 32}))
+		return (-1);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.buff_sz = 4, .levels = LVL});
+	if (!q || !put(q, LVL) || put(q, 0))
+		return (-1);
+	if (take(q) != 0)
+		return (-1);
+	i = 0;
+	while (i < LOOP2)
+		if (put(q, (size_t)(i++ * 7 % LVL)))
+			return (-1);
+	threadsafeq_append(q, &(struct qnode){.func = func, .data = (void *)(uintptr_t)LVL});
+	if (threadsafeq_size(q) != LOOP2 + 1 || threadsafeq_size_level(q, 0) != LOOP2 / LVL
+		|| threadsafeq_size_level(q, LVL - 1) != LOOP2 / LVL + 1 || threadsafeq_size_level(q, LVL))
+		return (-1);
+	last = 0;
+	while ((l = take(q)) >= 0)
+	{
+		if (l < last)
+			return (-1);
+		last = l;
+	}
+	threadsafeq_delete(q);
+	return (last == LVL - 1 ? 0 : -1);
+}
+
+/* Weights 3 and 1: three tasks of level 0 for each task of level 1 while both wait. */
+static int
+weighted_test(void)
+{
+	struct threadsafeq	*q;
+	struct qnode		nodev[8];
+	int			n0;
+	int			i;
+
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = 2, .prio_policy = THREADSAFEQ_PRIO_WEIGHTED,
+		.prio_weights = (const size_t []){3, 1}});
+	if (!q)
+		return (-1);
+	i = 0;
+	while (i < LOOP2)
+		if (put(q, (size_t)(i++ % 2)))
+			return (-1);
+	n0 = 0;
+	i = 0;
+	while (i++ < LOOP2 / 2)
+		n0 += take(q) == 0;
+	if (n0 != LOOP2 / 2 * 3 / 4)
+		return (-1);
+	while (take(q) >= 0)
+		;
+	threadsafeq_delete(q);
+	/* A batch takes no more tasks than the level has credit. */
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = 2, .prio_policy = THREADSAFEQ_PRIO_WEIGHTED,
+		.prio_weights = (const size_t []){3, 1}});
+	if (!q)
+		return (-1);
+	i = 0;
+	while (i < 16)
+		if (put(q, (size_t)(i++ % 2)))
+			return (-1);
+	if (threadsafeq_remove_batch(q, nodev, 8) != 3 || threadsafeq_remove_batch(q, nodev + 3, 8) != 1
+		|| (uintptr_t)nodev[2].data != 1 || (uintptr_t)nodev[3].data != 2)
+		return (-1);
+	while (take(q) >= 0)
+		;
+	threadsafeq_delete(q);
+	return (0);
+}
+
+/* The same weights under a pool, whose workers remove in batches. */
+static int
+weighted_pool_test(void)
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	int			i;
+
+	atomic_store(&gate, 0);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = 2, .prio_policy = THREADSAFEQ_PRIO_WEIGHTED,
+		.prio_weights = (const size_t []){3, 1}});
+	p = workerp_new(q, WSZ);
+	if (!q || !p)
+		return (-1);
+	i = 0;
+	while (i < 2 * LOOP2)
+	{
+		if (workerp_append_prio(p, &(struct qnode){.func = func, .cleanup = cleanup, .err = error,
+			.data = (void *)(uintptr_t)(i % 2 + 1)}, (size_t)(i % 2)))
+			return (-1);
+		++i;
+	}
+	atomic_store(&gate, 1);
+	while (!workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	fprintf(stdout, "LOG: weights 3:1 under a pool, level 1 ran %d tasks while level 0 ran %d\n", atomic_load(&snap),
+		LOOP2 / 2);
+	return (atomic_load(&snap) >= LOOP2 / 10 && atomic_load(&snap) <= LOOP2 / 4 ? 0 : -1);
+}
+
+/* A low level that waited past the aging period goes before a busy high level. */
+static int
+aging_test(void)
+{
+	struct threadsafeq	*q;
+	int			i;
+
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = 2, .prio_aging_usec = 1000});
+	if (!q || put(q, 1) || put(q, 1))
+		return (-1);
+	i = 0;
+	while (i++ < LOOP2)
+		if (put(q, 0))
+			return (-1);
+	usleep(5000);
+	if (take(q) != 1 || take(q) != 0)
+		return (-1);
+	while (take(q) >= 0)
+		;
+	threadsafeq_delete(q);
+	return (0);
+}
+
+/* A full queue drops from the last level first. */
+static int
+drop_test(void)
+{
+	struct threadsafeq	*q;
+
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = 2, .capacity = 4,
+		.full_policy = THREADSAFEQ_FULL_DROP_OLDEST});
+	if (!q || put(q, 0) || put(q, 1) || put(q, 0) || put(q, 1) || put(q, 0))
+		return (-1);
+	if (threadsafeq_size_level(q, 0) != 3 || threadsafeq_size_level(q, 1) != 1)
+		return (-1);
+	while (take(q) >= 0)
+		;
+	threadsafeq_delete(q);
+	return (0);
+}
+
+int
+main()
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	size_t			i;
+
+	if (strict_test() || weighted_test() || aging_test() || drop_test())
+	{
+		fprintf(stderr, "Error: single thread tests\n");
+		return (1);
+	}
+	i = 0;
+	while (i < LVL)
+		atomic_store(&levelv[i++], 0);
+	if (weighted_pool_test())
+	{
+		fprintf(stderr, "Error: weights under a pool, level 1 ran %d of %d\n", atomic_load(&snap), LOOP2 / 2);
+		return (1);
+	}
+	atomic_store(&inc, 0);
+	i = 0;
+	while (i < LVL)
+		atomic_store(&levelv[i++], 0);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = BSZ, .levels = LVL,
+		.prio_policy = THREADSAFEQ_PRIO_WEIGHTED, .prio_aging_usec = 1000});
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = p};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	i = 0;
+	while (i < LVL)
+	{
+		if (atomic_load(&levelv[i]) != LOOP / LVL)
+			atomic_fetch_add(&erc, 1);
+		++i;
+	}
+	if (atomic_load(&inc) != LOOP || atomic_load(&erc))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	return (0);
+}
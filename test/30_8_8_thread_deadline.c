@@ -0,0 +1,178 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DATA	"Lorem ipsum"
+#define LOOP	4000000
+
+#define BSZ 1024
+#define WSZ 8
+
+_Atomic int erc = 0;
+_Atomic int exc = 0;
+_Atomic int inc = 0;
+_Atomic int cln = 0;
+_Atomic int cnt = 0;
+
+int
+func(void *data)
+{
+	if (!data || strcmp(DATA, (char *)data))
+		return (-1);
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	if (errorcode == THREADSAFEQ_EEXPIRED && data && !strcmp(DATA, (char *)data))
+		atomic_fetch_add(&exc, 1);
+	else
+		atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	(void)data;
+	atomic_fetch_add(&cln, 1);
+}
+
+/* Every third task is already expired, every third has a deadline far ahead. */
+int
+func2(void *data)
+{
+	struct workerp		*p;
+	uint64_t		late;
+	int			i;
+
+	p = (struct workerp *)data;
+	late = qnode_deadline(60 * 1000000);
+	while ((i = atomic_fetch_add(&cnt, 1)) < LOOP)
+	{
+		struct qnode node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA,
+			.deadline = i % 3 == 0 ? 1 : i % 3 == 1 ? late : 0};
+		workerp_append(p, &node);
+	}
+	return (0);
+}
+
+/* Deadlines seen by qnode_exec() directly and kept by an inline slot. */
+static int
+exec_test(void)
+{
+	struct threadsafeq	*q;
+	struct qnode		node;
+	char			*slot;
+
+	node = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA, .deadline = qnode_deadline(0)};
+	if (qnode_exec(&node) != THREADSAFEQ_EEXPIRED || atomic_load(&inc) || atomic_load(&exc) != 1 || atomic_load(&cln) != 1)
+		return (-1);
+	node.deadline = qnode_deadline(1000000);
+	if (qnode_exec(&node) || atomic_load(&inc) != 1)
+		return (-1);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .inline_sz = sizeof (DATA)});
+	slot = threadsafeq_reserve_slot(q, sizeof (DATA));
+	if (!slot)
+		return (-1);
+	memcpy(slot, DATA, sizeof (DATA));
+	if (threadsafeq_commit_slot(q, slot, &(struct qnode){.func = func, .cleanup = cleanup, .err = error, .deadline = 1})
+		|| threadsafeq_remove(q, &node) || qnode_exec(&node) != THREADSAFEQ_EEXPIRED)
+		return (-1);
+	threadsafeq_delete(q);
+	return (atomic_load(&exc) == 2 && atomic_load(&cln) == 3 ? 0 : -1);
+}
+
+/* Compact nodes have no room for a deadline: such appends fail and leave the queue as it was. */
+static int
+compact_test(void)
+{
+	struct threadsafeq	*q;
+	struct qnode		nodev[4];
+	struct qnode		node;
+	char			*slot;
+	size_t			i;
+
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .compact = 1});
+	i = 0;
+	while (i < 4)
+	{
+		nodev[i] = (struct qnode){.func = func, .cleanup = cleanup, .err = error, .data = DATA};
+		++i;
+	}
+	nodev[2].deadline = qnode_deadline(1000000);
+	if (!threadsafeq_append(q, nodev + 2) || !threadsafeq_append_key(q, nodev + 2, 1)
+		|| !threadsafeq_append_batch(q, nodev, 4) || threadsafeq_size(q))
+		return (-1);
+	if (threadsafeq_append(q, nodev) || threadsafeq_remove(q, &node) || node.func != func || node.deadline)
+		return (-1);
+	threadsafeq_delete(q);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .compact = 1, .inline_sz = sizeof (DATA)});
+	slot = threadsafeq_reserve_slot(q, sizeof (DATA));
+	if (!slot || !threadsafeq_commit_slot(q, slot, nodev + 2) || threadsafeq_size(q))
+		return (-1);
+	threadsafeq_delete(q);
+	return (0);
+}
+
+int
+main()
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	struct workerp_taskstats	st;
+	size_t			i;
+
+	if (exec_test())
+	{
+		fprintf(stderr, "Error: exec, inc = %d, exc = %d, cln = %d\n", atomic_load(&inc), atomic_load(&exc),
+			atomic_load(&cln));
+		return (1);
+	}
+	if (compact_test())
+	{
+		fprintf(stderr, "Error: compact queue kept a task with a deadline\n");
+		return (1);
+	}
+	atomic_store(&inc, 0);
+	atomic_store(&exc, 0);
+	atomic_store(&cln, 0);
+	q = threadsafeq_new(BSZ);
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = p};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+		;
+	workerp_task_stats(p, &st);
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	if (atomic_load(&exc) != (LOOP + 2) / 3 || atomic_load(&inc) + atomic_load(&exc) != LOOP
+		|| atomic_load(&cln) != LOOP || atomic_load(&erc) || st.expired != (size_t)atomic_load(&exc)
+		|| st.executed != (size_t)atomic_load(&inc))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, exc = %d, cln = %d, erc = %d, executed = %zu, expired = %zu\n",
+			LOOP, atomic_load(&inc), atomic_load(&exc), atomic_load(&cln), atomic_load(&erc), st.executed, st.expired);
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, expired = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&exc),
+		atomic_load(&erc));
+	return (0);
+}
@@ -0,0 +1,256 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOOP	4000000
+#define LOOP2	10000
+#define KEYS	1024
+
+#define BSZ 1024
+#define WSZ 8
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int run = 0;
+_Atomic int cln = 0;
+_Atomic int cnt = 0;
+
+/* An update of `key`, `val` counts the updates folded into it. */
+struct upd
+{
+	int	key;
+	int	val;
+};
+
+int
+func(void *data)
+{
+	if (!data)
+		return (-1);
+	atomic_fetch_add(&inc, ((struct upd *)data)->val);
+	atomic_fetch_add(&run, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	free(data);
+	atomic_fetch_add(&cln, 1);
+}
+
+void *
+sum(void *pending, void *incoming)
+{
+	if (((struct upd *)pending)->key != ((struct upd *)incoming)->key)
+		atomic_fetch_add(&erc, 1);
+	((struct upd *)pending)->val += ((struct upd *)incoming)->val;
+	return (pending);
+}
+
+static struct qnode
+upd(int key, int val)
+{
+	struct upd	*u;
+
+	u = malloc(sizeof (*u));
+	*u = (struct upd){.key = key, .val = val};
+	return ((struct qnode){.func = func, .err = error, .cleanup = cleanup, .data = u});
+}
+
+static int
+put(struct threadsafeq *q, int key, int val)
+{
+	struct qnode	node;
+
+	node = upd(key, val);
+	if (!threadsafeq_append_key(q, &node, (uint64_t)key))
+		return (0);
+	cleanup(node.data);
+	return (-1);
+}
+
+/* Value of the next task for `key`, -1 if the next task has another key. */
+static int
+take(struct threadsafeq *q, int key)
+{
+	struct qnode	node;
+	int		val;
+
+	if (threadsafeq_remove(q, &node))
+		return (-1);
+	val = ((struct upd *)node.data)->key == key ? ((struct upd *)node.data)->val : -1;
+	qnode_exec(&node);
+	return (val);
+}
+
+static int
+edge_test(void)
+{
+	struct threadsafeq	*q;
+	struct qnode		node;
+	int			i;
+
+	if (threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_SHARDED, .keyed = 1})
+		|| threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = 2, .keyed = 1}))
+		return (-1);
+	q = threadsafeq_new(BSZ);
+	node = (struct qnode){.func = func};
+	if (!threadsafeq_append_key(q, &node, 1))
+		return (-1);
+	threadsafeq_delete(q);
+	/* Replace: the latest payload in the place of the first. */
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.buff_sz = 4, .keyed = 1});
+	if (!q || put(q, 1, 1) || put(q, 2, 1) || put(q, 1, 2) || put(q, 3, 1) || put(q, 1, 3) || threadsafeq_size(q) != 3
+		|| atomic_load(&cln) != 2 || take(q, 1) != 3 || put(q, 1, 4) || put(q, 2, 2) || threadsafeq_size(q) != 3
+		|| take(q, 2) != 2 || take(q, 3) != 1 || take(q, 1) != 4 || threadsafeq_size(q))
+		return (-1);
+	/* Growth of the index, with the entries of removed tasks left behind. */
+	i = 0;
+	while (i < 2 * LOOP2)
+		if (put(q, i++ % LOOP2, 1))
+			return (-1);
+	i = 0;
+	while (i < LOOP2 / 2)
+		if (take(q, i++) != 1)
+			return (-1);
+	i = 0;
+	while (i < LOOP2)
+		if (put(q, i++, 1))
+			return (-1);
+	if (threadsafeq_size(q) != LOOP2)
+		return (-1);
+	while (!threadsafeq_remove(q, &node))
+		qnode_exec(&node);
+	threadsafeq_delete(q);
+	/* Merge: one task carrying the sum. */
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.keyed = 1, .coalesce = sum});
+	i = 1;
+	while (i <= 100)
+		if (put(q, 7, i++))
+			return (-1);
+	if (threadsafeq_size(q) != 1 || take(q, 7) != 5050)
+		return (-1);
+	threadsafeq_delete(q);
+	/* Every payload was freed once, run or superseded. */
+	return (atomic_load(&cln) == 7 + 3 * LOOP2 + 100 ? 0 : -1);
+}
+
+size_t
+weigh(const struct qnode *node)
+{
+	return ((size_t)((struct upd *)node->data)->val);
+}
+
+/*
+ * Updating a pending key needs no room: it neither fails nor drops another
+ * task on a full queue, and the load follows the weight of the updated task.
+ */
+static int
+capacity_test(void)
+{
+	struct threadsafeq	*q;
+
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.keyed = 1, .capacity = 10, .weigh = weigh,
+		.full_policy = THREADSAFEQ_FULL_FAIL});
+	if (!q || put(q, 1, 3) || put(q, 2, 7) || put(q, 1, 1) || put(q, 3, 2) || !put(q, 4, 1)
+		|| take(q, 1) != 1 || take(q, 2) != 7 || take(q, 3) != 2 || put(q, 5, 10) || !put(q, 6, 1) || take(q, 5) != 10)
+		return (-1);
+	threadsafeq_delete(q);
+	/* Folded in place by `coalesce`: 3 + 4 leaves room for 3 more. */
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.keyed = 1, .coalesce = sum, .capacity = 10, .weigh = weigh,
+		.full_policy = THREADSAFEQ_FULL_FAIL});
+	if (!q || put(q, 1, 3) || put(q, 1, 4) || put(q, 2, 3) || !put(q, 3, 1) || take(q, 1) != 7 || take(q, 2) != 3
+		|| put(q, 3, 10) || take(q, 3) != 10)
+		return (-1);
+	threadsafeq_delete(q);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.keyed = 1, .capacity = 2,
+		.full_policy = THREADSAFEQ_FULL_DROP_OLDEST});
+	if (!q || put(q, 1, 1) || put(q, 2, 1) || put(q, 1, 5) || threadsafeq_size(q) != 2 || take(q, 1) != 5
+		|| take(q, 2) != 1)
+		return (-1);
+	threadsafeq_delete(q);
+	return (0);
+}
+
+int
+func2(void *data)
+{
+	struct workerp		*p;
+	struct qnode		node;
+	int			i;
+
+	p = (struct workerp *)data;
+	while ((i = atomic_fetch_add(&cnt, 1)) < LOOP)
+	{
+		node = upd(i % KEYS, 1);
+		while (workerp_append_key(p, &node, (uint64_t)(i % KEYS)))
+			atomic_fetch_add(&erc, 1);
+	}
+	return (0);
+}
+
+int
+main()
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	size_t			i;
+
+	if (edge_test())
+	{
+		fprintf(stderr, "Error: edge cases, run = %d, cln = %d\n", atomic_load(&run), atomic_load(&cln));
+		return (1);
+	}
+	if (capacity_test())
+	{
+		fprintf(stderr, "Error: coalescing on a full queue\n");
+		return (1);
+	}
+	atomic_store(&inc, 0);
+	atomic_store(&run, 0);
+	atomic_store(&cln, 0);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = BSZ, .keyed = 1,
+		.coalesce = sum});
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = p};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	/* Every update is counted once, by the task it was folded into; every payload is freed once. */
+	if (atomic_load(&inc) != LOOP || atomic_load(&cln) != LOOP || atomic_load(&erc))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, cln = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&cln),
+			atomic_load(&erc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d updates ran as %d tasks, erc = %d\n", LOOP, atomic_load(&run), atomic_load(&erc));
+	return (0);
+}
@@ -0,0 +1,234 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOOP	1000000
+#define LOOP2	2000
+#define LOOP3	1000
+
+#define BSZ 1024
+#define WSZ 8
+#define TNT 4
+#define QUOTA	20000
+#define PERIOD	100000
+#define QUANTUM	1000
+
+_Atomic int erc = 0;
+_Atomic int inc = 0;
+_Atomic int cnt = 0;
+_Atomic int donev[TNT];
+_Atomic long snap = -1;
+_Atomic long snap_cpu = -1;
+_Atomic long snap_wall = -1;
+long start_wall = 0;
+_Atomic int burn = 0;
+_Atomic int gate = 0;
+struct threadsafeq	*fq;
+
+static long
+wall_usec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static long
+cpu_usec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * The data of a task is its tenant plus one. Waits for the gate, then spins
+ * `burn` microseconds of CPU; the last task of tenant 0 records how far tenant 1 got,
+ * and when.
+ */
+int
+func(void *data)
+{
+	uintptr_t	t;
+	long		end;
+
+	t = (uintptr_t)data;
+	if (!t || t > TNT)
+		return (-1);
+	while (!atomic_load(&gate))
+		usleep(100);
+	end = cpu_usec() + atomic_load(&burn);
+	while (cpu_usec() < end)
+		;
+	if (atomic_fetch_add(&donev[t - 1], 1) + 1 == (t == 1 ? atomic_load(&cnt) : -1))
+	{
+		atomic_store(&snap, atomic_load(&donev[1]));
+		atomic_store(&snap_cpu, (long)threadsafeq_level_cpu_usec(fq, 1));
+		atomic_store(&snap_wall, wall_usec() - start_wall);
+	}
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+
+void
+error(void *data, int errorcode)
+{
+	(void)data;
+	(void)errorcode;
+	atomic_fetch_add(&erc, 1);
+}
+
+void
+cleanup(void *data)
+{
+	(void)data;
+}
+
+int
+func2(void *data)
+{
+	struct workerp		*p;
+	int			i;
+
+	p = (struct workerp *)data;
+	while ((i = atomic_fetch_add(&cnt, 1)) < LOOP)
+	{
+		struct qnode node = (struct qnode){.func = func, .cleanup = cleanup, .err = error,
+			.data = (void *)(uintptr_t)(i % TNT + 1)};
+		while (workerp_append_prio(p, &node, (size_t)(i % TNT)))
+			atomic_fetch_add(&erc, 1);
+	}
+	return (0);
+}
+
+static void
+reset(void)
+{
+	int	i;
+
+	atomic_store(&inc, 0);
+	atomic_store(&snap, -1);
+	atomic_store(&snap_cpu, -1);
+	atomic_store(&snap_wall, -1);
+	i = 0;
+	while (i < TNT)
+		atomic_store(&donev[i++], 0);
+}
+
+/* Two tenants with `n` tasks each, run to the end. */
+static int
+run(const struct threadsafeq_attr *attr, int n)
+{
+	struct workerp	*p;
+	int		i;
+
+	reset();
+	atomic_store(&gate, 0);
+	atomic_store(&cnt, n);
+	fq = threadsafeq_new_attr(attr);
+	p = workerp_new(fq, WSZ);
+	if (!fq || !p)
+		return (-1);
+	i = 0;
+	while (i < 2 * n)
+	{
+		if (workerp_append_prio(p, &(struct qnode){.func = func, .cleanup = cleanup, .err = error,
+			.data = (void *)(uintptr_t)(i % 2 + 1)}, (size_t)(i % 2)))
+			return (-1);
+		++i;
+	}
+	start_wall = wall_usec();
+	atomic_store(&gate, 1);
+	while (!workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(fq);
+	return (atomic_load(&inc) == 2 * n ? 0 : -1);
+}
+
+int
+main()
+{
+	struct threadsafeq	*q;
+	struct workerp		*p;
+	struct threadsafeq	*q2;
+	struct workerp		*p2;
+	size_t			i;
+
+	if (threadsafeq_new_attr(&(struct threadsafeq_attr){.levels = 2, .prio_quota_usec = (const size_t []){1, 1}}))
+	{
+		fprintf(stderr, "Error: quota accepted without THREADSAFEQ_PRIO_FAIR\n");
+		return (1);
+	}
+	/* Weights 3 and 1: tenant 1 gets about a quarter of the CPU while tenant 0 waits. */
+	atomic_store(&burn, 50);
+	if (run(&(struct threadsafeq_attr){.levels = 2, .prio_policy = THREADSAFEQ_PRIO_FAIR,
+		.prio_weights = (const size_t []){3, 1}, .prio_quantum_usec = 200}, LOOP2) || atomic_load(&snap) < LOOP2 / 5 || atomic_load(&snap) > LOOP2 / 2)
+	{
+		fprintf(stderr, "Error: weights, inc = %d, tenant 1 ran %ld of %d\n", atomic_load(&inc), atomic_load(&snap), LOOP2);
+		return (1);
+	}
+	fprintf(stdout, "LOG: weights 3:1, tenant 1 ran %ld tasks while tenant 0 ran %d\n", atomic_load(&snap), LOOP2);
+	/*
+	 * Tenant 1 may use 20ms of CPU per 100ms, tenant 0 has no limit. Periods are wall
+	 * clock time, which a loaded machine stretches against CPU time: the bound is, for
+	 * every period begun before tenant 0 finished, the quota plus a batch of a quantum
+	 * per worker, picked before the quota was seen used up. Unlimited, tenant 1 would
+	 * match tenant 0.
+	 */
+	atomic_store(&burn, 200);
+	if (run(&(struct threadsafeq_attr){.levels = 2, .prio_policy = THREADSAFEQ_PRIO_FAIR,
+		.prio_quota_usec = (const size_t []){0, QUOTA}, .prio_period_usec = PERIOD, .prio_quantum_usec = QUANTUM}, LOOP3)
+		|| atomic_load(&snap_cpu) < 0
+		|| atomic_load(&snap_cpu) > (QUOTA + WSZ * QUANTUM) * (atomic_load(&snap_wall) / PERIOD + 1))
+	{
+		fprintf(stderr, "Error: quota, inc = %d, tenant 1 used %ld usec in %ld usec\n", atomic_load(&inc),
+			atomic_load(&snap_cpu), atomic_load(&snap_wall));
+		return (1);
+	}
+	fprintf(stdout, "LOG: quota, tenant 1 used %ld usec in %ld usec while tenant 0 used %d\n", atomic_load(&snap_cpu),
+		atomic_load(&snap_wall), LOOP3 * 200);
+	atomic_store(&burn, 0);
+	atomic_store(&gate, 1);
+	reset();
+	atomic_store(&cnt, 0);
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = THREADSAFEQ_LIST, .buff_sz = BSZ, .levels = TNT,
+		.prio_policy = THREADSAFEQ_PRIO_FAIR});
+	fq = q;
+	p = workerp_new(q, WSZ);
+	q2 = threadsafeq_new(BSZ);
+	p2 = workerp_new(q2, WSZ);
+	i = 0;
+	while (i < WSZ)
+	{
+		struct qnode node = (struct qnode){.func = func2, .cleanup = NULL, .err = NULL, .data = p};
+		workerp_append(p2, &node);
+		i++;
+	}
+	while (!workerp_is_idle(p2, 100) || !workerp_is_idle(p, 100))
+		;
+	workerp_delete(p);
+	threadsafeq_delete(q);
+	workerp_delete(p2);
+	threadsafeq_delete(q2);
+	i = 0;
+	while (i < TNT)
+		if (atomic_load(&donev[i++]) != LOOP / TNT)
+			atomic_fetch_add(&erc, 1);
+	if (atomic_load(&inc) != LOOP || atomic_load(&erc))
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, inc = %d, erc = %d\n", LOOP, atomic_load(&inc), atomic_load(&erc));
+	return (0);
+}
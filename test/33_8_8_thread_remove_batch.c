@@ -0,0 +1,108 @@
+#include <stddef.h>
+#include <qops.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOOP	100000
+#define CAP	40
+#define BATCH	7
+
+#define BSZ 64
+
+_Atomic int inc = 0;
+
+int
+func(void *data)
+{
+	(void)data;
+	atomic_fetch_add(&inc, 1);
+	return (0);
+}
+
+static int
+append(struct threadsafeq *q, size_t seq)
+{
+	struct qnode	node;
+
+	node = (struct qnode){.func = func, .data = (void *)(uintptr_t)(seq + 1)};
+	return (threadsafeq_append(q, &node));
+}
+
+/*
+ * Keeps CAP tasks queued and takes them BATCH at a time: batches come back
+ * in order, the last one of a drain is partial, an empty queue gives 0 and
+ * every batch frees the capacity of its tasks.
+ */
+static int
+batch_test(int type)
+{
+	struct threadsafeq	*q;
+	struct qnode		nodev[BATCH];
+	size_t			head;
+	size_t			tail;
+	size_t			m;
+	size_t			i;
+	int			bound;
+
+	bound = type != THREADSAFEQ_SHM;
+	q = threadsafeq_new_attr(&(struct threadsafeq_attr){.type = type, .buff_sz = BSZ, .capacity = bound ? CAP : 0,
+		.full_policy = THREADSAFEQ_FULL_FAIL});
+	if (!q || threadsafeq_remove_batch(q, nodev, BATCH))
+		return (-1);
+	head = 0;
+	tail = 0;
+	while (tail < CAP)
+		if (append(q, tail++))
+			return (-1);
+	while (head < LOOP)
+	{
+		if (bound && tail - head == CAP && !append(q, tail))
+			return (-1);
+		m = threadsafeq_remove_batch(q, nodev, BATCH);
+		if (m != (tail - head < BATCH ? tail - head : BATCH))
+			return (-1);
+		i = 0;
+		while (i < m)
+			if (nodev[i].data != (void *)(uintptr_t)++head || qnode_exec(nodev + i++))
+				return (-1);
+		while (tail < LOOP && tail - head < CAP)
+			if (append(q, tail++))
+				return (-1);
+	}
+	if (threadsafeq_remove_batch(q, nodev, BATCH) || threadsafeq_size(q))
+		return (-1);
+	threadsafeq_delete(q);
+	return (0);
+}
+
+int
+main()
+{
+	static const char	*namev[] = {"LIST", "RING", "LFLIST", "SPSC", "SHARDED", "FLATCOMB", "SHM"};
+	int			type;
+
+	if (qclass_register(func, NULL, NULL) < 0)
+		return (1);
+	type = THREADSAFEQ_LIST;
+	while (type <= THREADSAFEQ_SHM)
+	{
+		if (batch_test(type))
+		{
+			fprintf(stderr, "Error: remove_batch on %s\n", namev[type]);
+			return (1);
+		}
+		++type;
+	}
+	if (atomic_load(&inc) != LOOP * type)
+	{
+		fprintf(stderr, "Error: LOOP = %d, inc = %d\n", LOOP, atomic_load(&inc));
+		return (1);
+	}
+	fprintf(stdout, "LOG: LOOP = %d, batches of %d on %d backends, inc = %d\n", LOOP, BATCH, type,
+		atomic_load(&inc));
+	return (0);
+}